@@ -0,0 +1,4 @@
+-- A new connection for each transaction (run_pgbench.sh passes -C):
+-- latency is connecting, loading postpic and a first decode
+\set id random(1, 30)
+SELECT colorspace(img), width(thumbnail(img, 64)) FROM bench_images WHERE id = :id;
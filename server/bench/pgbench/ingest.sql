@@ -0,0 +1,3 @@
+-- Decoding images on the way in, from their bytea form
+\set id random(1, 30)
+INSERT INTO bench_images ( img ) SELECT image_from_bytea(data) FROM bench_src WHERE id = :id;
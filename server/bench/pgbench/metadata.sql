@@ -0,0 +1,4 @@
+-- Header-only access: no image is detoasted whole or decoded
+\set id random(1, 30)
+SELECT count(*) FROM bench_images WHERE width(img) > 1000 AND format(img) = 'JPEG';
+SELECT width(img), height(img), date(img), data_length(img) FROM bench_images WHERE id = :id;
@@ -0,0 +1,21 @@
+-- Corpus for the pgbench scripts: synthetic JPEG images of three sizes
+-- in bench_src (as bytea, for ingest) and bench_images
+DROP TABLE IF EXISTS bench_src, bench_images;
+CREATE TABLE bench_src ( id INT PRIMARY KEY, data bytea );
+CREATE TABLE bench_images ( id SERIAL PRIMARY KEY, img image );
+
+INSERT INTO bench_src
+	SELECT i, data_range(img, 0, data_length(img)) FROM (
+		SELECT i, draw_rect(image_new(w, h, c1), box(point(w / 4, h / 4), point(w * 3 / 4, h * 3 / 4)), c2) AS img
+		FROM (SELECT i,
+				CASE i % 3 WHEN 0 THEN 320 WHEN 1 THEN 1280 ELSE 4000 END AS w,
+				CASE i % 3 WHEN 0 THEN 240 WHEN 1 THEN 960 ELSE 3000 END AS h,
+				('#' || lpad(to_hex(i::bigint * 2654435761 % 16777216), 6, '0'))::color AS c1,
+				('#' || lpad(to_hex((i + 1)::bigint * 2654435761 % 16777216), 6, '0'))::color AS c2
+			FROM generate_series(1, 30) i) s
+	) t;
+
+INSERT INTO bench_images ( id, img ) SELECT id, image_from_bytea(data) FROM bench_src;
+SELECT setval('bench_images_id_seq', 30);
+VACUUM ANALYZE bench_src;
+VACUUM ANALYZE bench_images;
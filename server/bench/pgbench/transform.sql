@@ -0,0 +1,4 @@
+-- Decoding, processing and encoding
+\set id random(1, 30)
+SELECT data_length(thumbnail(img, 128)) FROM bench_images WHERE id = :id;
+SELECT data_length(resize(img, 640, 480, 'lanczos')) FROM bench_images WHERE id = :id;
@@ -0,0 +1,549 @@
+/*********************************************************************
+ PostPic - An image-enabling extension for PostgreSql
+ (C) Copyright 2010 Domenico Rotiroti
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, version 3 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ A copy of the GNU Lesser General Public License is included in the
+ source distribution of this software.
+
+ pp_bench:
+ Times the GraphicsMagick calls PostPic is made of, and its own
+ kernels, on a corpus of synthetic images generated in memory
+
+*********************************************************************/
+
+#include "../src/pp_kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <magick/api.h>
+
+#define THUMB_SIZE	128
+#define HIST_BINS	16
+#define MIN_ITERS	3
+
+typedef struct {
+	const char * name;
+	int w, h;
+} PPBenchSize;
+
+static const PPBenchSize sizes[] = {
+	{ "small", 320, 240 },
+	{ "medium", 1280, 960 },
+	{ "large", 4000, 3000 },
+	{ NULL, 0, 0 }
+};
+
+/* formats GM can't write are skipped */
+static const char * formats[] = { "JPEG", "PNG", "WEBP", NULL };
+
+typedef struct {
+	const char * format;
+	int w, h;
+	unsigned char * blob;		/* the encoded image */
+	size_t blen;
+	Image * gimg;				/* decoded */
+	unsigned char * rgba;		/* decoded, 8 bit RGBA */
+	unsigned char * out;		/* scratch, as large as any result */
+	char * hex;
+	char * b64;
+	size_t b64len;
+} PPBenchImage;
+
+typedef struct {
+	const char * name;
+	int (*run)(PPBenchImage * bi);
+	int jpeg_only;
+} PPBenchOp;
+
+/* results end up here, so that nothing is optimized away */
+static volatile size_t sink;
+
+static int	op_ping(PPBenchImage * bi);
+static int	op_header(PPBenchImage * bi);
+static int	op_decode(PPBenchImage * bi);
+static int	op_decode_hint(PPBenchImage * bi);
+static int	op_thumbnail(PPBenchImage * bi);
+static int	op_resize_gm(PPBenchImage * bi);
+static int	op_resize_kernel(PPBenchImage * bi);
+static int	op_encode(PPBenchImage * bi);
+static int	op_optimize(PPBenchImage * bi);
+static int	op_hex_out(PPBenchImage * bi);
+static int	op_hex_in(PPBenchImage * bi);
+static int	op_base64_out(PPBenchImage * bi);
+static int	op_base64_in(PPBenchImage * bi);
+static int	op_stats(PPBenchImage * bi);
+static int	op_histogram(PPBenchImage * bi);
+
+static const PPBenchOp ops[] = {
+	{ "ping", op_ping, 0 },
+	{ "header", op_header, 1 },
+	{ "decode", op_decode, 0 },
+	{ "decode_hint", op_decode_hint, 0 },
+	{ "thumbnail", op_thumbnail, 0 },
+	{ "resize_gm", op_resize_gm, 0 },
+	{ "resize_kernel", op_resize_kernel, 0 },
+	{ "encode", op_encode, 0 },
+	{ "optimize", op_optimize, 1 },
+	{ "hex_out", op_hex_out, 0 },
+	{ "hex_in", op_hex_in, 0 },
+	{ "base64_out", op_base64_out, 0 },
+	{ "base64_in", op_base64_in, 0 },
+	{ "stats", op_stats, 0 },
+	{ "histogram", op_histogram, 0 },
+	{ NULL, NULL, 0 }
+};
+
+static double	now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int	cmp_double(const void * a, const void * b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double	percentile(const double * sorted, int n, double p)
+{
+	int i = (int) ceil(p / 100.0 * n) - 1;
+	return sorted[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+}
+
+static long	peak_rss_kb(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+/*
+ * Smooth gradients, ripples and a little noise, so that
+ * encoders see something closer to a photo than a flat fill.
+ * The noise is seeded: the corpus is the same on every run.
+ */
+static void	synth_pixels(unsigned char * px, int w, int h)
+{
+	unsigned int seed = 2463534242u;
+	int x, y, n;
+
+	for(y = 0; y < h; ++y) {
+		for(x = 0; x < w; ++x, px += 3) {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			n = (int) (seed & 15) - 8;
+			px[0] = (unsigned char) fmax(0, fmin(255, x * 255.0 / w + n));
+			px[1] = (unsigned char) fmax(0, fmin(255, 128 + 100 * sin(x * 0.031) * cos(y * 0.047) + n));
+			px[2] = (unsigned char) fmax(0, fmin(255, y * 255.0 / h + n));
+		}
+	}
+}
+
+static int	image_setup(PPBenchImage * bi, const char * format, int w, int h)
+{
+	ExceptionInfo ex;
+	ImageInfo * iinfo;
+	Image * src;
+	unsigned char * px;
+	const char * bad;
+
+	memset(bi, 0, sizeof(PPBenchImage));
+	bi->format = format;
+	bi->w = w;
+	bi->h = h;
+	px = malloc((size_t) w * h * 3);
+	if(!px) return -1;
+	synth_pixels(px, w, h);
+
+	GetExceptionInfo(&ex);
+	src = ConstituteImage(w, h, "RGB", CharPixel, px, &ex);
+	free(px);
+	if(!src) {
+		DestroyExceptionInfo(&ex);
+		return -1;
+	}
+	iinfo = CloneImageInfo(NULL);
+	strncpy(iinfo->magick, format, MaxTextExtent - 1);
+	strncpy(src->magick, format, MaxTextExtent - 1);
+	iinfo->quality = 85;
+	bi->blob = ImageToBlob(iinfo, src, &bi->blen, &ex);
+	DestroyImage(src);
+	DestroyImageInfo(iinfo);
+	if(!bi->blob || !bi->blen) {
+		DestroyExceptionInfo(&ex);
+		return -1;
+	}
+
+	/* decoded forms, and the text forms of the encoded one */
+	iinfo = CloneImageInfo(NULL);
+	bi->gimg = BlobToImage(iinfo, bi->blob, bi->blen, &ex);
+	DestroyImageInfo(iinfo);
+	DestroyExceptionInfo(&ex);
+	if(!bi->gimg) return -1;
+	bi->rgba = malloc((size_t) w * h * 4);
+	bi->out = malloc((size_t) w * h * 4 + bi->blen * 2 + 16);
+	bi->hex = malloc(bi->blen * 2);
+	bi->b64 = malloc((bi->blen + 2) / 3 * 4);
+	if(!bi->rgba || !bi->out || !bi->hex || !bi->b64) return -1;
+	GetExceptionInfo(&ex);
+	DispatchImage(bi->gimg, 0, 0, w, h, "RGBA", CharPixel, bi->rgba, &ex);
+	DestroyExceptionInfo(&ex);
+	pp_hex_encode(bi->blob, bi->blen, bi->hex);
+	pp_base64_encode(bi->blob, bi->blen, bi->b64);
+	bi->b64len = (bi->blen + 2) / 3 * 4;
+	/* make sure the decoders accept what the encoders wrote */
+	if(pp_hex_decode(bi->hex, bi->blen * 2, bi->out, &bad) != (long) bi->blen) return -1;
+	return 0;
+}
+
+static void	image_cleanup(PPBenchImage * bi)
+{
+	if(bi->gimg) DestroyImage(bi->gimg);
+	if(bi->blob) MagickFree(bi->blob);
+	free(bi->rgba);
+	free(bi->out);
+	free(bi->hex);
+	free(bi->b64);
+}
+
+static Image *	decode(PPBenchImage * bi, int w, int h)
+{
+	ExceptionInfo ex;
+	ImageInfo * iinfo;
+	Image * res;
+	char size[32];
+
+	GetExceptionInfo(&ex);
+	iinfo = CloneImageInfo(NULL);
+	if(w > 0 && h > 0) {
+		snprintf(size, sizeof(size), "%dx%d", w, h);
+		CloneString(&iinfo->size, size);
+	}
+	res = BlobToImage(iinfo, bi->blob, bi->blen, &ex);
+	DestroyImageInfo(iinfo);
+	DestroyExceptionInfo(&ex);
+	return res;
+}
+
+static int	thumb_size(PPBenchImage * bi, int * w, int * h)
+{
+	if(bi->w > bi->h) {
+		*w = THUMB_SIZE;
+		*h = bi->h * THUMB_SIZE / bi->w;
+	} else {
+		*h = THUMB_SIZE;
+		*w = bi->w * THUMB_SIZE / bi->h;
+	}
+	return 0;
+}
+
+static int	op_ping(PPBenchImage * bi)
+{
+	ExceptionInfo ex;
+	ImageInfo * iinfo = CloneImageInfo(NULL);
+	Image * res;
+
+	GetExceptionInfo(&ex);
+	res = PingBlob(iinfo, bi->blob, bi->blen, &ex);
+	DestroyImageInfo(iinfo);
+	DestroyExceptionInfo(&ex);
+	if(!res) return -1;
+	sink += res->columns;
+	DestroyImage(res);
+	return 0;
+}
+
+static int	op_header(PPBenchImage * bi)
+{
+	int w, h, ncomp;
+
+	if(pp_jpeg_dimensions(bi->blob, bi->blen, &w, &h, &ncomp)) return -1;
+	sink += w;
+	return 0;
+}
+
+static int	op_decode(PPBenchImage * bi)
+{
+	Image * res = decode(bi, 0, 0);
+
+	if(!res) return -1;
+	sink += res->columns;
+	DestroyImage(res);
+	return 0;
+}
+
+static int	op_decode_hint(PPBenchImage * bi)
+{
+	Image * res;
+	int w, h;
+
+	thumb_size(bi, &w, &h);
+	res = decode(bi, w, h);
+	if(!res) return -1;
+	sink += res->columns;
+	DestroyImage(res);
+	return 0;
+}
+
+/* what thumbnail() does: scaled decode, resize and encode */
+static int	op_thumbnail(PPBenchImage * bi)
+{
+	ExceptionInfo ex;
+	ImageInfo * iinfo;
+	Image * gimg, * timg;
+	void * blob;
+	size_t blen = 0;
+	int w, h;
+
+	thumb_size(bi, &w, &h);
+	gimg = decode(bi, w, h);
+	if(!gimg) return -1;
+	GetExceptionInfo(&ex);
+	timg = ThumbnailImage(gimg, w, h, &ex);
+	DestroyImage(gimg);
+	if(!timg) {
+		DestroyExceptionInfo(&ex);
+		return -1;
+	}
+	iinfo = CloneImageInfo(NULL);
+	strncpy(timg->magick, bi->format, MaxTextExtent - 1);
+	blob = ImageToBlob(iinfo, timg, &blen, &ex);
+	DestroyImageInfo(iinfo);
+	DestroyImage(timg);
+	DestroyExceptionInfo(&ex);
+	if(!blob) return -1;
+	sink += blen;
+	MagickFree(blob);
+	return 0;
+}
+
+static int	op_resize_gm(PPBenchImage * bi)
+{
+	ExceptionInfo ex;
+	Image * res;
+
+	GetExceptionInfo(&ex);
+	res = ResizeImage(bi->gimg, bi->w / 2, bi->h / 2, LanczosFilter, 1.0, &ex);
+	DestroyExceptionInfo(&ex);
+	if(!res) return -1;
+	sink += res->columns;
+	DestroyImage(res);
+	return 0;
+}
+
+static int	op_resize_kernel(PPBenchImage * bi)
+{
+	if(pp_resample_rgba8(bi->rgba, bi->w, bi->h, bi->out, bi->w / 2, bi->h / 2, PP_FILTER_LANCZOS))
+		return -1;
+	sink += bi->out[0];
+	return 0;
+}
+
+static int	op_encode(PPBenchImage * bi)
+{
+	ExceptionInfo ex;
+	ImageInfo * iinfo = CloneImageInfo(NULL);
+	void * blob;
+	size_t blen = 0;
+
+	GetExceptionInfo(&ex);
+	strncpy(bi->gimg->magick, bi->format, MaxTextExtent - 1);
+	blob = ImageToBlob(iinfo, bi->gimg, &blen, &ex);
+	DestroyImageInfo(iinfo);
+	DestroyExceptionInfo(&ex);
+	if(!blob) return -1;
+	sink += blen;
+	MagickFree(blob);
+	return 0;
+}
+
+static int	op_optimize(PPBenchImage * bi)
+{
+	unsigned char * res;
+	size_t len = pp_jpeg_optimize(bi->blob, bi->blen, 0, 0, &res);
+
+	if(!len) return -1;
+	sink += len;
+	free(res);
+	return 0;
+}
+
+static int	op_hex_out(PPBenchImage * bi)
+{
+	pp_hex_encode(bi->blob, bi->blen, (char *) bi->out);
+	sink += bi->out[0];
+	return 0;
+}
+
+static int	op_hex_in(PPBenchImage * bi)
+{
+	const char * bad;
+	long n = pp_hex_decode(bi->hex, bi->blen * 2, bi->out, &bad);
+
+	sink += n;
+	return n < 0 ? -1 : 0;
+}
+
+static int	op_base64_out(PPBenchImage * bi)
+{
+	pp_base64_encode(bi->blob, bi->blen, (char *) bi->out);
+	sink += bi->out[0];
+	return 0;
+}
+
+static int	op_base64_in(PPBenchImage * bi)
+{
+	long n = pp_base64_decode(bi->b64, bi->b64len, bi->out);
+
+	sink += n;
+	return n < 0 ? -1 : 0;
+}
+
+static int	op_stats(PPBenchImage * bi)
+{
+	PPPixelStats st;
+
+	pp_pixel_stats(bi->rgba, (size_t) bi->w * bi->h, &st);
+	sink += st.sum[0];
+	return 0;
+}
+
+static int	op_histogram(PPBenchImage * bi)
+{
+	unsigned int hist[3 * HIST_BINS];
+
+	if(pp_histogram(bi->rgba, (size_t) bi->w * bi->h, HIST_BINS, hist)) return -1;
+	sink += hist[0];
+	return 0;
+}
+
+/*
+ * Runs op for at least seconds (and MIN_ITERS times), then
+ * prints throughput and latency percentiles
+ */
+static int	run_op(const PPBenchOp * op, PPBenchImage * bi, double seconds, int csv)
+{
+	double * lat = NULL, * tmp, start, t0, total;
+	int n = 0, size = 0;
+
+	start = now_ms();
+	do {
+		if(n == size) {
+			size = size ? size * 2 : 64;
+			tmp = realloc(lat, size * sizeof(double));
+			if(!tmp) break;
+			lat = tmp;
+		}
+		t0 = now_ms();
+		if(op->run(bi)) {
+			fprintf(stderr, "%s failed on %dx%d %s\n", op->name, bi->w, bi->h, bi->format);
+			free(lat);
+			return -1;
+		}
+		lat[n++] = now_ms() - t0;
+	} while(n < MIN_ITERS || now_ms() - start < seconds * 1000);
+	total = now_ms() - start;
+
+	qsort(lat, n, sizeof(double), cmp_double);
+	printf(csv ? "%dx%d,%s,%s,%d,%.1f,%.3f,%.3f,%.3f\n"
+		: "%5dx%-5d %-5s %-14s %7d %10.1f %9.3f %9.3f %9.3f\n",
+		bi->w, bi->h, bi->format, op->name, n, n * 1000.0 / total,
+		percentile(lat, n, 50), percentile(lat, n, 95), percentile(lat, n, 99));
+	fflush(stdout);
+	free(lat);
+	return 0;
+}
+
+static void	usage(const char * pname)
+{
+	fprintf(stderr, "Usage: %s [-t seconds] [-s size[,size...]] [-o op[,op...]] [-c]\n"
+		"\t-t seconds\ttime spent on each operation (default 0.5)\n"
+		"\t-s sizes\tamong small (320x240), medium (1280x960) and large (4000x3000)\n"
+		"\t-o ops\t\toperations to run, all by default\n"
+		"\t-c\t\tCSV output\n", pname);
+}
+
+static int	selected(const char * list, const char * name)
+{
+	const char * p = list;
+	size_t len = strlen(name);
+
+	if(!list) return 1;
+	while((p = strstr(p, name))) {
+		if((p == list || p[-1] == ',') && (p[len] == ',' || !p[len])) return 1;
+		p += len;
+	}
+	return 0;
+}
+
+int main(int argc, char ** argv)
+{
+	PPBenchImage bi;
+	const char * sizelist = NULL, * oplist = NULL;
+	double seconds = 0.5;
+	int csv = 0, failed = 0, c, s, f, o;
+
+	while((c = getopt(argc, argv, "t:s:o:ch")) != -1) {
+		switch(c) {
+			case 't':
+				seconds = atof(optarg);
+				break;
+			case 's':
+				sizelist = optarg;
+				break;
+			case 'o':
+				oplist = optarg;
+				break;
+			case 'c':
+				csv = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	InitializeMagick(*argv);
+	printf(csv ? "image,format,op,iters,ops_per_sec,p50_ms,p95_ms,p99_ms\n"
+		: "%-11s %-5s %-14s %7s %10s %9s %9s %9s\n",
+		"image", "fmt", "op", "iters", "ops/s", "p50 ms", "p95 ms", "p99 ms");
+	for(s = 0; sizes[s].name; ++s) {
+		if(!selected(sizelist, sizes[s].name)) continue;
+		for(f = 0; formats[f]; ++f) {
+			if(image_setup(&bi, formats[f], sizes[s].w, sizes[s].h)) {
+				fprintf(stderr, "skipping %s: can't encode or decode it\n", formats[f]);
+				image_cleanup(&bi);
+				continue;
+			}
+			for(o = 0; ops[o].name; ++o) {
+				if(!selected(oplist, ops[o].name)) continue;
+				if(ops[o].jpeg_only && strcmp(formats[f], "JPEG")) continue;
+				if(run_op(&ops[o], &bi, seconds, csv)) failed = 1;
+			}
+			image_cleanup(&bi);
+		}
+	}
+	fprintf(csv ? stderr : stdout, "peak RSS: %ld kB\n", peak_rss_kb());
+	DestroyMagick();
+	return failed;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Runs the pgbench scripts against a database where postpic is
+# installed, reporting throughput, latency percentiles and the peak
+# RSS of the server processes (sampled, so the server must be local).
+# Connection settings come from the usual PG* variables. The connect
+# script opens a connection per transaction: compare its latency with
+# postpic in shared_preload_libraries and without.
+#
+#   ./run_pgbench.sh [clients] [seconds] [script...]
+#
+set -e
+cd "$(dirname "$0")"
+
+CLIENTS=${1:-4}
+DURATION=${2:-30}
+SCRIPTS="metadata transform ingest connect"
+if [ $# -gt 2 ]; then
+	shift 2
+	SCRIPTS="$*"
+fi
+LOGDIR=$(mktemp -d)
+trap 'rm -rf "$LOGDIR"' EXIT
+
+sample_rss() {
+	peak=0
+	while [ -d "$LOGDIR" ] && [ ! -f "$LOGDIR/done" ]; do
+		cur=$(ps -C postgres -o rss= 2>/dev/null | sort -n | tail -1)
+		if [ -n "$cur" ] && [ "$cur" -gt "$peak" ]; then
+			peak=$cur
+			echo $peak > "$1"
+		fi
+		sleep 0.2
+	done
+}
+
+psql -X -q -v ON_ERROR_STOP=1 -f pgbench/setup.sql
+
+for script in $SCRIPTS; do
+	echo "== $script: $CLIENTS clients, ${DURATION}s"
+	CONNECT=
+	if [ "$script" = connect ]; then
+		CONNECT=-C
+	fi
+	rm -f "$LOGDIR/done" "$LOGDIR"/log.*
+	echo 0 > "$LOGDIR/rss"
+	sample_rss "$LOGDIR/rss" &
+	pgbench -n -r $CONNECT -c "$CLIENTS" -j "$CLIENTS" -T "$DURATION" \
+		-l --log-prefix="$LOGDIR/log" -f "pgbench/$script.sql"
+	touch "$LOGDIR/done"
+	wait
+	# the third field of each log line is the latency in microseconds
+	cat "$LOGDIR"/log.* | awk '{ print $3 }' | sort -n | awk '
+		function pct(p,  i) { i = int(NR * p); if(i < NR * p) ++i; return lat[i] / 1000 }
+		{ lat[NR] = $1 }
+		END {
+			if(NR) printf("latency percentiles (ms): p50 %.3f, p95 %.3f, p99 %.3f, max %.3f\n",
+				pct(0.50), pct(0.95), pct(0.99), lat[NR] / 1000)
+		}'
+	echo "peak server process RSS: $(cat "$LOGDIR/rss") kB"
+done
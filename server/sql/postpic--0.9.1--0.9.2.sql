@@ -0,0 +1,318 @@
+/* contrib/postpic/postpic--0.9.1--0.9.2.sql */
+
+-- complain if script is sourced in psql rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION postpic UPDATE" to load this file. \quit
+
+-- Image metadata functions
+CREATE FUNCTION metadata ( image )
+   RETURNS jsonb
+   AS '$libdir/postpic', 'image_metadata'
+   LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION metadata ( image, VARCHAR )
+   RETURNS VARCHAR
+   AS '$libdir/postpic', 'image_metadata_value'
+   LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION format ( image )
+   RETURNS VARCHAR
+   AS '$libdir/postpic', 'image_format'
+   LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION orientation ( image )
+   RETURNS INT
+   AS '$libdir/postpic', 'image_orientation'
+   LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION digest ( image )
+   RETURNS bytea
+   AS '$libdir/postpic', 'image_digest'
+   LANGUAGE C IMMUTABLE STRICT;
+
+-- The encoded image's length, and up to len bytes of it from off
+-- (counting from 0), detoasting just what's needed: e.g. to serve
+-- HTTP range requests
+CREATE FUNCTION data_length ( image )
+	RETURNS INT
+	AS '$libdir/postpic', 'image_data_length'
+	LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION data_range ( img image, off INT, len INT )
+	RETURNS bytea
+	AS '$libdir/postpic', 'image_data_range'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- The JPEG preview embedded in EXIF data, if any, without decoding
+CREATE FUNCTION preview ( image )
+	RETURNS image
+	AS '$libdir/postpic', 'image_preview'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- Stores (or drops, with 0) downscaled renditions within the image
+CREATE FUNCTION pyramid ( image, INT )
+	RETURNS image
+	AS '$libdir/postpic', 'image_pyramid'
+	LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION pyramid_levels ( image )
+	RETURNS INT
+	AS '$libdir/postpic', 'image_pyramid_levels'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- Tiles of an image scaled down by 2^level, e.g. for deep-zoom viewers
+CREATE FUNCTION tiles ( img image, tile_size INT, lvl INT DEFAULT 0 )
+	RETURNS TABLE ( level INT, x INT, y INT, tile image )
+	AS '$libdir/postpic', 'image_tiles'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- Resize with a given filter: cubic (the default), box, triangle, catrom,
+-- mitchell, lanczos, point, hermite, hanning, hamming, blackman, gaussian,
+-- quadratic, bessel or sinc
+CREATE FUNCTION resize ( image, INT, INT, VARCHAR )
+	RETURNS image
+	AS '$libdir/postpic', 'image_resize'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- Draws overlay over img, e.g. a watermark. x and y offset it from the
+-- side or corner named by gravity: northwest, north, northeast, west,
+-- center, east, southwest, south or southeast
+CREATE FUNCTION composite ( img image, overlay image, x INT DEFAULT 0, y INT DEFAULT 0,
+		gravity VARCHAR DEFAULT 'northwest', opacity FLOAT4 DEFAULT 1.0 )
+	RETURNS image
+	AS '$libdir/postpic', 'image_composite'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- Several labels at once, optionally over rectangles, decoding and
+-- encoding the image just once. NULL font, size or colors keep the
+-- defaults of draw_text and draw_rect.
+CREATE FUNCTION draw_texts ( img image, labels VARCHAR[], positions POINT[],
+		font VARCHAR DEFAULT NULL, size INT DEFAULT NULL, fill color DEFAULT NULL,
+		rects BOX[] DEFAULT NULL, rect_fill color DEFAULT NULL )
+	RETURNS image
+	AS '$libdir/postpic', 'image_draw_texts'
+	LANGUAGE C IMMUTABLE;
+
+-- Rectangles, lines, polygons and labels, each with its own color,
+-- drawn all at once. Shapes are filled, or just outlined with
+-- stroke_width when filled is false; lines are always stroked.
+CREATE FUNCTION draw ( img image,
+		rects BOX[] DEFAULT NULL, rect_colors color[] DEFAULT NULL,
+		lines LSEG[] DEFAULT NULL, line_colors color[] DEFAULT NULL,
+		polygons POLYGON[] DEFAULT NULL, polygon_colors color[] DEFAULT NULL,
+		labels VARCHAR[] DEFAULT NULL, positions POINT[] DEFAULT NULL, label_colors color[] DEFAULT NULL,
+		filled BOOL DEFAULT true, stroke_width FLOAT4 DEFAULT 1,
+		font VARCHAR DEFAULT NULL, size INT DEFAULT NULL )
+	RETURNS image
+	AS '$libdir/postpic', 'image_draw'
+	LANGUAGE C IMMUTABLE;
+
+-- Content statistics, computed on a copy reduced to 256 pixels.
+-- histogram returns the fraction of pixels in each of bins (a power
+-- of 2) ranges, as a [3][bins] array for red, green and blue
+CREATE FUNCTION histogram ( image, bins INT DEFAULT 16 )
+	RETURNS FLOAT4[]
+	AS '$libdir/postpic', 'image_histogram'
+	LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION average_color ( image )
+	RETURNS color
+	AS '$libdir/postpic', 'image_average_color'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- The most common colors, most common first
+CREATE FUNCTION dominant_colors ( image, n INT DEFAULT 5 )
+	RETURNS color[]
+	AS '$libdir/postpic', 'image_dominant_colors'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- From 0 (black) to 1 (white)
+CREATE FUNCTION brightness ( image )
+	RETURNS FLOAT4
+	AS '$libdir/postpic', 'image_brightness'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- 0 for grayscale, above 100 for very colorful images
+CREATE FUNCTION colorfulness ( image )
+	RETURNS FLOAT4
+	AS '$libdir/postpic', 'image_colorfulness'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- The image resized to width x height as normalized RGB values,
+-- (pixel / 255 - mean) / std, for machine learning pipelines. layout
+-- is 'chw' (a [3][height][width] array) or 'hwc' ([height][width][3]).
+CREATE FUNCTION tensor ( img image, width INT, height INT, layout VARCHAR DEFAULT 'chw',
+		mean FLOAT4[] DEFAULT NULL, std FLOAT4[] DEFAULT NULL )
+	RETURNS FLOAT4[]
+	AS '$libdir/postpic', 'image_tensor'
+	LANGUAGE C IMMUTABLE;
+
+-- The same values as raw float32, in the server's byte order
+CREATE FUNCTION tensor_bytes ( img image, width INT, height INT, layout VARCHAR DEFAULT 'chw',
+		mean FLOAT4[] DEFAULT NULL, std FLOAT4[] DEFAULT NULL )
+	RETURNS bytea
+	AS '$libdir/postpic', 'image_tensor_bytes'
+	LANGUAGE C IMMUTABLE;
+
+-- Deduplicated storage: encoded images stored once, by digest, for the
+-- image columns a postpic_dedup trigger is set on, e.g.
+--   CREATE TRIGGER photos_dedup BEFORE INSERT OR UPDATE OR DELETE ON photos
+--       FOR EACH ROW EXECUTE PROCEDURE postpic_dedup('photo');
+-- Values then hold the header and the digest; postpic_gc() drops the
+-- images no value in any image column refers to anymore.
+CREATE TABLE postpic_blobs (
+	digest bytea PRIMARY KEY,
+	refs INT NOT NULL DEFAULT 0,
+	data bytea NOT NULL
+);
+ALTER TABLE postpic_blobs ALTER data SET STORAGE EXTERNAL;
+REVOKE ALL ON postpic_blobs FROM PUBLIC;
+
+-- The trigger and the reading of deduplicated values go through these,
+-- running as the extension's owner: the table isn't granted to anyone.
+-- They need the digest of an image, which only its values carry.
+CREATE FUNCTION postpic_blob_slice ( bytea, INT, INT )
+	RETURNS bytea
+	AS $$ SELECT substring(data from $2 for $3) FROM @extschema@.postpic_blobs WHERE digest = $1 $$
+	LANGUAGE SQL STABLE STRICT SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+
+CREATE FUNCTION postpic_blob_ref ( bytea )
+	RETURNS SETOF bytea
+	AS $$ UPDATE @extschema@.postpic_blobs SET refs = refs + 1 WHERE digest = $1 RETURNING digest $$
+	LANGUAGE SQL VOLATILE STRICT SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+
+-- Only if the data is the same too
+CREATE FUNCTION postpic_blob_ref ( bytea, bytea )
+	RETURNS SETOF bytea
+	AS $$ UPDATE @extschema@.postpic_blobs SET refs = refs + 1 WHERE digest = $1 AND data = $2 RETURNING digest $$
+	LANGUAGE SQL VOLATILE STRICT SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+
+-- A concurrent insert of the same image may have beaten us; another
+-- image with the same digest stays there, and nothing is returned
+CREATE FUNCTION postpic_blob_add ( bytea, bytea )
+	RETURNS SETOF bytea
+	AS $$
+BEGIN
+	BEGIN
+		INSERT INTO @extschema@.postpic_blobs (digest, refs, data) VALUES ($1, 1, $2);
+	EXCEPTION WHEN unique_violation THEN
+		UPDATE @extschema@.postpic_blobs SET refs = refs + 1 WHERE digest = $1 AND data = $2;
+		IF NOT FOUND THEN RETURN; END IF;
+	END;
+	RETURN NEXT $1;
+END
+$$	LANGUAGE plpgsql VOLATILE STRICT SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+
+CREATE FUNCTION postpic_blob_unref ( bytea )
+	RETURNS SETOF bytea
+	AS $$ UPDATE @extschema@.postpic_blobs SET refs = refs - 1 WHERE digest = $1 RETURNING digest $$
+	LANGUAGE SQL VOLATILE STRICT SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
+
+CREATE FUNCTION postpic_dedup ( )
+	RETURNS trigger
+	AS '$libdir/postpic'
+	LANGUAGE C;
+
+CREATE FUNCTION postpic_gc ( )
+	RETURNS BIGINT
+	AS '$libdir/postpic'
+	LANGUAGE C STRICT;
+
+-- It reads every table with an image column and blocks writes to them
+-- while it runs: for administrators only
+REVOKE ALL ON FUNCTION postpic_gc ( ) FROM PUBLIC;
+
+CREATE FUNCTION deduplicated ( image )
+	RETURNS BOOL
+	AS '$libdir/postpic', 'image_deduplicated'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- image(max_width, max_height [, format [, quality]])
+CREATE FUNCTION image_typmod_in ( cstring[] )
+	RETURNS INT
+	AS '$libdir/postpic'
+	LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION image_typmod_out ( INT )
+	RETURNS cstring
+	AS '$libdir/postpic'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- ALTER TYPE can only add them from 13 on; before, the catalog
+-- is updated by hand along with the dependencies CREATE TYPE records
+DO $BODY$
+BEGIN
+	IF current_setting('server_version_num')::INT >= 130000 THEN
+		EXECUTE 'ALTER TYPE image SET ( TYPMOD_IN = image_typmod_in, TYPMOD_OUT = image_typmod_out )';
+	ELSE
+		UPDATE pg_catalog.pg_type
+			SET typmodin = 'image_typmod_in'::regproc, typmodout = 'image_typmod_out'::regproc
+			WHERE oid = 'image'::regtype;
+		INSERT INTO pg_catalog.pg_depend
+			SELECT 'pg_type'::regclass, 'image'::regtype, 0, 'pg_proc'::regclass, f, 0, 'n'
+			FROM unnest(ARRAY['image_typmod_in'::regproc, 'image_typmod_out'::regproc]::oid[]) f;
+	END IF;
+END
+$BODY$;
+
+-- Scales down (and converts) images to fit the type modifier
+CREATE FUNCTION image ( image, INT, BOOL )
+	RETURNS image
+	AS '$libdir/postpic', 'image_enforce_typmod'
+	LANGUAGE C IMMUTABLE STRICT;
+
+CREATE CAST ( image AS image ) WITH FUNCTION image ( image, INT, BOOL ) AS IMPLICIT;
+
+-- Statistics by function and internal operation (decode, ping, encode,
+-- detoast, detoast slice, blob fetch), with postpic in
+-- shared_preload_libraries. Times are in milliseconds, the bytes and
+-- pixels of functions are those of the operations they ran.
+CREATE FUNCTION postpic_stats ( OUT dbid oid, OUT funcid oid, OUT operation text,
+		OUT calls BIGINT, OUT total_time FLOAT8, OUT max_time FLOAT8,
+		OUT bytes_in BIGINT, OUT bytes_out BIGINT, OUT pixels BIGINT )
+	RETURNS SETOF record
+	AS '$libdir/postpic'
+	LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION postpic_stats_reset ( )
+	RETURNS void
+	AS '$libdir/postpic'
+	LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION postpic_stats_reset ( ) FROM PUBLIC;
+
+-- The counters are the whole cluster's, while function OIDs only
+-- resolve in their own database: the view shows this database's.
+CREATE VIEW pg_stat_postpic AS
+	SELECT dbid, funcid, COALESCE(operation, funcid::regprocedure::text) AS operation,
+		calls, total_time, max_time, bytes_in, bytes_out, pixels
+	FROM postpic_stats()
+	WHERE dbid = (SELECT oid FROM pg_catalog.pg_database WHERE datname = pg_catalog.current_database());
+
+-- Frames of animations and pages of documents, numbered from 0. Other
+-- functions work on the first one, the only one they decode.
+CREATE FUNCTION page_count ( image )
+	RETURNS INT
+	AS '$libdir/postpic', 'image_page_count'
+	LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION page ( image, INT )
+	RETURNS image
+	AS '$libdir/postpic', 'image_page'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- The same pixels in fewer bytes, when possible: JPEG images get Huffman
+-- tables computed for them (and, with progressive, progressive scans,
+-- slower to decode), PNG ones the strongest deflate. strip drops their
+-- metadata but for color profiles and the EXIF orientation;
+-- metadata() keeps answering.
+CREATE FUNCTION optimize ( img image, strip BOOL DEFAULT false, progressive BOOL DEFAULT false )
+	RETURNS image
+	AS '$libdir/postpic', 'image_optimize'
+	LANGUAGE C IMMUTABLE STRICT;
+
+-- The same, telling the bytes of the encoded image before and after
+CREATE FUNCTION optimize_report ( img image, strip BOOL DEFAULT false, progressive BOOL DEFAULT false,
+		OUT optimized image, OUT bytes_in BIGINT, OUT bytes_out BIGINT )
+	RETURNS record
+	AS '$libdir/postpic', 'image_optimize_report'
+	LANGUAGE C IMMUTABLE STRICT;
@@ -19,6 +19,8 @@
 /* PG-related includes */
 #include <postgres.h>
 #include <fmgr.h>
+#include <funcapi.h>
+#include <miscadmin.h>
 #include <pg_config.h>
 /* -> dates & co */
 #include <utils/datetime.h>
@@ -30,30 +32,105 @@
 #include <storage/fd.h>
 /* --- */
 #include <utils/geo_decls.h>
+#if PG_VERSION_NUM >= 130000
+#include <access/detoast.h>
+#else
+#include <access/tuptoaster.h>
+#endif
 #if PG_VERSION_NUM >= 90000
 #include <utils/bytea.h>
 #endif
 #include <utils/elog.h>
 #include <utils/builtins.h>
 #include <utils/array.h>
+#include <catalog/pg_type.h>
 #include <utils/syscache.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/resowner.h>
+#include <utils/lsyscache.h>
+#include <libpq/pqformat.h>
+#include <executor/spi.h>
+#include <commands/trigger.h>
+/* -> statistics */
+#include <storage/ipc.h>
+#include <storage/shmem.h>
+#include <storage/spin.h>
+#include <storage/lwlock.h>
+#include <portability/instr_time.h>
+#include <utils/hsearch.h>
+#include <catalog/pg_proc.h>
+#include <catalog/pg_language.h>
+#include <catalog/pg_enum.h>
+#include <catalog/pg_extension.h>
+#include <catalog/indexing.h>
+#include <access/genam.h>
+#include <access/xact.h>
+#if PG_VERSION_NUM >= 90300
+#include <access/htup_details.h>
+#endif
+#if PG_VERSION_NUM >= 120000
+#include <access/table.h>
+#endif
+#include <utils/fmgroids.h>
+#include <utils/inval.h>
+#include <utils/rel.h>
+#if PG_VERSION_NUM >= 100000
+#include <common/md5.h>
+#else
+#include <libpq/md5.h>
+#endif
+#include <lib/stringinfo.h>
+#include <mb/pg_wchar.h>
+#if PG_VERSION_NUM >= 90400
+#include <utils/json.h>
+#include <utils/jsonb.h>
+#endif
 /* GM-related includes */
 #include <magick/api.h>
+#include "pp_kernels.h"
 /* Others */
 #include <stdio.h>
 #include <unistd.h>
+#include <math.h>
 #include <arpa/inet.h>
 
 PG_MODULE_MAGIC;
 
 /* 
  * The datatype we use internally for storing
- * image information
+ * image information (format version 1):
+ *
+ *   PPImage | section directory | sections | encoded image | trailing sections
+ *
+ * Optional sections are flagged in flags, and the directory holds
+ * one PPSection per flag set, in bit order. The encoded image starts
+ * at dataoff, with no varlena header of its own, and is datalen
+ * bytes long. Bulky sections trail it, aligned, so that fetching the
+ * header and the leading sections stays cheap; the padding before
+ * them is not part of the image.
+ *
+ * In memory the varlena header is always 4 bytes, as the aligned
+ * fields need. On disk, values short enough (deduplicated ones,
+ * which only hold their header) get 1 byte headers from PostgreSQL
+ * itself, the storage being EXTERNAL rather than PLAIN: every read
+ * goes through PG_DETOAST_DATUM or its slice variant, which expand
+ * them back.
  */
+typedef struct {
+	uint32	off;	/* from the start of the value */
+	uint32	len;
+} PPSection;
+
 typedef struct {
 	char	vl_len_[4];
-	/* FIXED_DATA_BEGIN */
+	/* Same leading member as in version 0, so that version overlays
+	 * its width, which is never negative */
 	Timestamp	date;
+	int32	version;
+	uint16	flags;
+	uint8	format;
+	uint8	orientation;
 	int32	width;
 	int32	height;
 	Oid		cspace;
@@ -61,10 +138,123 @@ typedef struct {
 	float4	f_number;
 	float4	exposure_t;
 	float4	focal_l;
-	/* FIXED_DATA_END */
-	bytea imgdata;
+	uint32	dataoff;
+	uint32	datalen;	/* 0 once deduplicated, see PPBlobRef */
+	PPSection	sections[FLEXIBLE_ARRAY_MEMBER];
 } PPImage;
 
+/*
+ * Format version 0, still found on disk: fixed data followed by
+ * the encoded image as a bytea, possibly followed by the
+ * metadata sidecar as a bytea
+ */
+typedef struct {
+	char	vl_len_[4];
+	Timestamp	date;
+	int32	width;
+	int32	height;
+	Oid		cspace;
+	int32	iso;
+	float4	f_number;
+	float4	exposure_t;
+	float4	focal_l;
+	bytea imgdata;
+} PPImageV0;
+
+/* Optional sections, by flag bit */
+#define PPS_METADATA	0	/* "key\0value\0" pairs read at ingest */
+#define PPS_DIGEST		1	/* MD5 of the encoded image */
+#define PPS_PREVIEW		2	/* PPPreview locating the EXIF thumbnail */
+#define PPS_BLOB		3	/* PPBlobRef: the encoded image is in postpic_blobs */
+#define PP_TRAILING_SECTIONS	8
+#define PPS_PYRAMID		8	/* PPPyramid of downscaled renditions */
+#define PP_MAX_SECTIONS	16
+#define PPF_METADATA	(1 << PPS_METADATA)
+#define PPF_DIGEST		(1 << PPS_DIGEST)
+#define PPF_PREVIEW		(1 << PPS_PREVIEW)
+#define PPF_BLOB		(1 << PPS_BLOB)
+#define PPF_PYRAMID		(1 << PPS_PYRAMID)
+#define DIGESTLEN		16	/* MD5 */
+
+typedef struct {
+	const void *	data;
+	uint32	len;
+} PPSectionData;
+
+/* Encoded image formats */
+const char * formats[] = {
+	"Unknown", "JPEG", "PNG", "GIF", "TIFF", "WEBP", "BMP", NULL
+};
+
+#define PP_FMT_UNKNOWN	0
+#define PP_FMT_JPEG		1
+#define PP_FMT_PNG		2
+#define PP_FMT_GIF		3
+#define PP_FMT_TIFF		4
+
+/* formats that can hold several frames, or pages */
+#define PP_MULTIFRAME(f)	((f) == PP_FMT_GIF || (f) == PP_FMT_TIFF || (f) == PP_FMT_UNKNOWN)
+
+/* JPEG preview embedded in the EXIF data */
+typedef struct {
+	uint32	off;	/* from the start of the encoded image */
+	uint32	len;
+	int32	width;
+	int32	height;
+	int32	ncomp;
+} PPPreview;
+
+/*
+ * Deduplicated values keep the encoded image in postpic_blobs,
+ * under their digest, and just its length here
+ */
+typedef struct {
+	uint32	len;
+} PPBlobRef;
+
+/* Pyramid of encoded renditions, each half the size of the previous */
+typedef struct {
+	int32	width;
+	int32	height;
+	uint32	off;	/* from the start of the section */
+	uint32	len;
+} PPLevel;
+
+typedef struct {
+	int32	nlevels;
+	PPLevel	levels[FLEXIBLE_ARRAY_MEMBER];
+} PPPyramid;
+
+#define PP_ANALYSIS_SIZE	256	/* longer side of the copy statistics work on */
+
+#define PP_WIRE_MAGIC	"PPIC"
+#define PP_WIRE_VERSION	1
+#define PP_WIRE_END		255
+
+/* dates travel as int64 microseconds, whatever the server's timestamps */
+#if PG_VERSION_NUM < 100000 && !defined(HAVE_INT64_TIMESTAMP)
+#define PP_DATE_TO_WIRE(d)		((int64) rint((d) * USECS_PER_SEC))
+#define PP_DATE_FROM_WIRE(v)	((Timestamp) (v) / USECS_PER_SEC)
+#else
+#define PP_DATE_TO_WIRE(d)		((int64) (d))
+#define PP_DATE_FROM_WIRE(v)	((Timestamp) (v))
+#endif
+
+/*
+ * Type modifier of image(max_width, max_height [, format [, quality]]):
+ * width - 1 and height - 1 take 12 bits each, then 3 bits for the
+ * format (0 keeps it) and 4 for quality / 10 (0 for the default)
+ */
+#define PP_TYPMOD_MAXSIDE	4096
+#define PP_TYPMOD(w, h, f, q)	(((w) - 1) | (((h) - 1) << 12) | ((f) << 24) | (((q) / 10) << 27))
+#define PP_TYPMOD_WIDTH(t)		(((t) & 0xFFF) + 1)
+#define PP_TYPMOD_HEIGHT(t)		((((t) >> 12) & 0xFFF) + 1)
+#define PP_TYPMOD_FORMAT(t)		(((t) >> 24) & 0x7)
+#define PP_TYPMOD_QUALITY(t)	((((t) >> 27) & 0xF) * 10)
+
+#define PP_MAX_LEVELS	12
+#define PP_LEVEL_MIN	64	/* no level smaller than this, on both sides */
+
 /* Colorspace Handling */
 typedef struct {
 	char * name;
@@ -82,6 +272,66 @@ PPColorspace colorspaces[] = {
 };
 
 static Oid colorspace_oid;
+static uint32 colorspace_hash;	/* of colorspace_oid in the TYPEOID cache */
+static bool colorspaces_valid = false;
+
+#if PG_VERSION_NUM >= 120000
+#define pp_syscache_oid(cache, oidcol, k1, k2)	GetSysCacheOid2(cache, oidcol, k1, k2)
+#else
+#define pp_syscache_oid(cache, oidcol, k1, k2)	GetSysCacheOid2(cache, k1, k2)
+#define table_open(r, l)	heap_open(r, l)
+#define table_close(r, l)	heap_close(r, l)
+#endif
+
+/* Resampling filters */
+typedef struct {
+	char * name;
+	FilterTypes gm;
+	int kernel;		/* for pp_resample_rgba8, -1 if GM only */
+} PPFilter;
+
+PPFilter filters[] = {
+	{ "cubic", CubicFilter, PP_FILTER_CUBIC },	/* the default */
+	{ "point", PointFilter, -1 },
+	{ "box", BoxFilter, PP_FILTER_BOX },
+	{ "triangle", TriangleFilter, PP_FILTER_TRIANGLE },
+	{ "hermite", HermiteFilter, -1 },
+	{ "hanning", HanningFilter, -1 },
+	{ "hamming", HammingFilter, -1 },
+	{ "blackman", BlackmanFilter, -1 },
+	{ "gaussian", GaussianFilter, -1 },
+	{ "quadratic", QuadraticFilter, -1 },
+	{ "catrom", CatromFilter, PP_FILTER_CATROM },
+	{ "mitchell", MitchellFilter, PP_FILTER_MITCHELL },
+	{ "lanczos", LanczosFilter, PP_FILTER_LANCZOS },
+	{ "bessel", BesselFilter, -1 },
+	{ "sinc", SincFilter, -1 },
+	{ NULL, UndefinedFilter, -1 }
+};
+
+#define FILTER_DEFAULT (&filters[0])
+
+/*
+ * GM objects are malloc'ed, out of reach of memory contexts:
+ * we track the live ones along with their resource owner,
+ * so that an error can't leak them
+ */
+typedef enum {
+	PP_RES_IMAGE,
+	PP_RES_IMAGEINFO,
+	PP_RES_DRAW,
+	PP_RES_DRAWINFO,
+	PP_RES_BLOB
+} PPResourceKind;
+
+typedef struct {
+	void *	obj;
+	PPResourceKind	kind;
+	ResourceOwner	owner;
+} PPResource;
+
+static PPResource * resources = NULL;
+static int nresources = 0, maxresources = 0;
 
 /* Color representation */
 typedef struct {
@@ -89,14 +339,257 @@ typedef struct {
 	unsigned int cd;
 } PPColor;
 
+/* A deconstructed array argument, n = 0 when NULL */
+typedef struct {
+	Datum *	elems;
+	bool *	nulls;
+	int	n;
+} PPArray;
+
 char * tmpdir = "/tmp";
 
-#define CS_UNKNOWN colorspaces[0]
-#define CS_RGB colorspaces[1]
-#define CS_RGBA colorspaces[2]
-#define CS_GRAY colorspaces[3]
-#define CS_sRGB colorspaces[4]
-#define CS_CMYK colorspaces[5]
+/* Queries on postpic_blobs, prepared once per backend */
+typedef struct {
+	const char *	query;	/* %s stands for the schema prefix */
+	int	nargs;
+	Oid	argtypes[3];
+	SPIPlanPtr	plan;
+} PPBlobQuery;
+
+#define PP_BLOB_SLICE	0
+#define PP_BLOB_REF		1
+#define PP_BLOB_REF_SAME	2
+#define PP_BLOB_ADD		3
+#define PP_BLOB_UNREF	4
+#define PP_BLOB_LOCK	5
+
+/*
+ * All but the lock go through the extension's SECURITY DEFINER
+ * functions, the table not being granted to anyone; those
+ * changing the references return the digest of each row changed.
+ */
+static PPBlobQuery blob_queries[] = {
+	{ "SELECT %spostpic_blob_slice($1, $2, $3)",
+		3, { BYTEAOID, INT4OID, INT4OID }, NULL },
+	{ "SELECT * FROM %spostpic_blob_ref($1)",
+		1, { BYTEAOID }, NULL },
+	/* MD5 collisions can be crafted: don't trust the digest alone */
+	{ "SELECT * FROM %spostpic_blob_ref($1, $2)",
+		2, { BYTEAOID, BYTEAOID }, NULL },
+	{ "SELECT * FROM %spostpic_blob_add($1, $2)",
+		2, { BYTEAOID, BYTEAOID }, NULL },
+	{ "SELECT * FROM %spostpic_blob_unref($1)",
+		1, { BYTEAOID }, NULL },
+	/* conflicts with the writes of the trigger, not with reads */
+	{ "LOCK TABLE %spostpic_blobs IN SHARE ROW EXCLUSIVE MODE",
+		0, { InvalidOid }, NULL }
+};
+
+/* Columns postpic_gc looks for deduplicated values in, $1 being the image type */
+static const char * gc_columns_query =
+	"SELECT quote_ident(n.nspname) || '.' || quote_ident(c.relname), quote_ident(a.attname), c.relkind "
+	"FROM pg_catalog.pg_attribute a "
+	"JOIN pg_catalog.pg_class c ON c.oid = a.attrelid "
+	"JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
+	"JOIN pg_catalog.pg_type t ON t.oid = a.atttypid "
+	"WHERE c.relkind IN ('r', 'm') AND a.attnum > 0 AND NOT a.attisdropped "
+	"AND (t.oid = $1 OR t.typbasetype = $1) "
+	/* other sessions' temporary tables can't be read */
+	"AND (c.relpersistence <> 't' OR c.relnamespace = pg_catalog.pg_my_temp_schema())";
+
+static char * blob_schema = NULL;
+
+/*
+ * Statistics, in shared memory: one entry per function of ours
+ * and database, plus one per internal operation (decoding,
+ * detoasting...) and database. Entries, once added, stay.
+ */
+#define PP_OP_FUNCTION		0
+#define PP_OP_DECODE		1
+#define PP_OP_PING			2
+#define PP_OP_ENCODE		3
+#define PP_OP_DETOAST		4
+#define PP_OP_DETOAST_SLICE	5
+#define PP_OP_BLOB_FETCH	6
+#define PP_OP_OPTIMIZE		7
+#define PP_OPS				8
+
+static const char * stat_ops[] = {
+	NULL, "decode", "ping", "encode", "detoast", "detoast slice", "blob fetch", "optimize"
+};
+
+typedef struct {
+	Oid		dbid;
+	Oid		funcid;		/* InvalidOid for internal operations */
+	int		op;
+	slock_t	mutex;		/* for the counters */
+	int64	calls;
+	double	total_time;	/* ms */
+	double	max_time;
+	int64	bytes_in;	/* detoasted or decoded */
+	int64	bytes_out;	/* encoded */
+	int64	pixels;		/* decoded or encoded */
+} PPStat;
+
+typedef struct {
+	slock_t	mutex;		/* for adding entries */
+	int		nentries;
+	PPStat	entries[FLEXIBLE_ARRAY_MEMBER];
+} PPStats;
+
+#define PP_STAT_ENTRIES	1024
+#define PP_STATS_ON	(stats != NULL && track_stats)
+/* starts timing an internal operation, see pp_stat_op */
+#define PP_STAT_START(t)	(PP_STATS_ON ? (INSTR_TIME_SET_CURRENT(t), true) : false)
+
+static PPStats * stats = NULL;
+/* the entries this backend uses, by op and (in stat_functions) by function */
+static PPStat * stat_op_entries[PP_OPS];
+static HTAB * stat_functions = NULL;
+
+typedef struct {
+	Oid		funcid;
+	PPStat *	entry;	/* NULL if not ours, or no room left */
+} PPStatFunction;
+
+/* Calls of our functions in progress, for the fmgr hook */
+typedef struct {
+	PPStat *	entry;
+	instr_time	start;
+	int64	bytes_in;
+	int64	bytes_out;
+	int64	pixels;
+} PPStatCall;
+
+#define PP_STAT_DEPTH	32
+
+static PPStatCall stat_calls[PP_STAT_DEPTH];
+static int stat_depth = 0;
+/* this backend's running totals, calls take their difference */
+static int64 stat_bytes_in = 0, stat_bytes_out = 0, stat_pixels = 0;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static needs_fmgr_hook_type prev_needs_fmgr_hook = NULL;
+static fmgr_hook_type prev_fmgr_hook = NULL;
+
+/* Recently created canvases, see image_new */
+typedef struct {
+	int32	w;
+	int32	h;
+	PPColor	color;
+	PPImage *	img;
+} PPCanvas;
+
+#define PP_CANVAS_CACHE		16
+#define PP_CANVAS_MAXSIZE	(64 * 1024)
+
+static PPCanvas canvases[PP_CANVAS_CACHE];
+static int next_canvas = 0;
+static MemoryContext canvas_context = NULL;
+
+/*
+ * Decoded overlays (logos, watermarks...) by digest and opacity.
+ * These live across calls, so they're not tracked.
+ */
+typedef struct {
+	char	digest[DIGESTLEN];
+	float4	opacity;
+	Image *	img;
+} PPOverlay;
+
+#define PP_OVERLAY_CACHE	8
+#define PP_OVERLAY_MAXPIXELS	(1024 * 1024)
+
+static PPOverlay overlays[PP_OVERLAY_CACHE];
+static int next_overlay = 0;
+
+/* Annotation settings by font, size and color, see gm_font_lookup */
+typedef struct {
+	char *	family;
+	int32	size;
+	bool	has_color;
+	PPColor	color;
+	DrawInfo *	dinfo;
+} PPFont;
+
+#define PP_FONT_CACHE	8
+
+static PPFont fonts[PP_FONT_CACHE];
+static int next_font = 0;
+
+/* Shape and normalization of a tensor, see image_tensor */
+typedef struct {
+	int32	width;
+	int32	height;
+	bool	planar;		/* channels first (CHW), else HWC */
+	float	scale[3];	/* value = pixel * scale + bias, for R, G, B */
+	float	bias[3];
+} PPTensor;
+
+/* Gravities, for placing overlays */
+typedef struct {
+	char * name;
+	int	hpos;	/* 0 left, 1 center, 2 right */
+	int	vpos;	/* 0 top, 1 center, 2 bottom */
+} PPGravity;
+
+PPGravity gravities[] = {
+	{ "northwest", 0, 0 },
+	{ "north", 1, 0 },
+	{ "northeast", 2, 0 },
+	{ "west", 0, 1 },
+	{ "center", 1, 1 },
+	{ "east", 2, 1 },
+	{ "southwest", 0, 2 },
+	{ "south", 1, 2 },
+	{ "southeast", 2, 2 },
+	{ NULL, 0, 0 }
+};
+
+/* GUCs */
+static bool thumbnail_from_preview = false;
+static int pyramid_levels = 0;
+static int max_pixels = 0;		/* 0 means GM's own limit */
+static int max_memory = 0;		/* kB */
+static int max_disk = 0;		/* kB */
+static int max_threads = 1;
+static bool send_header = false;
+static bool track_stats = true;
+static int output_format = 0;
+static int optimize_mode = 0;
+
+#define PP_OUTPUT_HEX		0
+#define PP_OUTPUT_BASE64	1
+#define PP_BASE64_PREFIX	"base64:"
+
+static const struct config_enum_entry output_formats[] = {
+	{ "hex", PP_OUTPUT_HEX, false },
+	{ "base64", PP_OUTPUT_BASE64, false },
+	{ NULL, 0, false }
+};
+
+#define PP_OPTIMIZE_OFF		0
+#define PP_OPTIMIZE_ON		1
+#define PP_OPTIMIZE_STRIP	2
+
+static const struct config_enum_entry optimize_modes[] = {
+	{ "off", PP_OPTIMIZE_OFF, false },
+	{ "on", PP_OPTIMIZE_ON, false },
+	{ "strip", PP_OPTIMIZE_STRIP, false },
+	{ NULL, 0, false }
+};
+static magick_int64_t gm_default_threads;
+static magick_int64_t gm_default_pixels, gm_default_memory, gm_default_map, gm_default_disk;
+
+#define CS_UNKNOWN pp_colorspaces()[0]
+#define CS_RGB pp_colorspaces()[1]
+#define CS_RGBA pp_colorspaces()[2]
+#define CS_GRAY pp_colorspaces()[3]
+#define CS_sRGB pp_colorspaces()[4]
+#define CS_CMYK pp_colorspaces()[5]
 
 /* Some constant */
 #define BUFSIZE		8192
@@ -104,20 +597,39 @@ char * tmpdir = "/tmp";
 #define DATELEN		20
 #define COLORLEN	18
 #define VERLEN		128
-#define FIXED_DATA_LEN	36
+#define PP_FORMAT_MAGIC		0x8F500000
+#define PP_FORMAT_MASK		0xFFFF0000
+#define PP_FORMAT_VERSION	1
 #define ATTR_TIME	"EXIF:DateTimeOriginal"
 #define ATTR_EXPT	"EXIF:ExposureTime"
 #define ATTR_FNUM	"EXIF:FNumber"
 #define ATTR_ISO	"EXIF:ISOSpeedRatings"
 #define ATTR_FLEN	"EXIF:FocalLength"
+#define ATTR_ORIENT	"EXIF:Orientation"
+#define ATTR_EXIF_ALL	"EXIF:*"
+#define ATTR_XMP	"XMP"
+#define IPTC_MARKER	0x1C
 #define	PP_VERSION_RELEASE	0
 #define	PP_VERSION_MAJOR	9
-#define	PP_VERSION_MINOR	1
+#define	PP_VERSION_MINOR	2
 
 /*
  * Helpful macros
  */
-#define PG_GETARG_IMAGE(x) (PPImage*) PG_DETOAST_DATUM(PG_GETARG_POINTER(x))
+#define PG_GETARG_IMAGE(x) pp_image_from_datum(PG_GETARG_DATUM(x))
+#define PG_GETARG_IMAGE_HEADER(x) pp_header_from_datum(PG_GETARG_DATUM(x), false)
+#define PG_GETARG_IMAGE_SECTIONS(x) pp_header_from_datum(PG_GETARG_DATUM(x), true)
+#define PP_DATA(img)	((char *) (img) + (img)->dataoff)
+#define PP_DATALEN(img)	((img)->datalen)
+#define PP_HAS(img, f)	((img)->flags & (f))
+#define PP_IS_V0(img)	((((PPImage *) (img))->version & PP_FORMAT_MASK) != PP_FORMAT_MAGIC)
+
+/*
+ * Version 0 metadata sidecar, following imgdata
+ */
+#define PP_V0_IMGDATA_END(img)	INTALIGN(offsetof(PPImageV0, imgdata) + VARSIZE(&(img)->imgdata))
+#define PP_V0_HAS_METADATA(img)	(VARSIZE(img) > PP_V0_IMGDATA_END(img))
+#define PP_V0_METADATA(img)	((bytea *) ((char *) (img) + PP_V0_IMGDATA_END(img)))
 
 /*
  * Mandatory and factory methods 
@@ -129,6 +641,9 @@ Datum	image_recv(PG_FUNCTION_ARGS);
 Datum	image_from_large_object(PG_FUNCTION_ARGS);
 Datum	image_from_bytea(PG_FUNCTION_ARGS);
 Datum	image_new(PG_FUNCTION_ARGS);
+Datum	image_typmod_in(PG_FUNCTION_ARGS);
+Datum	image_typmod_out(PG_FUNCTION_ARGS);
+Datum	image_enforce_typmod(PG_FUNCTION_ARGS);
 
 Datum	color_in(PG_FUNCTION_ARGS);
 Datum	color_out(PG_FUNCTION_ARGS);
@@ -152,14 +667,40 @@ Datum	image_exposure_time(PG_FUNCTION_ARGS);
 Datum	image_iso(PG_FUNCTION_ARGS);
 Datum	image_focal_length(PG_FUNCTION_ARGS);
 Datum	image_colorspace(PG_FUNCTION_ARGS);
+Datum	image_metadata(PG_FUNCTION_ARGS);
+Datum	image_metadata_value(PG_FUNCTION_ARGS);
+Datum	image_format(PG_FUNCTION_ARGS);
+Datum	image_orientation(PG_FUNCTION_ARGS);
+Datum	image_digest(PG_FUNCTION_ARGS);
+Datum	image_deduplicated(PG_FUNCTION_ARGS);
+Datum	image_data_length(PG_FUNCTION_ARGS);
+Datum	image_data_range(PG_FUNCTION_ARGS);
+Datum	image_optimize(PG_FUNCTION_ARGS);
+Datum	image_optimize_report(PG_FUNCTION_ARGS);
+Datum	image_composite(PG_FUNCTION_ARGS);
+Datum	image_draw_texts(PG_FUNCTION_ARGS);
+Datum	image_draw(PG_FUNCTION_ARGS);
+Datum	image_histogram(PG_FUNCTION_ARGS);
+Datum	image_average_color(PG_FUNCTION_ARGS);
+Datum	image_dominant_colors(PG_FUNCTION_ARGS);
+Datum	image_brightness(PG_FUNCTION_ARGS);
+Datum	image_colorfulness(PG_FUNCTION_ARGS);
+Datum	image_tensor(PG_FUNCTION_ARGS);
+Datum	image_tensor_bytes(PG_FUNCTION_ARGS);
 
 /*
  * Image processing functions
  */
 Datum	image_thumbnail(PG_FUNCTION_ARGS);
+Datum	image_preview(PG_FUNCTION_ARGS);
+Datum	image_pyramid(PG_FUNCTION_ARGS);
+Datum	image_pyramid_levels(PG_FUNCTION_ARGS);
 Datum	image_square(PG_FUNCTION_ARGS);
 Datum	image_resize(PG_FUNCTION_ARGS);
 Datum	image_crop(PG_FUNCTION_ARGS);
+Datum	image_tiles(PG_FUNCTION_ARGS);
+Datum	image_page_count(PG_FUNCTION_ARGS);
+Datum	image_page(PG_FUNCTION_ARGS);
 Datum	image_rotate(PG_FUNCTION_ARGS);
 Datum	image_draw_text(PG_FUNCTION_ARGS);
 Datum   image_draw_rect(PG_FUNCTION_ARGS);
@@ -169,11 +710,79 @@ Datum   image_draw_rect(PG_FUNCTION_ARGS);
  */
 Datum   image_index(PG_FUNCTION_ARGS);
 
+/*
+ * Deduplicated storage
+ */
+Datum	postpic_dedup(PG_FUNCTION_ARGS);
+Datum	postpic_gc(PG_FUNCTION_ARGS);
+
+/*
+ * Statistics
+ */
+Datum	postpic_stats(PG_FUNCTION_ARGS);
+Datum	postpic_stats_reset(PG_FUNCTION_ARGS);
+
 /*
  * Internal and GraphicsMagick's
  */
 PPImage *	pp_init_image_full(Image * gimg, void * blob, size_t datalen);
 PPImage *	pp_init_image(Image * gimg);
+PPImage *	pp_ingest_image(Image * gimg, void * data, size_t datalen);
+PPImage *	pp_ingest_blob(void * data, size_t datalen);
+// lossless optimization
+void *		pp_optimize_data(int format, const void * data, size_t len, bool strip, bool progressive, size_t * olen);
+PPImage *	pp_optimize_image(Datum d, bool strip, bool progressive);
+PPImage *	pp_replace_data(const PPImage * img, const void * data, size_t len);
+void		gm_strip(Image * gimg);
+// on-disk format
+PPImage *	pp_image_from_datum(Datum d);
+PPImage *	pp_header_from_datum(Datum d, bool sections);
+PPImage *	pp_upgrade_v0(PPImageV0 * old, bool header_only);
+PPImage *	pp_assemble(const PPImage * hdr, const PPSectionData * sects, const void * data, size_t datalen);
+void		pp_get_sections(const PPImage * img, PPSectionData * sects);
+char *		pp_section(const PPImage * img, uint16 flag, uint32 * len);
+PPImage *	pp_set_section(const PPImage * img, int sect, const void * data, uint32 len);
+uint8		pp_parse_format(const char * magick);
+char *		pp_fetch_data(Datum d, const PPImage * hdr, uint32 off, uint32 len);
+char *		pp_fetch_section(Datum d, const PPImage * hdr, const char * sect, uint32 len);
+char *		pp_detoast_slice(Datum d, uint32 off, uint32 len);
+uint32		pp_stored_datalen(Datum d, const PPImage * hdr);
+// deduplicated storage
+PPImage *	pp_attach(const PPImage * img);
+PPImage *	pp_detach(const PPImage * img, const char * digest);
+char *		pp_blob_fetch(const char * digest, uint32 off, uint32 len);
+void		pp_blob_ref(const char * digest, const char * data, uint32 len);
+void		pp_blob_unref(const char * digest);
+int			pp_blob_exec(int q, Datum * args, bool read_only);
+bytea *		pp_make_bytea(const char * data, uint32 len);
+int			pp_image_column(TupleDesc desc, const char * name);
+bool		pp_blob_digest(Datum d, char * digest);
+// binary I/O
+void		pp_send_header(StringInfo buf, const PPImage * img);
+PPImage *	pp_recv_header(StringInfo buf);
+void		pp_recv_metadata(const char * data, uint32 len);
+void		pp_recv_pyramid(const char * data, uint32 len, StringInfo sect);
+void		pp_check_wire(const PPImage * hdr, const char * data, uint32 len);
+void		pp_recv_error(const char * msg);
+void		pp_get_digest(Datum d, const PPImage * hdr, char * digest);
+void		pp_md5(const void * data, size_t len, char * digest);
+void		pp_copy_exif(PPImage * dst, const PPImage * src);
+// embedded previews
+bool		pp_find_preview(const void * data, size_t len, PPPreview * pv);
+bool		pp_get_preview(Datum d, const PPImage * hdr, PPPreview * pv);
+PPImage *	pp_init_preview(const PPImage * hdr, const void * data, const PPPreview * pv);
+PPImage *	pp_thumbnail_from_preview(Datum d, int32 size);
+void		pp_thumbnail_size(const PPImage * img, int32 size, int32 * sx, int32 * sy);
+// overlay cache
+Image *		gm_overlay_lookup(Datum d, float4 opacity, bool * cached);
+// canvas cache
+PPImage *	pp_canvas_lookup(int32 w, int32 h, const PPColor * color);
+void		pp_canvas_store(int32 w, int32 h, const PPColor * color, const PPImage * img);
+// type modifiers
+Datum		pp_enforce_typmod(Datum d, int32 typmod);
+int			pp_typmod_int(const char * str, int min, int max, const char * what);
+// pyramids
+PPImage *	pp_build_pyramid(PPImage * img, Image * gimg, int levels);
 // parsing and formatting
 Timestamp	pp_str2timestamp(const char * date);
 //char *		pp_timestamp2str(Timestamp ts);
@@ -182,41 +791,153 @@ int			pp_substr2int(char * str, int off, int len);
 float4		pp_parse_float(const char * str);
 int			pp_parse_int(char * str);
 Oid			pp_parse_cstype(const ColorspaceType t);
+PPColorspace *	pp_colorspaces(void);
+void		pp_colorspaces_invalidate(Datum arg, int cacheid, uint32 hashvalue);
+Oid			pp_extension_namespace(void);
+void		gm_preload(void);
 void		pp_parse_color(const char * str, PPColor * color);
+// metadata sidecar
+void		pp_collect_metadata(Image * gimg, StringInfo meta);
+void		pp_parse_exif_list(const char * list, StringInfo meta);
+void		pp_meta_append(StringInfo meta, const char * key, const char * value, int len);
+void		pp_parse_iptc(const unsigned char * profile, size_t plen, StringInfo meta);
+const char *	pp_meta_lookup(const char * meta, int len, const char * key);
+char *		pp_get_metadata(Datum d, int * len);
 // To deal easily with GraphicsMagick objects
 Image *		gm_image_from_lob(Oid loid);
 Image *		gm_image_from_bytea(bytea * imgdata);
+Image *		gm_image_from_blob(const void * blob, size_t blen);
+Image *		gm_image_from_blob_hint(const void * blob, size_t blen, int32 w, int32 h);
+Image *		gm_ping_blob(const void * blob, size_t blen);
+Image *		gm_image_page(const void * blob, size_t blen, int format, int32 page, int32 w, int32 h);
+Image *		gm_take_frame(Image * list, Image * frame);
+int32		gm_page_count(const void * blob, size_t blen);
+Image *		gm_image_from_image_hint(PPImage * img, int32 w, int32 h);
+Image *		gm_image_new(int32 w, int32 h, const PPColor * color);
+DrawInfo *	gm_font_lookup(const char * family, int32 size, const PPColor * color);
+void		gm_annotate(Image * gimg, DrawInfo * dinfo, int x, int y, const char * text);
+int			pp_deconstruct(ArrayType * a, Datum ** elems, bool ** nulls);
+void		pp_get_array(FunctionCallInfo fcinfo, int argno, PPArray * arr);
+PPColor *	pp_array_color(const PPArray * colors, int i);
+void		gm_draw_set_color(DrawContext ctx, const PPColor * color, bool fill, double stroke_width);
+Image *		gm_image_from_image(PPImage * img);
 char *		gm_image_getattr(Image * img, const char * attr);
 void *		gm_image_to_blob(Image * timg, size_t * blen, ExceptionInfo * ex);
+void *		gm_image_to_blob_fmt(Image * timg, const char * magick, size_t * blen, ExceptionInfo * ex);
+void *		gm_image_encode(Image * timg, const char * magick, int quality, size_t * blen, ExceptionInfo * ex);
+Image *		gm_image_at_size(Datum d, const PPImage * hdr, int32 w, int32 h);
+Image *		gm_resize(Image * gimg, int32 w, int32 h, const PPFilter * f, ExceptionInfo * ex);
+Image *		gm_resample_rgba8(Image * gimg, int32 w, int32 h, int kernel, ExceptionInfo * ex);
+bool		gm_export_rgba8(Image * gimg, unsigned char * buf, ExceptionInfo * ex);
+unsigned char *	gm_analysis_pixels(Datum d, size_t * npixels);
+unsigned char *	gm_pixels_at_size(Datum d, const PPImage * hdr, int32 w, int32 h, const PPFilter * f);
+void		pp_tensor_args(FunctionCallInfo fcinfo, PPTensor * ts);
+Datum		pp_make_color(const unsigned char * rgb);
+const PPFilter *	pp_parse_filter(const char * name);
 void		gm_image_destroy(Image *);
+Image *		gm_result(Image * res, ExceptionInfo * ex);
+void		gm_raise(ExceptionInfo * ex, const char * msg);
+// tracking of GM objects
+void *		gm_track(void * obj, PPResourceKind kind);
+void		gm_untrack(void * obj);
+void		gm_destroy(void * obj, PPResourceKind kind);
+void		gm_release_resources(ResourceReleasePhase phase, bool isCommit, bool isTopLevel, void * arg);
+// resource limits
+void		pp_check_pixels(int64 w, int64 h);
+void		assign_max_pixels(int newval, void * extra);
+void		assign_max_memory(int newval, void * extra);
+void		assign_max_disk(int newval, void * extra);
+void		assign_max_threads(int newval, void * extra);
 PixelPacket *	gm_ppacket_from_color(const PPColor * color);
+// statistics
+Size		pp_stats_size(void);
+void		pp_shmem_startup(void);
+#if PG_VERSION_NUM >= 150000
+void		pp_shmem_request(void);
+#endif
+PPStat *	pp_stat_entry(Oid funcid, int op);
+PPStat *	pp_stat_function(Oid funcid);
+bool		pp_is_ours(Oid funcid);
+void		pp_stat_add(PPStat * e, const instr_time * start, int64 in, int64 out, int64 pixels);
+void		pp_stat_op(int op, const instr_time * start, int64 in, int64 out, int64 pixels);
+bool		pp_needs_fmgr_hook(Oid funcid);
+void		pp_fmgr_hook(FmgrHookEventType event, FmgrInfo * flinfo, Datum * arg);
 // large objects processing
 void *		lo_readblob(Oid loid, int * len);
 int			lo_size(int32 fd);
 
 
+/*
+ * Accepts bytea's hex format, base64 after a "base64:" prefix
+ * and, through byteain, bytea's escape format
+ */
 PG_FUNCTION_INFO_V1(image_in);
 Datum	image_in(PG_FUNCTION_ARGS)
 {
-	PPImage * img;
-	Image * gimg;
+	char * str = PG_GETARG_CSTRING(0);
+	size_t len = strlen(str);
+	unsigned char * data;
+	const char * bad;
 	bytea * imgdata;
-	Datum data;
-	
-	data = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
-	imgdata = (bytea *) DatumGetPointer(data);
-	gimg = gm_image_from_bytea(imgdata);
-	
-	img = pp_init_image_full(gimg, VARDATA(imgdata), VARSIZE(imgdata) - VARHDRSZ);
-	gm_image_destroy(gimg);
-	PG_RETURN_POINTER(img);
+	long dlen;
+
+	if(str[0] == '\\' && str[1] == 'x') {
+		data = palloc(len / 2 + 1);
+		dlen = pp_hex_decode(str + 2, len - 2, data, &bad);
+		if(dlen < 0 && !*bad) {
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid hexadecimal data: odd number of digits")));
+		} else if(dlen < 0) {
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid hexadecimal digit: \"%c\"", *bad)));
+		}
+	} else if(!strncmp(str, PP_BASE64_PREFIX, strlen(PP_BASE64_PREFIX))) {
+		len -= strlen(PP_BASE64_PREFIX);
+		data = palloc(len / 4 * 3 + 3);
+		dlen = pp_base64_decode(str + strlen(PP_BASE64_PREFIX), len, data);
+		if(dlen < 0) {
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid base64 image data")));
+		}
+	} else {
+		imgdata = DatumGetByteaP(DirectFunctionCall1(byteain, CStringGetDatum(str)));
+		data = (unsigned char *) VARDATA(imgdata);
+		dlen = VARSIZE(imgdata) - VARHDRSZ;
+	}
+	/* COPY relies on us for the column's type modifier */
+	PG_RETURN_DATUM(pp_enforce_typmod(PointerGetDatum(pp_ingest_blob(data, dlen)),
+		PG_NARGS() > 2 ? PG_GETARG_INT32(2) : -1));
 }
 
+/*
+ * Hex, as byteaout does (and PQunescapeBytea reads), or base64
+ * as chosen by postpic.output_format
+ */
 PG_FUNCTION_INFO_V1(image_out);
 Datum	image_out(PG_FUNCTION_ARGS)
 {
 	PPImage * img = PG_GETARG_IMAGE(0);
-	return DirectFunctionCall1(byteaout, PointerGetDatum(&img->imgdata));
+	uint32 len = PP_DATALEN(img);
+	Size plen;
+	char * res;
+
+	if(output_format == PP_OUTPUT_BASE64) {
+		plen = strlen(PP_BASE64_PREFIX);
+		res = palloc(plen + (Size) (len + 2) / 3 * 4 + 1);
+		memcpy(res, PP_BASE64_PREFIX, plen);
+		pp_base64_encode((unsigned char *) PP_DATA(img), len, res + plen);
+		res[plen + (Size) (len + 2) / 3 * 4] = '\0';
+	} else {
+		res = palloc((Size) len * 2 + 3);
+		res[0] = '\\';
+		res[1] = 'x';
+		pp_hex_encode((unsigned char *) PP_DATA(img), len, res + 2);
+		res[(Size) len * 2 + 2] = '\0';
+	}
+	PG_RETURN_CSTRING(res);
 }
 
 PG_FUNCTION_INFO_V1(image_from_large_object);
@@ -226,7 +947,7 @@ Datum	image_from_large_object(PG_FUNCTION_ARGS)
 	Image * gimg = gm_image_from_lob(loid);
 	PPImage * img;
 	
-	img = pp_init_image(gimg);
+	img = pp_ingest_image(gimg, NULL, 0);
 	gm_image_destroy(gimg);
 	PG_RETURN_POINTER(img);
 }
@@ -235,167 +956,689 @@ PG_FUNCTION_INFO_V1(image_from_bytea);
 Datum	image_from_bytea(PG_FUNCTION_ARGS)
 {
 	PPImage * img;
-	Image * gimg;
 	bytea * imgdata;
 	
 	imgdata = /*(bytea *)*/ PG_GETARG_BYTEA_P(0);
-	gimg = gm_image_from_bytea(imgdata);
-	
-	img = pp_init_image_full(gimg, VARDATA(imgdata), VARSIZE(imgdata) - VARHDRSZ);
-	gm_image_destroy(gimg);
+	img = pp_ingest_blob(VARDATA(imgdata), VARSIZE(imgdata) - VARHDRSZ);
 	PG_RETURN_POINTER(img);
 }
 
+/*
+ * Sends the encoded image alone or, with postpic.send_header on,
+ * preceded by the header and sections so that image_recv
+ * doesn't need to decode it
+ */
 PG_FUNCTION_INFO_V1(image_send);
 Datum	image_send(PG_FUNCTION_ARGS)
 {
 	PPImage * img = PG_GETARG_IMAGE(0);
-	PG_RETURN_BYTEA_P(&img->imgdata);
-}
-
-PG_FUNCTION_INFO_V1(image_recv);
-Datum   image_recv(PG_FUNCTION_ARGS)
-{
-	PPImage * img;
-    Image * gimg;
-	Datum data;
-	bytea * imgdata;
-	
-	data = DirectFunctionCall1(bytearecv,PG_GETARG_DATUM(0));
-	imgdata  = (bytea *) DatumGetPointer(data);
-    gimg = gm_image_from_bytea(imgdata);
+	StringInfoData buf;
 
-    img = pp_init_image_full(gimg, VARDATA(imgdata), VARSIZE(imgdata) - VARHDRSZ);
-    gm_image_destroy(gimg);
-	PG_RETURN_POINTER(img);
+	pq_begintypsend(&buf);
+	if(send_header) pp_send_header(&buf, img);
+	pq_sendbytes(&buf, PP_DATA(img), PP_DATALEN(img));
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
 }
 
-PG_FUNCTION_INFO_V1(image_new);
-Datum   image_new(PG_FUNCTION_ARGS)
+/*
+ * Rebuilds an image sent with its header, checking it
+ * against the data as far as that's cheap: no decoding
+ */
+PPImage *	pp_recv_header(StringInfo buf)
 {
-    PPImage * res;
-    Image * gimg, * timg;
-    PPColor * color;
-    int32 w, h;
-    ExceptionInfo ex;
-    ImageInfo * iinfo;
-    char * map;
-    Oid ccs;
+	PPImage hdr;
+	PPSectionData sects[PP_MAX_SECTIONS];
+	StringInfoData pyr;
+	PPPreview pv;
+	PPColorspace * cspaces;
+	const char * data, * csname;
+	char digest[DIGESTLEN];
+	int version, id, i;
+	uint32 len;
 
-	w = PG_GETARG_INT32(0);
-	h = PG_GETARG_INT32(1);
-	color = (PPColor*) PG_GETARG_POINTER(2);
-	GetExceptionInfo(&ex);
+	memset(&hdr, 0, sizeof(PPImage));
+	memset(sects, 0, sizeof(sects));
+	pq_getmsgbytes(buf, 4);		/* the magic */
+	version = pq_getmsgint(buf, 2);
+	if(version != PP_WIRE_VERSION) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+			 errmsg("unsupported image wire format version %d", version)));
+	}
+	hdr.format = pq_getmsgbyte(buf);
+	hdr.orientation = pq_getmsgbyte(buf);
+	hdr.width = pq_getmsgint(buf, 4);
+	hdr.height = pq_getmsgint(buf, 4);
+	csname = pq_getmsgstring(buf);
+	cspaces = pp_colorspaces();
+	for(i = 0; cspaces[i].name && strcmp(csname, cspaces[i].name); ++i);
+	hdr.cspace = cspaces[i].name ? cspaces[i].oid : CS_UNKNOWN.oid;
+	hdr.date = PP_DATE_FROM_WIRE(pq_getmsgint64(buf));
+	hdr.iso = pq_getmsgint(buf, 4);
+	hdr.f_number = pq_getmsgfloat4(buf);
+	hdr.exposure_t = pq_getmsgfloat4(buf);
+	hdr.focal_l = pq_getmsgfloat4(buf);
 
-	iinfo = CloneImageInfo(NULL);
-	strcpy(iinfo->magick, "JPEG");
-	ccs = color->cs;
-	if(ccs == CS_RGB.oid || ccs == CS_sRGB.oid) {
-		map = "PRGB";
-		iinfo->colorspace = RGBColorspace;
-    } else if(ccs == CS_RGBA.oid) {
-    	map = "RGBA";
-    	iinfo->colorspace = TransparentColorspace;
-	} else if(ccs == CS_CMYK.oid) {
-		map = "CMYK";
-		iinfo->colorspace = CMYKColorspace;
-	} else if(ccs == CS_GRAY.oid) {
-		map = "PPPI";
-		iinfo->colorspace = GRAYColorspace;
-	} else {
-		elog(ERROR, "Unsupported colorspace %d", color->cs);
-		/* Not needed, just to make the compiler happy */
-		PG_RETURN_NULL();
-	}
-	timg = ConstituteImage( 1, 1, // w x h
-                     map, // data interpretation
-                     CharPixel,
-                     &color->cd, // actual pixel data
-                     &ex );
-	gimg = AllocateImage(iinfo);
-	gimg->columns = w;
-	gimg->rows = h;
-	TransformColorspace(gimg, iinfo->colorspace);
-	TextureImage(gimg, timg);
+	while((id = pq_getmsgbyte(buf)) != PP_WIRE_END) {
+		len = pq_getmsgint(buf, 4);
+		data = pq_getmsgbytes(buf, len);
+		switch(id) {
+			case PPS_METADATA:
+				pp_recv_metadata(data, len);
+				break;
+			case PPS_DIGEST:
+				if(len != DIGESTLEN) pp_recv_error("malformed digest section");
+				break;
+			case PPS_PYRAMID:
+				pp_recv_pyramid(data, len, &pyr);
+				data = pyr.data;
+				len = pyr.len;
+				break;
+			default:
+				/* from a newer version, leave it out */
+				continue;
+		}
+		sects[id].data = data;
+		sects[id].len = len;
+	}
+	len = pq_getmsgint(buf, 4);
+	data = pq_getmsgbytes(buf, len);
 
-    res = pp_init_image(gimg);
-    gm_image_destroy(gimg);
-	gm_image_destroy(timg);
-    DestroyImageInfo(iinfo);
-    DestroyExceptionInfo(&ex);
-    PG_RETURN_POINTER(res);
+	pp_check_wire(&hdr, data, len);
+	if(hdr.format == PP_FMT_JPEG && pp_find_preview(data, len, &pv)) {
+		sects[PPS_PREVIEW].data = &pv;
+		sects[PPS_PREVIEW].len = sizeof(PPPreview);
+	}
+	/* deduplication trusts digests: never take the sender's word for it */
+	pp_md5(data, len, digest);
+	if(sects[PPS_DIGEST].data && memcmp(sects[PPS_DIGEST].data, digest, DIGESTLEN)) {
+		pp_recv_error("digest doesn't match the image data");
+	}
+	sects[PPS_DIGEST].data = digest;
+	sects[PPS_DIGEST].len = DIGESTLEN;
+	return pp_assemble(&hdr, sects, data, len);
 }
 
-
-PG_FUNCTION_INFO_V1(color_in);
-Datum	color_in(PG_FUNCTION_ARGS)
+/*
+ * Metadata must be key\0value\0 pairs, as pp_meta_lookup expects,
+ * in the database encoding, as pp_meta_append makes sure at ingest
+ */
+void	pp_recv_metadata(const char * data, uint32 len)
 {
-	char * cstr;
-	PPColor * color;
-	
-	cstr = PG_GETARG_CSTRING(0);
-	color = palloc(sizeof(PPColor));
-	pp_parse_color(cstr, color);
-	
-	PG_RETURN_POINTER(color);
+	const char * end;
+	uint32 i = 0;
+	int n = 0;
+
+	while(i < len) {
+		end = memchr(data + i, 0, len - i);
+		if(!end || !pg_verifymbstr(data + i, end - data - i, true)) {
+			pp_recv_error("malformed metadata section");
+		}
+		i = end - data + 1;
+		++n;
+	}
+	if(n % 2) pp_recv_error("malformed metadata section");
 }
 
-PG_FUNCTION_INFO_V1(color_out);
-Datum   color_out(PG_FUNCTION_ARGS)
+void	pp_recv_pyramid(const char * data, uint32 len, StringInfo sect)
 {
-	int i = 1;
-	char * str = palloc (COLORLEN);
-	PPColor * color = (PPColor*) PG_GETARG_POINTER(0);
-	while (colorspaces[i].name && color->cs!=colorspaces[i].oid) ++i;
-	if (!(colorspaces[i].name)) i=0;
-	sprintf(str, "%s#%x", colorspaces[i].name, ntohl(color->cd));
-	PG_RETURN_CSTRING(str);
+	StringInfoData msg;
+	PPPyramid * pyr;
+	int32 n, i;
+	uint32 blen;
+
+	msg.data = (char *) data;
+	msg.len = msg.maxlen = len;
+	msg.cursor = 0;
+	n = pq_getmsgint(&msg, 4);
+	if(n < 0 || n > PP_MAX_LEVELS) pp_recv_error("malformed pyramid section");
+	initStringInfo(sect);
+	enlargeStringInfo(sect, offsetof(PPPyramid, levels) + n * sizeof(PPLevel));
+	sect->len = offsetof(PPPyramid, levels) + n * sizeof(PPLevel);
+	((PPPyramid *) sect->data)->nlevels = n;
+	for(i = 0; i < n; ++i) {
+		pyr = (PPPyramid *) sect->data;
+		pyr->levels[i].width = pq_getmsgint(&msg, 4);
+		pyr->levels[i].height = pq_getmsgint(&msg, 4);
+		blen = pq_getmsgint(&msg, 4);
+		pyr->levels[i].len = blen;
+		pyr->levels[i].off = sect->len;
+		if(pyr->levels[i].width <= 0 || pyr->levels[i].height <= 0) {
+			pp_recv_error("malformed pyramid section");
+		}
+		appendBinaryStringInfo(sect, pq_getmsgbytes(&msg, blen), blen);
+	}
+	if(msg.cursor != msg.len) pp_recv_error("malformed pyramid section");
 }
 
-PG_FUNCTION_INFO_V1(image_thumbnail);
-Datum   image_thumbnail(PG_FUNCTION_ARGS)
+/*
+ * The data must be of the stated format and size: JPEGs are
+ * checked by walking their markers, others are pinged by GM,
+ * which reads the header alone
+ */
+void	pp_check_wire(const PPImage * hdr, const char * data, uint32 len)
 {
+	ImageInfo * iinfo;
+	Image * gimg;
 	ExceptionInfo ex;
-	int32 size, sx, sy;
-	PPImage * img, *res;
-	Image * gimg, * timg;
-	
-	img = PG_GETARG_IMAGE(0);
-	size = PG_GETARG_INT32(1);
-	gimg = gm_image_from_bytea(&img->imgdata);
-	if(img->width >= img->height) {
-		sx = size;
-		sy = img->height * size / img->width;
+	int w = 0, h = 0, ncomp;
+
+	if(hdr->width <= 0 || hdr->height <= 0) pp_recv_error("invalid image size");
+	if(hdr->format >= lengthof(formats) - 1) pp_recv_error("unknown image format");
+	pp_check_pixels(hdr->width, hdr->height);
+	if(hdr->format == PP_FMT_JPEG) {
+		if(pp_jpeg_dimensions((const unsigned char *) data, len, &w, &h, &ncomp)) {
+			pp_recv_error("invalid JPEG data");
+		}
 	} else {
-		sy = size;
-		sx = img->width * size / img->height;
+		GetExceptionInfo(&ex);
+		iinfo = gm_track(CloneImageInfo(NULL), PP_RES_IMAGEINFO);
+		gimg = PingBlob(iinfo, data, len, &ex);
+		gm_destroy(iinfo, PP_RES_IMAGEINFO);
+		if(!gimg) gm_raise(&ex, "invalid image data");
+		/* DestroyImage would leave the other frames behind */
+		gimg = gm_track(gm_take_frame(gimg, gimg), PP_RES_IMAGE);
+		DestroyExceptionInfo(&ex);
+		if(hdr->format != PP_FMT_UNKNOWN && pp_parse_format(gimg->magick) != hdr->format) {
+			gm_image_destroy(gimg);
+			pp_recv_error("image data doesn't match the format in the header");
+		}
+		w = gimg->columns;
+		h = gimg->rows;
+		gm_image_destroy(gimg);
+	}
+	if(w != hdr->width || h != hdr->height) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+			 errmsg("image is %dx%d, header says %dx%d", w, h, hdr->width, hdr->height)));
 	}
-	GetExceptionInfo(&ex);
-	timg = ThumbnailImage(gimg, sx, sy, &ex);
-	res = pp_init_image(timg);
-			
-	gm_image_destroy(gimg);
-	gm_image_destroy(timg);
-	DestroyExceptionInfo(&ex);
-	PG_RETURN_POINTER(res);	
 }
 
-PG_FUNCTION_INFO_V1(image_resize);
-Datum   image_resize(PG_FUNCTION_ARGS)
+void	pp_recv_error(const char * msg)
 {
-	ExceptionInfo ex;
-	int32 sx, sy;
-	PPImage * img, * res;
-	Image * gimg, * timg;
-	
-	img = PG_GETARG_IMAGE(0);
-	sx = PG_GETARG_INT32(1);
+	ereport(ERROR,
+		(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+		 errmsg("%s", msg)));
+}
+
+/*
+ * Wire format, version 1, all integers in network order:
+ *   "PPIC", version (int16), format (int8), orientation (int8),
+ *   width, height (int32), colorspace name (string), date (int64
+ *   microseconds, as timestamp_send), iso (int32), f_number,
+ *   exposure_t, focal_l (float4),
+ *   sections: { id (int8), length (int32), payload }, ended by id 255,
+ *   image data length (int32), then the image data itself.
+ * The preview is found again on receive, the pyramid is sent
+ * as nlevels, then width, height, length and data of each level.
+ */
+void	pp_send_header(StringInfo buf, const PPImage * img)
+{
+	PPSectionData sects[PP_MAX_SECTIONS];
+	PPPyramid * pyr;
+	PPColorspace * cspaces;
+	uint32 len;
+	int i = 0, j;
+
+	pq_sendbytes(buf, PP_WIRE_MAGIC, 4);
+	pq_sendint(buf, PP_WIRE_VERSION, 2);
+	pq_sendint(buf, img->format, 1);
+	pq_sendint(buf, img->orientation, 1);
+	pq_sendint(buf, img->width, 4);
+	pq_sendint(buf, img->height, 4);
+	cspaces = pp_colorspaces();
+	while(cspaces[i].name && img->cspace != cspaces[i].oid) ++i;
+	pq_sendstring(buf, cspaces[i].name ? cspaces[i].name : CS_UNKNOWN.name);
+	pq_sendint64(buf, PP_DATE_TO_WIRE(img->date));
+	pq_sendint(buf, img->iso, 4);
+	pq_sendfloat4(buf, img->f_number);
+	pq_sendfloat4(buf, img->exposure_t);
+	pq_sendfloat4(buf, img->focal_l);
+
+	pp_get_sections(img, sects);
+	for(i = 0; i < PP_MAX_SECTIONS; ++i) {
+		if(!sects[i].data) continue;
+		switch(i) {
+			case PPS_METADATA:
+			case PPS_DIGEST:
+				pq_sendint(buf, i, 1);
+				pq_sendint(buf, sects[i].len, 4);
+				pq_sendbytes(buf, sects[i].data, sects[i].len);
+				break;
+			case PPS_PYRAMID:
+				pyr = (PPPyramid *) sects[i].data;
+				len = 4;
+				for(j = 0; j < pyr->nlevels; ++j) len += 12 + pyr->levels[j].len;
+				pq_sendint(buf, i, 1);
+				pq_sendint(buf, len, 4);
+				pq_sendint(buf, pyr->nlevels, 4);
+				for(j = 0; j < pyr->nlevels; ++j) {
+					pq_sendint(buf, pyr->levels[j].width, 4);
+					pq_sendint(buf, pyr->levels[j].height, 4);
+					pq_sendint(buf, pyr->levels[j].len, 4);
+					pq_sendbytes(buf, (const char *) pyr + pyr->levels[j].off, pyr->levels[j].len);
+				}
+				break;
+		}
+	}
+	pq_sendint(buf, PP_WIRE_END, 1);
+	pq_sendint(buf, PP_DATALEN(img), 4);
+}
+
+PG_FUNCTION_INFO_V1(image_recv);
+Datum   image_recv(PG_FUNCTION_ARGS)
+{
+	PPImage * img;
+	Datum data;
+	bytea * imgdata;
+	StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+	int32 typmod = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : -1;
+
+	if(buf->len - buf->cursor >= 4 && !memcmp(buf->data + buf->cursor, PP_WIRE_MAGIC, 4)) {
+		img = pp_recv_header(buf);
+	} else {
+		/* just the encoded image */
+		data = DirectFunctionCall1(bytearecv,PG_GETARG_DATUM(0));
+		imgdata  = (bytea *) DatumGetPointer(data);
+		img = pp_ingest_blob(VARDATA(imgdata), VARSIZE(imgdata) - VARHDRSZ);
+	}
+	PG_RETURN_DATUM(pp_enforce_typmod(PointerGetDatum(img), typmod));
+}
+
+/*
+ * image(max_width, max_height [, format [, quality]]), e.g.
+ * image(1024, 1024, jpeg, 80). Sides go up to 4096, quality
+ * in steps of 10.
+ */
+PG_FUNCTION_INFO_V1(image_typmod_in);
+Datum	image_typmod_in(PG_FUNCTION_ARGS)
+{
+	ArrayType * ta = PG_GETARG_ARRAYTYPE_P(0);
+	Datum * elems;
+	char * str;
+	int32 w, h, format = 0, quality = 0;
+	int n;
+
+	deconstruct_array(ta, CSTRINGOID, -2, false, 'c', &elems, NULL, &n);
+	if(n < 2 || n > 4) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("image type modifiers are max_width, max_height, and optionally format and quality")));
+	}
+	w = pp_typmod_int(DatumGetCString(elems[0]), 1, PP_TYPMOD_MAXSIDE, "max_width");
+	h = pp_typmod_int(DatumGetCString(elems[1]), 1, PP_TYPMOD_MAXSIDE, "max_height");
+	if(n > 2) {
+		str = DatumGetCString(elems[2]);
+		for(format = 1; formats[format] && pg_strcasecmp(str, formats[format]); ++format);
+		if(!formats[format]) {
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unknown image format \"%s\"", str)));
+		}
+	}
+	if(n > 3) {
+		quality = pp_typmod_int(DatumGetCString(elems[3]), 10, 100, "quality");
+		if(quality % 10) {
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("image quality must be a multiple of 10")));
+		}
+	}
+	PG_RETURN_INT32(PP_TYPMOD(w, h, format, quality));
+}
+
+PG_FUNCTION_INFO_V1(image_typmod_out);
+Datum	image_typmod_out(PG_FUNCTION_ARGS)
+{
+	int32 typmod = PG_GETARG_INT32(0);
+	char * str = palloc(3*INTLEN + VERLEN);
+
+	if(typmod < 0) {
+		*str = '\0';
+	} else if(PP_TYPMOD_QUALITY(typmod)) {
+		sprintf(str, "(%d,%d,%s,%d)", PP_TYPMOD_WIDTH(typmod), PP_TYPMOD_HEIGHT(typmod),
+			formats[PP_TYPMOD_FORMAT(typmod)], PP_TYPMOD_QUALITY(typmod));
+	} else if(PP_TYPMOD_FORMAT(typmod)) {
+		sprintf(str, "(%d,%d,%s)", PP_TYPMOD_WIDTH(typmod), PP_TYPMOD_HEIGHT(typmod),
+			formats[PP_TYPMOD_FORMAT(typmod)]);
+	} else {
+		sprintf(str, "(%d,%d)", PP_TYPMOD_WIDTH(typmod), PP_TYPMOD_HEIGHT(typmod));
+	}
+	PG_RETURN_CSTRING(str);
+}
+
+/*
+ * Length coercion, applying the type modifier
+ */
+PG_FUNCTION_INFO_V1(image_enforce_typmod);
+Datum	image_enforce_typmod(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_DATUM(pp_enforce_typmod(PG_GETARG_DATUM(0), PG_GETARG_INT32(1)));
+}
+
+/*
+ * Images larger than the modifier allows are scaled down to fit,
+ * decoded at a reduced size when the format allows it, and images
+ * in another format converted. Those fitting are left untouched,
+ * looking at their header only.
+ */
+Datum	pp_enforce_typmod(Datum d, int32 typmod)
+{
+	ExceptionInfo ex;
+	PPImage * hdr, * res;
+	Image * gimg, * timg;
+	const char * magick;
+	void * blob;
+	size_t blen;
+	int32 w, h, maxw, maxh, format;
+
+	if(typmod < 0) return d;
+	hdr = pp_header_from_datum(d, true);
+	w = hdr->width;
+	h = hdr->height;
+	maxw = PP_TYPMOD_WIDTH(typmod);
+	maxh = PP_TYPMOD_HEIGHT(typmod);
+	format = PP_TYPMOD_FORMAT(typmod);
+	if(w <= maxw && h <= maxh && (!format || format == hdr->format)) return d;
+
+	if(w > maxw || h > maxh) {
+		if((int64) w * maxh > (int64) h * maxw) {
+			h = Max(1, (int64) h * maxw / w);
+			w = maxw;
+		} else {
+			w = Max(1, (int64) w * maxh / h);
+			h = maxh;
+		}
+	}
+	if(!format) format = hdr->format;
+	/* GM can't tell what to write for an unknown format */
+	magick = format != PP_FMT_UNKNOWN ? formats[format] : "PNG";
+
+	/* what fits once scaled down may be decoded at a reduced size */
+	pp_check_pixels(w, h);
+	gimg = gm_image_at_size(d, hdr, w, h);
+	GetExceptionInfo(&ex);
+	timg = gimg;
+	if(gimg->columns != w || gimg->rows != h) {
+		timg = gm_result(gm_resize(gimg, w, h, FILTER_DEFAULT, &ex), &ex);
+	}
+	blob = gm_image_encode(timg, magick, PP_TYPMOD_QUALITY(typmod), &blen, &ex);
+	strlcpy(timg->magick, magick, MaxTextExtent);
+	res = pp_ingest_image(timg, blob, blen);
+	pp_copy_exif(res, hdr);
+
+	gm_destroy(blob, PP_RES_BLOB);
+	if(timg != gimg) gm_image_destroy(timg);
+	gm_image_destroy(gimg);
+	DestroyExceptionInfo(&ex);
+	return PointerGetDatum(res);
+}
+
+int		pp_typmod_int(const char * str, int min, int max, const char * what)
+{
+	char * end;
+	long val = strtol(str, &end, 10);
+
+	if(end == str || *end || val < min || val > max) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("image %s must be between %d and %d", what, min, max)));
+	}
+	return val;
+}
+
+PG_FUNCTION_INFO_V1(image_new);
+Datum   image_new(PG_FUNCTION_ARGS)
+{
+    PPImage * res;
+    Image * gimg;
+    PPColor * color;
+    int32 w, h;
+
+	w = PG_GETARG_INT32(0);
+	h = PG_GETARG_INT32(1);
+	color = (PPColor*) PG_GETARG_POINTER(2);
+	pp_check_pixels(w, h);
+
+	res = pp_canvas_lookup(w, h, color);
+	if(res) PG_RETURN_POINTER(res);
+
+	gimg = gm_image_new(w, h, color);
+    res = pp_init_image(gimg);
+    gm_image_destroy(gimg);
+    pp_canvas_store(w, h, color, res);
+    PG_RETURN_POINTER(res);
+}
+
+/*
+ * A w x h image filled with color, writing the pixel
+ * cache directly: the first row pixel by pixel, the
+ * others copying it over
+ */
+Image *	gm_image_new(int32 w, int32 h, const PPColor * color)
+{
+	ImageInfo * iinfo;
+	Image * gimg;
+	PixelPacket px, * row, * q;
+	const unsigned char * cd = (const unsigned char *) &color->cd;
+	Oid ccs = color->cs;
+	ColorspaceType cspace;
+	int32 x, y;
+
+	memset(&px, 0, sizeof(px));
+	iinfo = gm_track(CloneImageInfo(NULL), PP_RES_IMAGEINFO);
+	strcpy(iinfo->magick, "JPEG");
+	/* cd is stored in network order, as in the maps ConstituteImage used to get */
+	if(ccs == CS_RGB.oid || ccs == CS_sRGB.oid) {
+		iinfo->colorspace = RGBColorspace;
+		px.red = ScaleCharToQuantum(cd[1]);
+		px.green = ScaleCharToQuantum(cd[2]);
+		px.blue = ScaleCharToQuantum(cd[3]);
+	} else if(ccs == CS_RGBA.oid) {
+		iinfo->colorspace = RGBColorspace;
+		px.red = ScaleCharToQuantum(cd[0]);
+		px.green = ScaleCharToQuantum(cd[1]);
+		px.blue = ScaleCharToQuantum(cd[2]);
+		px.opacity = MaxRGB - ScaleCharToQuantum(cd[3]);
+	} else if(ccs == CS_CMYK.oid) {
+		iinfo->colorspace = CMYKColorspace;
+		px.red = ScaleCharToQuantum(cd[0]);
+		px.green = ScaleCharToQuantum(cd[1]);
+		px.blue = ScaleCharToQuantum(cd[2]);
+		px.opacity = ScaleCharToQuantum(cd[3]);
+	} else if(ccs == CS_GRAY.oid) {
+		iinfo->colorspace = GRAYColorspace;
+		px.red = px.green = px.blue = ScaleCharToQuantum(cd[3]);
+	} else {
+		gm_destroy(iinfo, PP_RES_IMAGEINFO);
+		elog(ERROR, "Unsupported colorspace %d", color->cs);
+	}
+
+	cspace = iinfo->colorspace;
+	gimg = gm_track(AllocateImage(iinfo), PP_RES_IMAGE);
+	gm_destroy(iinfo, PP_RES_IMAGEINFO);
+	if(!gimg) elog(ERROR, "Unable to allocate image");
+	gimg->columns = w;
+	gimg->rows = h;
+	gimg->colorspace = cspace;
+	gimg->matte = (ccs == CS_RGBA.oid);
+
+	row = palloc(w * sizeof(PixelPacket));
+	row[0] = px;
+	for(x = 1; x < w; x *= 2) memcpy(row + x, row, Min(x, w - x) * sizeof(PixelPacket));
+	for(y = 0; y < h; ++y) {
+		q = SetImagePixels(gimg, 0, y, w, 1);
+		if(!q) break;
+		memcpy(q, row, w * sizeof(PixelPacket));
+		if(!SyncImagePixels(gimg)) break;
+	}
+	pfree(row);
+	if(y < h) {
+		gm_image_destroy(gimg);
+		elog(ERROR, "Unable to fill image");
+	}
+	return gimg;
+}
+
+/*
+ * Solid color canvases come out the same every time:
+ * keep the last few we've encoded around
+ */
+PPImage *	pp_canvas_lookup(int32 w, int32 h, const PPColor * color)
+{
+	PPImage * res;
+	int i;
+
+	for(i = 0; i < PP_CANVAS_CACHE; ++i) {
+		if(canvases[i].img && canvases[i].w == w && canvases[i].h == h
+			&& canvases[i].color.cs == color->cs && canvases[i].color.cd == color->cd) {
+			res = palloc(VARSIZE(canvases[i].img));
+			memcpy(res, canvases[i].img, VARSIZE(canvases[i].img));
+			return res;
+		}
+	}
+	return NULL;
+}
+
+void	pp_canvas_store(int32 w, int32 h, const PPColor * color, const PPImage * img)
+{
+	PPCanvas * c;
+
+	if(!img || VARSIZE(img) > PP_CANVAS_MAXSIZE) return;
+	if(!canvas_context) {
+		canvas_context = AllocSetContextCreate(TopMemoryContext, "PostPic canvases",
+			ALLOCSET_SMALL_MINSIZE, ALLOCSET_SMALL_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
+	}
+	c = &canvases[next_canvas];
+	next_canvas = (next_canvas + 1) % PP_CANVAS_CACHE;
+	if(c->img) pfree(c->img);
+	c->img = MemoryContextAlloc(canvas_context, VARSIZE(img));
+	memcpy(c->img, img, VARSIZE(img));
+	c->w = w;
+	c->h = h;
+	c->color = *color;
+}
+
+
+PG_FUNCTION_INFO_V1(color_in);
+Datum	color_in(PG_FUNCTION_ARGS)
+{
+	char * cstr;
+	PPColor * color;
+	
+	cstr = PG_GETARG_CSTRING(0);
+	color = palloc(sizeof(PPColor));
+	pp_parse_color(cstr, color);
+	
+	PG_RETURN_POINTER(color);
+}
+
+PG_FUNCTION_INFO_V1(color_out);
+Datum   color_out(PG_FUNCTION_ARGS)
+{
+	int i = 1;
+	char * str = palloc (COLORLEN);
+	PPColor * color = (PPColor*) PG_GETARG_POINTER(0);
+	PPColorspace * cspaces = pp_colorspaces();
+	while (cspaces[i].name && color->cs!=cspaces[i].oid) ++i;
+	if (!(cspaces[i].name)) i=0;
+	sprintf(str, "%s#%x", cspaces[i].name, ntohl(color->cd));
+	PG_RETURN_CSTRING(str);
+}
+
+PG_FUNCTION_INFO_V1(image_thumbnail);
+Datum   image_thumbnail(PG_FUNCTION_ARGS)
+{
+	ExceptionInfo ex;
+	int32 size, sx, sy;
+	PPImage * img, *res;
+	Image * gimg, * timg;
+	
+	size = PG_GETARG_INT32(1);
+	if(thumbnail_from_preview) {
+		res = pp_thumbnail_from_preview(PG_GETARG_DATUM(0), size);
+		if(res) PG_RETURN_POINTER(res);
+	}
+	img = PG_GETARG_IMAGE_SECTIONS(0);
+	pp_thumbnail_size(img, size, &sx, &sy);
+	gimg = gm_image_at_size(PG_GETARG_DATUM(0), img, sx, sy);
+	GetExceptionInfo(&ex);
+	timg = gm_result(ThumbnailImage(gimg, sx, sy, &ex), &ex);
+	res = pp_init_image(timg);
+	if(res) pp_copy_exif(res, img);
+			
+	gm_image_destroy(gimg);
+	gm_image_destroy(timg);
+	DestroyExceptionInfo(&ex);
+	PG_RETURN_POINTER(res);	
+}
+
+PG_FUNCTION_INFO_V1(image_preview);
+Datum   image_preview(PG_FUNCTION_ARGS)
+{
+	PPImage * hdr = PG_GETARG_IMAGE_SECTIONS(0);
+	PPPreview pv;
+	char * data;
+
+	if(!pp_get_preview(PG_GETARG_DATUM(0), hdr, &pv)) PG_RETURN_NULL();
+	data = pp_fetch_data(PG_GETARG_DATUM(0), hdr, pv.off, pv.len);
+	PG_RETURN_POINTER(pp_init_preview(hdr, data, &pv));
+}
+
+PG_FUNCTION_INFO_V1(image_pyramid);
+Datum   image_pyramid(PG_FUNCTION_ARGS)
+{
+	PPImage * img, * res;
+	Image * gimg;
+	int32 levels;
+
+	img = PG_GETARG_IMAGE(0);
+	levels = PG_GETARG_INT32(1);
+	if(levels <= 0) {
+		PG_RETURN_POINTER(pp_set_section(img, PPS_PYRAMID, NULL, 0));
+	}
+	gimg = gm_image_from_image(img);
+	res = pp_build_pyramid(img, gimg, levels);
+	gm_image_destroy(gimg);
+	PG_RETURN_POINTER(res);
+}
+
+PG_FUNCTION_INFO_V1(image_pyramid_levels);
+Datum   image_pyramid_levels(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_SECTIONS(0);
+	uint32 len;
+	PPPyramid * pyr = (PPPyramid *) pp_section(img, PPF_PYRAMID, &len);
+
+	/* the section trails the image, fetch just its count */
+	if(!pyr) PG_RETURN_INT32(0);
+	pyr = (PPPyramid *) pp_fetch_section(PG_GETARG_DATUM(0), img,
+		(char *) pyr, offsetof(PPPyramid, levels));
+	PG_RETURN_INT32(pyr->nlevels);
+}
+
+PG_FUNCTION_INFO_V1(image_resize);
+Datum   image_resize(PG_FUNCTION_ARGS)
+{
+	ExceptionInfo ex;
+	int32 sx, sy;
+	PPImage * img, * res;
+	Image * gimg, * timg;
+	const PPFilter * filter = FILTER_DEFAULT;
+	
+	img = PG_GETARG_IMAGE_SECTIONS(0);
+	sx = PG_GETARG_INT32(1);
 	sy = PG_GETARG_INT32(2);
+	if(PG_NARGS() > 3) {
+		filter = pp_parse_filter(pp_varchar2str(PG_GETARG_VARCHAR_P(3)));
+	}
+	pp_check_pixels(sx, sy);
 
-	gimg = gm_image_from_bytea(&img->imgdata);
+	gimg = gm_image_at_size(PG_GETARG_DATUM(0), img, sx, sy);
 	GetExceptionInfo(&ex);
-	timg = ResizeImage(gimg, sx, sy, CubicFilter, 1, &ex);
+	timg = gm_result(gm_resize(gimg, sx, sy, filter, &ex), &ex);
 	res = pp_init_image(timg);
+	if(res) pp_copy_exif(res, img);
 
 	gm_image_destroy(gimg);
 	gm_image_destroy(timg);
@@ -421,554 +1664,3352 @@ Datum   image_crop(PG_FUNCTION_ARGS)
 	rect.width = cw;
 	rect.height = ch;
 
-	gimg = gm_image_from_bytea(&img->imgdata);
+	gimg = gm_image_from_image(img);
 	GetExceptionInfo(&ex);
-	timg = CropImage(gimg, &rect, &ex);
+	timg = gm_result(CropImage(gimg, &rect, &ex), &ex);
 	res = pp_init_image(timg);
+	if(res) pp_copy_exif(res, img);
+
+	gm_image_destroy(gimg);
+	gm_image_destroy(timg);
+	DestroyExceptionInfo(&ex);
+	PG_RETURN_POINTER(res);	
+}
+
+/*
+ * Cuts the image, scaled down by 2^level, into tile_size squares
+ * (smaller at the right and bottom edges), decoding it just once
+ */
+PG_FUNCTION_INFO_V1(image_tiles);
+Datum   image_tiles(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo * rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate * tupstore;
+	MemoryContext oldcontext;
+	ExceptionInfo ex;
+	RectangleInfo rect;
+	Datum values[4];
+	bool nulls[4] = { false, false, false, false };
+	int32 tsize, level, lw, lh, x, y;
+	PPImage * img, * res;
+	Image * gimg, * limg, * timg;
+
+	if(!rsinfo || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize)) {
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("set-valued function called in context that cannot accept a set")));
+	}
+	if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	img = PG_GETARG_IMAGE_SECTIONS(0);
+	tsize = PG_GETARG_INT32(1);
+	level = PG_GETARG_INT32(2);
+	if(tsize <= 0 || level < 0 || level > 30) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid tile size %d or level %d", tsize, level)));
+	}
+	lw = Max(img->width >> level, 1);
+	lh = Max(img->height >> level, 1);
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	gimg = gm_image_at_size(PG_GETARG_DATUM(0), img, lw, lh);
+	GetExceptionInfo(&ex);
+	limg = gimg;
+	if(gimg->columns != (unsigned long) lw || gimg->rows != (unsigned long) lh) {
+		limg = gm_result(gm_resize(gimg, lw, lh, FILTER_DEFAULT, &ex), &ex);
+	}
+	for(y = 0; limg && y < lh; y += tsize) {
+		for(x = 0; x < lw; x += tsize) {
+			/* GM objects are tracked: cancelling frees them */
+			CHECK_FOR_INTERRUPTS();
+			rect.x = x; rect.y = y;
+			rect.width = Min(tsize, lw - x);
+			rect.height = Min(tsize, lh - y);
+			timg = gm_result(CropImage(limg, &rect, &ex), &ex);
+			res = pp_init_image(timg);
+			if(res) pp_copy_exif(res, img);
+			gm_image_destroy(timg);
+			if(!res) continue;
+			values[0] = Int32GetDatum(level);
+			values[1] = Int32GetDatum(x / tsize);
+			values[2] = Int32GetDatum(y / tsize);
+			values[3] = PointerGetDatum(res);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			pfree(res);
+		}
+	}
+	if(limg != gimg) gm_image_destroy(limg);
+	gm_image_destroy(gimg);
+	DestroyExceptionInfo(&ex);
+
+	return (Datum) 0;
+}
+
+/*
+ * Single frame formats answer from the header, the others
+ * by pinging every frame
+ */
+PG_FUNCTION_INFO_V1(image_page_count);
+Datum	image_page_count(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+
+	if(!PP_MULTIFRAME(img->format)) PG_RETURN_INT32(1);
+	img = PG_GETARG_IMAGE(0);
+	PG_RETURN_INT32(gm_page_count(PP_DATA(img), PP_DATALEN(img)));
+}
+
+/*
+ * Frame (or page) number page, from 0, in the original's format:
+ * only what's needed to render it is decoded
+ */
+PG_FUNCTION_INFO_V1(image_page);
+Datum	image_page(PG_FUNCTION_ARGS)
+{
+	ExceptionInfo ex;
+	PPImage * img, * res;
+	Image * gimg;
+	const char * magick;
+	void * blob;
+	size_t blen;
+	int32 page = PG_GETARG_INT32(1), n = 1;
+
+	img = PG_GETARG_IMAGE_HEADER(0);
+	if(PP_MULTIFRAME(img->format)) {
+		img = PG_GETARG_IMAGE(0);
+		n = gm_page_count(PP_DATA(img), PP_DATALEN(img));
+	}
+	if(page < 0 || page >= n) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("image has no page %d", page),
+			 errdetail_plural("It has %d page, numbered from 0.",
+				"It has %d pages, numbered from 0.", n, n)));
+	}
+	if(n == 1) PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+	pp_check_pixels(img->width, img->height);
+	gimg = gm_image_page(PP_DATA(img), PP_DATALEN(img), img->format, page, 0, 0);
+	/* GM can't tell what to write for an unknown format */
+	magick = img->format != PP_FMT_UNKNOWN ? formats[img->format] : "PNG";
+	GetExceptionInfo(&ex);
+	blob = gm_image_to_blob_fmt(gimg, magick, &blen, &ex);
+	strlcpy(gimg->magick, magick, MaxTextExtent);
+	res = pp_init_image_full(gimg, blob, blen);
+	if(res) pp_copy_exif(res, img);
+	gm_destroy(blob, PP_RES_BLOB);
+	gm_image_destroy(gimg);
+	DestroyExceptionInfo(&ex);
+	PG_RETURN_POINTER(res);
+}
+
+/*
+ * Statistics on image content. They work on a copy reduced
+ * to PP_ANALYSIS_SIZE, which is plenty for them.
+ */
+PG_FUNCTION_INFO_V1(image_histogram);
+Datum   image_histogram(PG_FUNCTION_ARGS)
+{
+	int32 bins = PG_GETARG_INT32(1);
+	unsigned char * px;
+	unsigned int * hist;
+	size_t n;
+	Datum * elems;
+	int dims[2], lbs[2] = { 1, 1 }, i;
+
+	if(bins <= 0 || bins > 256 || (bins & (bins - 1))) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("bins must be a power of 2 between 1 and 256")));
+	}
+	px = gm_analysis_pixels(PG_GETARG_DATUM(0), &n);
+	hist = palloc(3 * bins * sizeof(unsigned int));
+	pp_histogram(px, n, bins, hist);
+	elems = palloc(3 * bins * sizeof(Datum));
+	for(i = 0; i < 3 * bins; ++i) elems[i] = Float4GetDatum((float4) hist[i] / n);
+	dims[0] = 3;
+	dims[1] = bins;
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, NULL, 2, dims, lbs,
+		FLOAT4OID, sizeof(float4), FLOAT4PASSBYVAL, 'i'));
+}
+
+PG_FUNCTION_INFO_V1(image_average_color);
+Datum   image_average_color(PG_FUNCTION_ARGS)
+{
+	PPPixelStats st;
+	unsigned char * px, rgb[3];
+	size_t n;
+	int i;
+
+	px = gm_analysis_pixels(PG_GETARG_DATUM(0), &n);
+	pp_pixel_stats(px, n, &st);
+	for(i = 0; i < 3; ++i) rgb[i] = (st.sum[i] + n / 2) / n;
+	return pp_make_color(rgb);
+}
+
+PG_FUNCTION_INFO_V1(image_dominant_colors);
+Datum   image_dominant_colors(PG_FUNCTION_ARGS)
+{
+	int32 ncolors = PG_GETARG_INT32(1);
+	unsigned char * px, * rgb;
+	unsigned int * counts;
+	size_t n;
+	Datum * elems;
+	int found, i;
+
+	if(ncolors <= 0 || ncolors > 256) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("number of colors must be between 1 and 256")));
+	}
+	px = gm_analysis_pixels(PG_GETARG_DATUM(0), &n);
+	rgb = palloc(ncolors * 3);
+	counts = palloc(ncolors * sizeof(unsigned int));
+	found = pp_dominant_colors(px, n, ncolors, rgb, counts);
+	elems = palloc(Max(found, 1) * sizeof(Datum));
+	for(i = 0; i < found; ++i) elems[i] = pp_make_color(rgb + i * 3);
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, found,
+		get_element_type(get_fn_expr_rettype(fcinfo->flinfo)),
+		sizeof(PPColor), false, 'i'));
+}
+
+/*
+ * Luma (Rec. 601) of the average color, from 0 to 1
+ */
+PG_FUNCTION_INFO_V1(image_brightness);
+Datum   image_brightness(PG_FUNCTION_ARGS)
+{
+	PPPixelStats st;
+	unsigned char * px;
+	size_t n;
+
+	px = gm_analysis_pixels(PG_GETARG_DATUM(0), &n);
+	pp_pixel_stats(px, n, &st);
+	PG_RETURN_FLOAT4((0.299 * st.sum[0] + 0.587 * st.sum[1] + 0.114 * st.sum[2]) / (255.0 * n));
+}
+
+/*
+ * Hasler and Suesstrunk's colorfulness metric: 0 for grays,
+ * around 50 for average photos, above 100 for very colorful ones
+ */
+PG_FUNCTION_INFO_V1(image_colorfulness);
+Datum   image_colorfulness(PG_FUNCTION_ARGS)
+{
+	PPPixelStats st;
+	unsigned char * px;
+	size_t n;
+	double mrg, myb, vrg, vyb;
+
+	px = gm_analysis_pixels(PG_GETARG_DATUM(0), &n);
+	pp_pixel_stats(px, n, &st);
+	mrg = (double) st.sum_rg / n;
+	myb = (double) st.sum_yb / (2.0 * n);
+	vrg = (double) st.sumsq_rg / n - mrg * mrg;
+	vyb = (double) st.sumsq_yb / (4.0 * n) - myb * myb;
+	PG_RETURN_FLOAT4(sqrt(Max(vrg, 0.0) + Max(vyb, 0.0)) + 0.3 * sqrt(mrg * mrg + myb * myb));
+}
+
+/*
+ * The image resized to width x height as float4[], RGB, either [3][h][w]
+ * (layout 'chw') or [h][w][3] ('hwc'), each value being
+ * (pixel / 255 - mean) / std for its channel
+ */
+PG_FUNCTION_INFO_V1(image_tensor);
+Datum   image_tensor(PG_FUNCTION_ARGS)
+{
+	PPTensor ts;
+	ArrayType * res;
+	unsigned char * px;
+	Size n, nbytes;
+	int dims[3], lbs[3] = { 1, 1, 1 };
+
+	/* not strict, for the NULL defaults of mean and std */
+	if(PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3)) PG_RETURN_NULL();
+	pp_tensor_args(fcinfo, &ts);
+	n = (Size) ts.width * ts.height;
+	/* from the requested size, before decoding anything */
+	nbytes = ARR_OVERHEAD_NONULLS(3) + n * 3 * sizeof(float4);
+	if(nbytes > MaxAllocSize) {
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("tensor too large")));
+	}
+	px = gm_pixels_at_size(PG_GETARG_DATUM(0), pp_header_from_datum(PG_GETARG_DATUM(0), true),
+		ts.width, ts.height, pp_parse_filter("triangle"));
+	if(ts.planar) {
+		dims[0] = 3; dims[1] = ts.height; dims[2] = ts.width;
+	} else {
+		dims[0] = ts.height; dims[1] = ts.width; dims[2] = 3;
+	}
+	/* fill the array in place */
+	res = (ArrayType *) palloc0(nbytes);
+	SET_VARSIZE(res, nbytes);
+	res->ndim = 3;
+	res->dataoffset = 0;
+	res->elemtype = FLOAT4OID;
+	memcpy(ARR_DIMS(res), dims, sizeof(dims));
+	memcpy(ARR_LBOUND(res), lbs, sizeof(lbs));
+	pp_rgba8_to_float(px, n, ts.planar, ts.scale, ts.bias, (float *) ARR_DATA_PTR(res));
+	pfree(px);
+	PG_RETURN_ARRAYTYPE_P(res);
+}
+
+/*
+ * As image_tensor, as raw float32 values in the server's byte
+ * order, to be read straight into a buffer by data loaders
+ */
+PG_FUNCTION_INFO_V1(image_tensor_bytes);
+Datum   image_tensor_bytes(PG_FUNCTION_ARGS)
+{
+	PPTensor ts;
+	bytea * res;
+	unsigned char * px;
+	Size n, nbytes;
+
+	/* not strict, for the NULL defaults of mean and std */
+	if(PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3)) PG_RETURN_NULL();
+	pp_tensor_args(fcinfo, &ts);
+	n = (Size) ts.width * ts.height;
+	nbytes = VARHDRSZ + n * 3 * sizeof(float);
+	if(nbytes > MaxAllocSize) {
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("tensor too large")));
+	}
+	px = gm_pixels_at_size(PG_GETARG_DATUM(0), pp_header_from_datum(PG_GETARG_DATUM(0), true),
+		ts.width, ts.height, pp_parse_filter("triangle"));
+	res = (bytea *) palloc(nbytes);
+	SET_VARSIZE(res, nbytes);
+	pp_rgba8_to_float(px, n, ts.planar, ts.scale, ts.bias, (float *) VARDATA(res));
+	pfree(px);
+	PG_RETURN_BYTEA_P(res);
+}
+
+/*
+ * Arguments shared by the tensor functions: image, width, height,
+ * layout, mean[3], std[3]. NULL mean and std mean 0 and 1.
+ */
+void	pp_tensor_args(FunctionCallInfo fcinfo, PPTensor * ts)
+{
+	char * layout = pp_varchar2str(PG_GETARG_VARCHAR_P(3));
+	float mean[3] = { 0, 0, 0 }, std[3] = { 1, 1, 1 };
+	PPArray marr, sarr;
+	int i;
+
+	ts->width = PG_GETARG_INT32(1);
+	ts->height = PG_GETARG_INT32(2);
+	/* before the sizes get multiplied by the callers */
+	pp_check_pixels(ts->width, ts->height);
+	if(!pg_strcasecmp(layout, "chw")) ts->planar = true;
+	else if(!pg_strcasecmp(layout, "hwc")) ts->planar = false;
+	else {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unknown tensor layout \"%s\"", layout),
+			 errhint("Use 'chw' or 'hwc'.")));
+	}
+	pp_get_array(fcinfo, 4, &marr);
+	pp_get_array(fcinfo, 5, &sarr);
+	for(i = 0; i < 3; ++i) {
+		if((marr.n && (marr.n != 3 || marr.nulls[i])) || (sarr.n && (sarr.n != 3 || sarr.nulls[i]))) {
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("mean and std need one value per channel")));
+		}
+		if(marr.n) mean[i] = DatumGetFloat4(marr.elems[i]);
+		if(sarr.n) std[i] = DatumGetFloat4(sarr.elems[i]);
+	}
+	for(i = 0; i < 3; ++i) {
+		if(std[i] == 0) {
+			ereport(ERROR,
+				(errcode(ERRCODE_DIVISION_BY_ZERO),
+				 errmsg("std can't be zero")));
+		}
+		ts->scale[i] = 1.0f / (255.0f * std[i]);
+		ts->bias[i] = -mean[i] / std[i];
+	}
+}
+
+Datum	pp_make_color(const unsigned char * rgb)
+{
+	PPColor * color = palloc(sizeof(PPColor));
+
+	color->cs = CS_RGB.oid;
+	color->cd = htonl((rgb[0] << 16) | (rgb[1] << 8) | rgb[2]);
+	return PointerGetDatum(color);
+}
+
+PG_FUNCTION_INFO_V1(image_rotate);
+Datum   image_rotate(PG_FUNCTION_ARGS)
+{
+	ExceptionInfo ex;
+	float4 deg;
+	double rad, c, s;
+	PPImage * img, *res;
+	Image * gimg, * timg;
+	
+	img = PG_GETARG_IMAGE(0);
+	deg = PG_GETARG_FLOAT4(1);
+	/* the bounding box of the rotated image */
+	rad = deg * M_PI / 180.0;
+	c = fabs(cos(rad));
+	s = fabs(sin(rad));
+	pp_check_pixels((int64) ceil(img->width * c + img->height * s),
+		(int64) ceil(img->width * s + img->height * c));
+
+	gimg = gm_image_from_image(img);
+	GetExceptionInfo(&ex);
+	timg = gm_result(RotateImage(gimg, deg, &ex), &ex);
+	res = pp_init_image(timg);
+	if(res) pp_copy_exif(res, img);
+
+	gm_image_destroy(gimg);
+	gm_image_destroy(timg);
+	DestroyExceptionInfo(&ex);
+	PG_RETURN_POINTER(res);
+}
+
+PG_FUNCTION_INFO_V1(image_square);
+Datum   image_square(PG_FUNCTION_ARGS)
+{
+	ExceptionInfo ex;
+	RectangleInfo ri;
+	int32 size, sx, sy;
+	PPImage * img, * res;
+	Image * gimg, * timg, * simg;
+	
+	img = PG_GETARG_IMAGE_SECTIONS(0);
+	size = PG_GETARG_INT32(1);
+
+	ri.x = ri.y = 0;
+	ri.width = ri.height = size;
+	/* the thumbnail is cropped afterwards, and needs the pixels first */
+	if(img->width < img->height) {
+		sx = size;
+		sy = Min((int64) img->height * size / img->width, INT_MAX);
+		pp_check_pixels(sx, sy);
+		ri.y = (sy-sx)/2;
+	} else {
+		sy = size;
+		sx = Min((int64) img->width * size / img->height, INT_MAX);
+		pp_check_pixels(sx, sy);
+		ri.x = (sx-sy)/2;
+	}
+	gimg = gm_image_at_size(PG_GETARG_DATUM(0), img, sx, sy);
+	GetExceptionInfo(&ex);
+	timg = gm_result(ThumbnailImage(gimg, sx, sy, &ex), &ex);
+	simg = gm_result(CropImage(timg, &ri, &ex), &ex);
+	res = pp_init_image(simg);
+	if(res) pp_copy_exif(res, img);
+	
+	gm_image_destroy(gimg);
+	gm_image_destroy(timg);
+	gm_image_destroy(simg);
+	DestroyExceptionInfo(&ex);
+	PG_RETURN_POINTER(res);		
+}
+
+/*
+ * Draws overlay over img. x and y offset it from the
+ * corner or side named by gravity, towards the center.
+ */
+PG_FUNCTION_INFO_V1(image_composite);
+Datum   image_composite(PG_FUNCTION_ARGS)
+{
+	PPImage * img, * res;
+	Image * gimg, * oimg;
+	int32 x, y;
+	char * gname;
+	float4 opacity;
+	bool cached;
+	int i = 0;
+
+	img = PG_GETARG_IMAGE(0);
+	x = PG_GETARG_INT32(2);
+	y = PG_GETARG_INT32(3);
+	gname = pp_varchar2str(PG_GETARG_VARCHAR_P(4));
+	opacity = PG_GETARG_FLOAT4(5);
+
+	while(gravities[i].name && pg_strcasecmp(gname, gravities[i].name)) ++i;
+	if(!gravities[i].name) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unknown gravity \"%s\"", gname)));
+	}
+	if(opacity < 0.0 || opacity > 1.0) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("opacity must be between 0 and 1")));
+	}
+
+	oimg = gm_overlay_lookup(PG_GETARG_DATUM(1), opacity, &cached);
+	gimg = gm_image_from_image(img);
+	switch(gravities[i].hpos) {
+		case 1: x += ((long) gimg->columns - (long) oimg->columns) / 2; break;
+		case 2: x = (long) gimg->columns - (long) oimg->columns - x; break;
+	}
+	switch(gravities[i].vpos) {
+		case 1: y += ((long) gimg->rows - (long) oimg->rows) / 2; break;
+		case 2: y = (long) gimg->rows - (long) oimg->rows - y; break;
+	}
+	CompositeImage(gimg, OverCompositeOp, oimg, x, y);
+	res = pp_init_image(gimg);
+	if(res) pp_copy_exif(res, img);
+
+	gm_image_destroy(gimg);
+	if(!cached) gm_image_destroy(oimg);
+	PG_RETURN_POINTER(res);
+}
+
+/*
+ * Returns the decoded overlay, faded to opacity, from the cache
+ * if it's there. Images too large to cache are returned tracked,
+ * for the caller to destroy.
+ */
+Image *	gm_overlay_lookup(Datum d, float4 opacity, bool * cached)
+{
+	PPImage * hdr = pp_header_from_datum(d, true);
+	PPOverlay * o;
+	Image * oimg;
+	char digest[DIGESTLEN];
+	int i;
+
+	pp_get_digest(d, hdr, digest);
+	for(i = 0; i < PP_OVERLAY_CACHE; ++i) {
+		if(overlays[i].img && overlays[i].opacity == opacity
+			&& !memcmp(overlays[i].digest, digest, DIGESTLEN)) {
+			*cached = true;
+			return overlays[i].img;
+		}
+	}
+
+	oimg = gm_image_from_image(pp_image_from_datum(d));
+	if(opacity < 1.0) {
+		if(!oimg->matte) SetImageOpacity(oimg, OpaqueOpacity);
+		SetImageOpacity(oimg, (unsigned int) (MaxRGB * (1.0 - opacity)));
+	}
+	*cached = ((int64) oimg->columns * oimg->rows <= PP_OVERLAY_MAXPIXELS);
+	if(!*cached) return oimg;
+
+	gm_untrack(oimg);
+	o = &overlays[next_overlay];
+	next_overlay = (next_overlay + 1) % PP_OVERLAY_CACHE;
+	if(o->img) DestroyImage(o->img);
+	memcpy(o->digest, digest, DIGESTLEN);
+	o->opacity = opacity;
+	o->img = oimg;
+	return oimg;
+}
+
+PG_FUNCTION_INFO_V1(image_draw_text);
+Datum   image_draw_text(PG_FUNCTION_ARGS)
+{
+    PPImage * img, * res;
+    PPColor * color = NULL;
+    Image * gimg;
+    DrawInfo * dinfo;
+    VarChar * label;
+    char * family = NULL;
+    int x = 20, y = 20, f_size = 0;
+    unsigned int na;
+    
+    na = PG_NARGS();    
+    img = PG_GETARG_IMAGE(0);
+    label = PG_GETARG_VARCHAR_P(1);
+    switch(na) {
+    	case 7: //color
+    		color = (PPColor*) PG_GETARG_POINTER(6);
+    		/* fallthrough */
+    	case 6: //font family and size
+    		family = pp_varchar2str(PG_GETARG_VARCHAR_P(4));
+    		f_size = PG_GETARG_INT32(5);
+    		/* fallthrough */
+		case 4: // x and y position
+			x = PG_GETARG_INT32(2);
+			y = PG_GETARG_INT32(3);
+    }
+    dinfo = gm_font_lookup(family, f_size, color);
+    gimg = gm_image_from_image(img);
+    gm_annotate(gimg, dinfo, x, y, pp_varchar2str(label));
+    res = pp_init_image(gimg);
+    if(res) pp_copy_exif(res, img);
+    gm_image_destroy(gimg);
+
+	PG_RETURN_POINTER(res);
+}
+
+/*
+ * Several labels, and optionally rectangles below them,
+ * with a single decode and encode of the image
+ */
+PG_FUNCTION_INFO_V1(image_draw_texts);
+Datum   image_draw_texts(PG_FUNCTION_ARGS)
+{
+	PPImage * img, * res;
+	PPColor * color = NULL, * rcolor = NULL;
+	Image * gimg;
+	DrawInfo * dinfo;
+	DrawContext ctx;
+	Datum * labels, * points, * rects;
+	bool * lnulls, * pnulls, * rnulls;
+	char * family = NULL;
+	int32 f_size = 0;
+	int nlabels, npoints, nrects = 0, i;
+	Point * pt;
+	BOX * rect;
+
+	if(PG_ARGISNULL(0)) PG_RETURN_NULL();
+	img = PG_GETARG_IMAGE(0);
+	if(PG_ARGISNULL(1) || PG_ARGISNULL(2)) PG_RETURN_POINTER(img);
+	nlabels = pp_deconstruct(PG_GETARG_ARRAYTYPE_P(1), &labels, &lnulls);
+	npoints = pp_deconstruct(PG_GETARG_ARRAYTYPE_P(2), &points, &pnulls);
+	if(nlabels != npoints) {
+		ereport(ERROR,
+			(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+			 errmsg("there must be as many positions as labels")));
+	}
+	if(!PG_ARGISNULL(3)) family = pp_varchar2str(PG_GETARG_VARCHAR_P(3));
+	if(!PG_ARGISNULL(4)) f_size = PG_GETARG_INT32(4);
+	if(!PG_ARGISNULL(5)) color = (PPColor*) PG_GETARG_POINTER(5);
+	if(!PG_ARGISNULL(6)) nrects = pp_deconstruct(PG_GETARG_ARRAYTYPE_P(6), &rects, &rnulls);
+	if(!PG_ARGISNULL(7)) rcolor = (PPColor*) PG_GETARG_POINTER(7);
+
+	dinfo = gm_font_lookup(family, f_size, color);
+	gimg = gm_image_from_image(img);
+	if(nrects) {
+		ctx = gm_track(DrawAllocateContext((DrawInfo*)NULL, gimg), PP_RES_DRAW);
+		if(rcolor) DrawSetFillColor(ctx, gm_ppacket_from_color(rcolor));
+		for(i = 0; i < nrects; ++i) {
+			if(rnulls[i]) continue;
+			rect = DatumGetBoxP(rects[i]);
+			DrawRectangle(ctx, rect->high.x, rect->high.y, rect->low.x, rect->low.y);
+		}
+		DrawRender(ctx);
+		gm_destroy(ctx, PP_RES_DRAW);
+	}
+	for(i = 0; i < nlabels; ++i) {
+		if(lnulls[i] || pnulls[i]) continue;
+		pt = DatumGetPointP(points[i]);
+		gm_annotate(gimg, dinfo, (int) pt->x, (int) pt->y,
+			pp_varchar2str(DatumGetVarCharP(labels[i])));
+	}
+	res = pp_init_image(gimg);
+	if(res) pp_copy_exif(res, img);
+	gm_image_destroy(gimg);
+
+	PG_RETURN_POINTER(res);
+}
+
+int		pp_deconstruct(ArrayType * a, Datum ** elems, bool ** nulls)
+{
+	int16 elmlen;
+	bool elmbyval;
+	char elmalign;
+	int n;
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(a), &elmlen, &elmbyval, &elmalign);
+	deconstruct_array(a, ARR_ELEMTYPE(a), elmlen, elmbyval, elmalign, elems, nulls, &n);
+	return n;
+}
+
+/*
+ * Any number of rectangles, lines, polygons and labels, each with
+ * its own color, rendered in a single pass of one DrawContext
+ */
+PG_FUNCTION_INFO_V1(image_draw);
+Datum   image_draw(PG_FUNCTION_ARGS)
+{
+	PPImage * img, * res;
+	Image * gimg;
+	DrawContext ctx;
+	PPArray rects, rcolors, lines, lcolors, polys, pcolors, labels, points, tcolors;
+	PointInfo * pts;
+	BOX * rect;
+	LSEG * seg;
+	POLYGON * poly;
+	Point * pt;
+	bool fill = true;
+	double stroke_width = 1.0;
+	int32 f_size = 0;
+	int i, j;
+
+	if(PG_ARGISNULL(0)) PG_RETURN_NULL();
+	img = PG_GETARG_IMAGE(0);
+	pp_get_array(fcinfo, 1, &rects);
+	pp_get_array(fcinfo, 2, &rcolors);
+	pp_get_array(fcinfo, 3, &lines);
+	pp_get_array(fcinfo, 4, &lcolors);
+	pp_get_array(fcinfo, 5, &polys);
+	pp_get_array(fcinfo, 6, &pcolors);
+	pp_get_array(fcinfo, 7, &labels);
+	pp_get_array(fcinfo, 8, &points);
+	pp_get_array(fcinfo, 9, &tcolors);
+	if(!PG_ARGISNULL(10)) fill = PG_GETARG_BOOL(10);
+	if(!PG_ARGISNULL(11)) stroke_width = PG_GETARG_FLOAT4(11);
+	if(!PG_ARGISNULL(13)) f_size = PG_GETARG_INT32(13);
+	if(labels.n != points.n) {
+		ereport(ERROR,
+			(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+			 errmsg("there must be as many positions as labels")));
+	}
+	if(rects.n + lines.n + polys.n + labels.n == 0) PG_RETURN_POINTER(img);
+
+	gimg = gm_image_from_image(img);
+	ctx = gm_track(DrawAllocateContext((DrawInfo*)NULL, gimg), PP_RES_DRAW);
+	for(i = 0; i < rects.n; ++i) {
+		if(rects.nulls[i]) continue;
+		rect = DatumGetBoxP(rects.elems[i]);
+		DrawPushGraphicContext(ctx);
+		gm_draw_set_color(ctx, pp_array_color(&rcolors, i), fill, stroke_width);
+		DrawRectangle(ctx, rect->high.x, rect->high.y, rect->low.x, rect->low.y);
+		DrawPopGraphicContext(ctx);
+	}
+	for(i = 0; i < polys.n; ++i) {
+		if(polys.nulls[i]) continue;
+		poly = DatumGetPolygonP(polys.elems[i]);
+		pts = palloc(poly->npts * sizeof(PointInfo));
+		for(j = 0; j < poly->npts; ++j) {
+			pts[j].x = poly->p[j].x;
+			pts[j].y = poly->p[j].y;
+		}
+		DrawPushGraphicContext(ctx);
+		gm_draw_set_color(ctx, pp_array_color(&pcolors, i), fill, stroke_width);
+		DrawPolygon(ctx, poly->npts, pts);
+		DrawPopGraphicContext(ctx);
+		pfree(pts);
+	}
+	for(i = 0; i < lines.n; ++i) {
+		if(lines.nulls[i]) continue;
+		seg = DatumGetLsegP(lines.elems[i]);
+		DrawPushGraphicContext(ctx);
+		gm_draw_set_color(ctx, pp_array_color(&lcolors, i), false, stroke_width);
+		DrawLine(ctx, seg->p[0].x, seg->p[0].y, seg->p[1].x, seg->p[1].y);
+		DrawPopGraphicContext(ctx);
+	}
+	if(labels.n) {
+		if(!PG_ARGISNULL(12)) DrawSetFontFamily(ctx, pp_varchar2str(PG_GETARG_VARCHAR_P(12)));
+		if(f_size > 0) DrawSetFontSize(ctx, f_size);
+	}
+	for(i = 0; i < labels.n; ++i) {
+		if(labels.nulls[i] || points.nulls[i]) continue;
+		pt = DatumGetPointP(points.elems[i]);
+		DrawPushGraphicContext(ctx);
+		if(pp_array_color(&tcolors, i)) DrawSetFillColor(ctx, gm_ppacket_from_color(pp_array_color(&tcolors, i)));
+		DrawAnnotation(ctx, pt->x, pt->y,
+			(unsigned char *) pp_varchar2str(DatumGetVarCharP(labels.elems[i])));
+		DrawPopGraphicContext(ctx);
+	}
+	DrawRender(ctx);
+	gm_destroy(ctx, PP_RES_DRAW);
+	res = pp_init_image(gimg);
+	if(res) pp_copy_exif(res, img);
+	gm_image_destroy(gimg);
+
+	PG_RETURN_POINTER(res);
+}
+
+void	pp_get_array(FunctionCallInfo fcinfo, int argno, PPArray * arr)
+{
+	arr->n = 0;
+	if(PG_NARGS() <= argno || PG_ARGISNULL(argno)) return;
+	arr->n = pp_deconstruct(PG_GETARG_ARRAYTYPE_P(argno), &arr->elems, &arr->nulls);
+}
+
+/*
+ * The i-th color, NULL if there are fewer or it's NULL
+ */
+PPColor *	pp_array_color(const PPArray * colors, int i)
+{
+	if(i >= colors->n || colors->nulls[i]) return NULL;
+	return (PPColor *) DatumGetPointer(colors->elems[i]);
+}
+
+/*
+ * Shapes are either filled with color, or outlined
+ * with it when fill is false. NULL keeps the defaults.
+ */
+void	gm_draw_set_color(DrawContext ctx, const PPColor * color, bool fill, double stroke_width)
+{
+	if(fill) {
+		if(color) DrawSetFillColor(ctx, gm_ppacket_from_color(color));
+		return;
+	}
+	DrawSetFillOpacity(ctx, 0.0);
+	DrawSetStrokeWidth(ctx, stroke_width);
+	if(color) {
+		DrawSetStrokeColor(ctx, gm_ppacket_from_color(color));
+	} else {
+		DrawSetStrokeColorString(ctx, "black");
+	}
+}
+
+/*
+ * Draws text with its baseline starting at x, y, as
+ * DrawAnnotation does, but without building and parsing
+ * a drawing script for it
+ */
+void	gm_annotate(Image * gimg, DrawInfo * dinfo, int x, int y, const char * text)
+{
+	char geometry[2*INTLEN];
+
+	snprintf(geometry, sizeof(geometry), "%+d%+d", x, y);
+	CloneString(&dinfo->geometry, geometry);
+	CloneString(&dinfo->text, text);
+	AnnotateImage(gimg, dinfo);
+	CloneString(&dinfo->text, NULL);
+}
+
+/*
+ * Returns a DrawInfo set up for family (NULL for GM's default),
+ * size (0 likewise) and color (NULL likewise), with the font
+ * file already resolved. They're cached and not tracked:
+ * don't destroy them.
+ */
+DrawInfo *	gm_font_lookup(const char * family, int32 size, const PPColor * color)
+{
+	PPFont * f;
+	ImageInfo * iinfo;
+	DrawInfo * dinfo;
+	const TypeInfo * tinfo;
+	ExceptionInfo ex;
+	int i;
+
+	for(i = 0; i < PP_FONT_CACHE; ++i) {
+		f = &fonts[i];
+		if(!f->dinfo || f->size != size || (f->has_color != (color != NULL))) continue;
+		if(color && (f->color.cs != color->cs || f->color.cd != color->cd)) continue;
+		if((f->family == NULL) != (family == NULL)) continue;
+		if(family && strcmp(f->family, family)) continue;
+		return f->dinfo;
+	}
+
+	iinfo = gm_track(CloneImageInfo(NULL), PP_RES_IMAGEINFO);
+	dinfo = gm_track(CloneDrawInfo(iinfo, NULL), PP_RES_DRAWINFO);
+	gm_destroy(iinfo, PP_RES_IMAGEINFO);
+	if(size > 0) dinfo->pointsize = size;
+	if(color) dinfo->fill = *gm_ppacket_from_color(color);
+	if(family) {
+		/* skip the type list search at each annotation */
+		GetExceptionInfo(&ex);
+		tinfo = GetTypeInfoByFamily(family, AnyStyle, AnyStretch, 0, &ex);
+		DestroyExceptionInfo(&ex);
+		if(tinfo && tinfo->glyphs) CloneString(&dinfo->font, tinfo->glyphs);
+		else CloneString(&dinfo->family, family);
+	}
+
+	f = &fonts[next_font];
+	next_font = (next_font + 1) % PP_FONT_CACHE;
+	if(f->dinfo) {
+		DestroyDrawInfo(f->dinfo);
+		if(f->family) pfree(f->family);
+	}
+	gm_untrack(dinfo);
+	f->dinfo = dinfo;
+	f->family = family ? MemoryContextStrdup(TopMemoryContext, family) : NULL;
+	f->size = size;
+	f->has_color = (color != NULL);
+	if(color) f->color = *color;
+	return dinfo;
+}
+
+PG_FUNCTION_INFO_V1(image_draw_rect);
+Datum   image_draw_rect(PG_FUNCTION_ARGS)
+{
+    PPImage * img, * res;
+    PPColor * color = NULL;
+    Image * gimg;
+    DrawContext ctx;
+    BOX * rect;
+    //bool fill;
+    
+    img = PG_GETARG_IMAGE(0);
+    rect = PG_GETARG_BOX_P(1);
+    //fill = PG_GETARG_BOOL(2);
+    color = (PPColor*) PG_GETARG_POINTER(2);
+    
+    gimg = gm_image_from_image(img);
+    
+    ctx  = gm_track(DrawAllocateContext((DrawInfo*)NULL, gimg), PP_RES_DRAW);
+    DrawSetFillColor(ctx, gm_ppacket_from_color(color));
+    DrawRectangle(ctx, rect->high.x, rect->high.y,
+		rect->low.x, rect->low.y);
+    DrawRender(ctx);
+    gm_destroy(ctx, PP_RES_DRAW);
+    res = pp_init_image(gimg);
+    if(res) pp_copy_exif(res, img);
+    gm_image_destroy(gimg);
+
+	PG_RETURN_POINTER(res);
+}
+
+PG_FUNCTION_INFO_V1(image_index);
+Datum	image_index(PG_FUNCTION_ARGS)
+{
+	ArrayType * aimgs;
+	Image * gimg, * rimg;
+	int32 tile;
+	int nimgs, n = 0, i;
+	Datum * elems;
+	bool * nulls;
+	ImageInfo iinfo;
+	MontageInfo minfo;
+	ExceptionInfo ex;
+	PPImage * res;
+	char * str;
+	VarChar * title;
+	
+	aimgs = PG_GETARG_ARRAYTYPE_P(0);
+	title = PG_GETARG_VARCHAR_P(1);
+	tile = PG_GETARG_INT32(2);
+	if(tile <= 0) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("tiles per row must be positive")));
+	}
+	
+	nimgs = pp_deconstruct(aimgs, &elems, &nulls);
+	if(nimgs==0) PG_RETURN_NULL();
+	gimg = NewImageList();
+	for(i = 0; i < nimgs; ++i) {
+		if(nulls[i]) continue;
+		AppendImageToList(&gimg, gm_image_from_image(pp_image_from_datum(elems[i])));
+		++n;
+	}
+	if(!gimg) PG_RETURN_NULL();
+	
+	GetImageInfo(&iinfo);
+	GetMontageInfo(&iinfo, &minfo);
+	minfo.geometry = pstrdup("+4+4");
+	str = palloc(2*INTLEN);
+	sprintf(str, "%dx%d", tile, (n % tile ? n/tile+1 : n/tile));
+	minfo.tile = str;
+	str = pp_varchar2str(title);
+	minfo.title = str;
+	minfo.shadow=1;
+	GetExceptionInfo(&ex);
+	rimg = gm_result(MontageImages(gimg, &minfo, &ex), &ex);
+	CatchException(&ex);
+	
+	//So sad, it doesn't work if I don't write the img :((
+	sprintf(rimg->filename, "%s/ppm%d_%s.jpg", tmpdir, tile, minfo.title );
+	str = pstrdup(rimg->filename);
+	WriteImage(&iinfo, rimg);
+    CatchException(&ex);
+    if(!rimg) {
+		res = NULL;
+    	elog(WARNING, "Can't get montage data");
+	}
+    else {
+    	res = pp_init_image(rimg);
+	}
+
+	/* the list owns its members now */
+	for(i = 0; i < n; ++i) gm_untrack(GetImageFromList(gimg, i));
+	DestroyImageList(gimg);
+	DestroyExceptionInfo(&ex);
+	gm_untrack(rimg);
+	DestroyImageList(rimg);
+	unlink(str);
+	if(res) PG_RETURN_POINTER(res);
+	PG_RETURN_NULL();
+}
+
+/*
+ * Trigger keeping the image columns named in its arguments
+ * deduplicated, to be fired BEFORE INSERT OR UPDATE OR DELETE
+ * FOR EACH ROW. New values move their encoded image to
+ * postpic_blobs (or just take a reference, if it's there
+ * already), old ones drop their reference.
+ */
+PG_FUNCTION_INFO_V1(postpic_dedup);
+Datum	postpic_dedup(PG_FUNCTION_ARGS)
+{
+	TriggerData * td = (TriggerData *) fcinfo->context;
+	TupleDesc desc;
+	HeapTuple oldtup = NULL, newtup = NULL;
+	PPImage * img;
+	Datum d;
+	Datum * values;
+	char * nulls;
+	int * attnums;
+	char olddig[DIGESTLEN], newdig[DIGESTLEN];
+	bool isnull, hasold, hasnew;
+	int nargs, attnum, i, n = 0;
+
+	if(!CALLED_AS_TRIGGER(fcinfo) || !TRIGGER_FIRED_BEFORE(td->tg_event)
+		|| !TRIGGER_FIRED_FOR_ROW(td->tg_event)) {
+		ereport(ERROR,
+			(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+			 errmsg("postpic_dedup must be fired before each row")));
+	}
+	nargs = td->tg_trigger->tgnargs;
+	if(nargs == 0) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("postpic_dedup needs the names of the image columns")));
+	}
+	desc = td->tg_relation->rd_att;
+	if(TRIGGER_FIRED_BY_INSERT(td->tg_event)) {
+		newtup = td->tg_trigtuple;
+	} else if(TRIGGER_FIRED_BY_UPDATE(td->tg_event)) {
+		oldtup = td->tg_trigtuple;
+		newtup = td->tg_newtuple;
+	} else {
+		oldtup = td->tg_trigtuple;
+	}
+
+	attnums = (int *) palloc(nargs * sizeof(int));
+	values = (Datum *) palloc(nargs * sizeof(Datum));
+	nulls = (char *) palloc(nargs);
+	if(SPI_connect() != SPI_OK_CONNECT) elog(ERROR, "SPI_connect failed");
+	for(i = 0; i < nargs; ++i) {
+		attnum = pp_image_column(desc, td->tg_trigger->tgargs[i]);
+		hasold = false;
+		hasnew = false;
+		if(oldtup) {
+			d = SPI_getbinval(oldtup, desc, attnum, &isnull);
+			hasold = !isnull && pp_blob_digest(d, olddig);
+		}
+		if(newtup) {
+			d = SPI_getbinval(newtup, desc, attnum, &isnull);
+			if(!isnull && !(hasnew = pp_blob_digest(d, newdig))) {
+				/* a self-contained value: store its image */
+				img = pp_image_from_datum(d);
+				pp_get_digest(d, img, newdig);
+				pp_blob_ref(newdig, PP_DATA(img), PP_DATALEN(img));
+				attnums[n] = attnum;
+				values[n] = PointerGetDatum(pp_detach(img, newdig));
+				nulls[n++] = ' ';
+			}
+		}
+		/* the same reference, e.g. an UPDATE not touching the column */
+		if(hasold && hasnew && !memcmp(olddig, newdig, DIGESTLEN)) continue;
+		if(hasnew) pp_blob_ref(newdig, NULL, 0);
+		if(hasold) pp_blob_unref(olddig);
+	}
+	if(n) newtup = SPI_modifytuple(td->tg_relation, newtup, n, attnums, values, nulls);
+	SPI_finish();
+
+	return PointerGetDatum(newtup ? newtup : oldtup);
+}
+
+/*
+ * Drops the blobs no value refers to anymore, returning how many.
+ * The reference counts only follow the trigger, while deduplicated
+ * values may be copied anywhere (INSERT ... SELECT, CREATE TABLE AS):
+ * the values are looked for in every image column instead. Writes
+ * in flight to those tables, copies included, are waited for, and
+ * new ones wait for us; tables created meanwhile aren't seen.
+ */
+PG_FUNCTION_INFO_V1(postpic_gc);
+Datum	postpic_gc(PG_FUNCTION_ARGS)
+{
+	StringInfoData q;
+	SPITupleTable * cols;
+	const char * nsp;
+	Oid nspoid, imgtype, argtype = OIDOID;
+	Datum arg;
+	uint64 i, ncols;
+	int64 n;
+
+	/* a transaction snapshot would predate the lock */
+	if(IsolationUsesXactSnapshot()) {
+		ereport(ERROR,
+			(errcode(ERRCODE_ACTIVE_SQL_TRANSACTION),
+			 errmsg("postpic_gc must run at the READ COMMITTED isolation level")));
+	}
+	nspoid = pp_extension_namespace();
+	imgtype = OidIsValid(nspoid) ? pp_syscache_oid(TYPENAMENSP, Anum_pg_type_oid,
+		CStringGetDatum("image"), ObjectIdGetDatum(nspoid)) : InvalidOid;
+	if(!OidIsValid(imgtype)) elog(ERROR, "postpic extension not found");
+	nsp = quote_identifier(get_namespace_name(nspoid));
+
+	if(SPI_connect() != SPI_OK_CONNECT) elog(ERROR, "SPI_connect failed");
+	arg = ObjectIdGetDatum(imgtype);
+	if(SPI_execute_with_args(gc_columns_query, 1, &argtype, &arg, NULL, true, 0) != SPI_OK_SELECT) {
+		elog(ERROR, "SPI_execute_with_args failed");
+	}
+	cols = SPI_tuptable;
+	ncols = SPI_processed;
+
+	/*
+	 * The tables first, as the trigger does: the statements below
+	 * then see what was copied by transactions committed meanwhile.
+	 * Materialized views can't be locked, nor written but by REFRESH.
+	 */
+	initStringInfo(&q);
+	for(i = 0; i < ncols; ++i) {
+		if(strcmp(SPI_getvalue(cols->vals[i], cols->tupdesc, 3), "r")) continue;
+		appendStringInfoString(&q, q.len ? ", " : "LOCK TABLE ");
+		appendStringInfoString(&q, SPI_getvalue(cols->vals[i], cols->tupdesc, 1));
+	}
+	if(q.len) {
+		appendStringInfoString(&q, " IN SHARE MODE");
+		if(SPI_execute(q.data, false, 0) != SPI_OK_UTILITY) elog(ERROR, "SPI_execute failed");
+	}
+	pp_blob_exec(PP_BLOB_LOCK, NULL, false);
+
+	/* mark, as the anti-join of a union of all of them, and sweep */
+	resetStringInfo(&q);
+	appendStringInfo(&q, "DELETE FROM %spostpic_blobs b WHERE NOT EXISTS (SELECT 1 FROM (SELECT NULL::bytea", blob_schema);
+	for(i = 0; i < ncols; ++i) {
+		appendStringInfo(&q, " UNION ALL SELECT %s.digest(%s) FROM %s WHERE %s.deduplicated(%s)",
+			nsp, SPI_getvalue(cols->vals[i], cols->tupdesc, 2),
+			SPI_getvalue(cols->vals[i], cols->tupdesc, 1),
+			nsp, SPI_getvalue(cols->vals[i], cols->tupdesc, 2));
+	}
+	appendStringInfoString(&q, ") live (digest) WHERE live.digest = b.digest)");
+	if(SPI_execute(q.data, false, 0) != SPI_OK_DELETE) elog(ERROR, "SPI_execute failed");
+	n = SPI_processed;
+	SPI_finish();
+	PG_RETURN_INT64(n);
+}
+
+/*
+ * The statistics entries of all databases; nothing without
+ * postpic in shared_preload_libraries
+ */
+PG_FUNCTION_INFO_V1(postpic_stats);
+Datum	postpic_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo * rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate * tupstore;
+	MemoryContext oldcontext;
+	volatile PPStat * ve;
+	PPStat e;
+	Datum values[9];
+	bool nulls[9];
+	int i, n = 0;
+
+	if(!rsinfo || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize)) {
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("set-valued function called in context that cannot accept a set")));
+	}
+	if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	if(stats) {
+		SpinLockAcquire(&stats->mutex);
+		n = stats->nentries;
+		SpinLockRelease(&stats->mutex);
+	}
+	memset(nulls, 0, sizeof(nulls));
+	for(i = 0; i < n; ++i) {
+		ve = &stats->entries[i];
+		SpinLockAcquire(&ve->mutex);
+		e = *((PPStat *) ve);
+		SpinLockRelease(&ve->mutex);
+		values[0] = ObjectIdGetDatum(e.dbid);
+		values[1] = ObjectIdGetDatum(e.funcid);
+		nulls[1] = (e.op != PP_OP_FUNCTION);
+		values[2] = nulls[1] ? CStringGetTextDatum(stat_ops[e.op]) : (Datum) 0;
+		nulls[2] = !nulls[1];
+		values[3] = Int64GetDatum(e.calls);
+		values[4] = Float8GetDatum(e.total_time);
+		values[5] = Float8GetDatum(e.max_time);
+		values[6] = Int64GetDatum(e.bytes_in);
+		values[7] = Int64GetDatum(e.bytes_out);
+		values[8] = Int64GetDatum(e.pixels);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Zeroes the counters, keeping the entries
+ */
+PG_FUNCTION_INFO_V1(postpic_stats_reset);
+Datum	postpic_stats_reset(PG_FUNCTION_ARGS)
+{
+	volatile PPStat * ve;
+	int i, n = 0;
+
+	if(stats) {
+		SpinLockAcquire(&stats->mutex);
+		n = stats->nentries;
+		SpinLockRelease(&stats->mutex);
+	}
+	for(i = 0; i < n; ++i) {
+		ve = &stats->entries[i];
+		SpinLockAcquire(&ve->mutex);
+		ve->calls = 0;
+		ve->total_time = 0;
+		ve->max_time = 0;
+		ve->bytes_in = 0;
+		ve->bytes_out = 0;
+		ve->pixels = 0;
+		SpinLockRelease(&ve->mutex);
+	}
+	PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(postpic_version);
+Datum	postpic_version(PG_FUNCTION_ARGS)
+{
+	char * version = palloc(DATELEN);
+	sprintf(version, "PostPic version %d.%d.%d", PP_VERSION_RELEASE,
+		PP_VERSION_MAJOR, PP_VERSION_MINOR);
+	PG_RETURN_CSTRING( version ); 
+}
+
+PG_FUNCTION_INFO_V1(postpic_version_release);
+Datum	postpic_version_release(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32( PP_VERSION_RELEASE );
+}
+
+PG_FUNCTION_INFO_V1(postpic_version_major);
+Datum	postpic_version_major(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32( PP_VERSION_MAJOR );
+}
+
+PG_FUNCTION_INFO_V1(postpic_version_minor);
+Datum	postpic_version_minor(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32( PP_VERSION_MINOR );
+}
+
+PG_FUNCTION_INFO_V1(image_width);
+Datum	image_width(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+	PG_RETURN_INT32(img->width);
+}
+
+PG_FUNCTION_INFO_V1(image_height);
+Datum	image_height(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+	PG_RETURN_INT32(img->height);
+}
+
+PG_FUNCTION_INFO_V1(image_date);
+Datum	image_date(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+	if(TIMESTAMP_IS_NOBEGIN(img->date)) PG_RETURN_NULL();
+	PG_RETURN_TIMESTAMP(img->date);
+}
+
+PG_FUNCTION_INFO_V1(image_f_number);
+Datum	image_f_number(PG_FUNCTION_ARGS)
+{
+    PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+    if(img->f_number > 0) {
+    	PG_RETURN_FLOAT4(img->f_number);
+	}
+	PG_RETURN_NULL();
+}
+
+PG_FUNCTION_INFO_V1(image_exposure_time);
+Datum	image_exposure_time(PG_FUNCTION_ARGS)
+{
+    PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+    if(img->exposure_t > 0) {
+        PG_RETURN_FLOAT4(img->exposure_t);
+    }
+    PG_RETURN_NULL();
+}
+
+PG_FUNCTION_INFO_V1(image_iso);
+Datum	image_iso(PG_FUNCTION_ARGS)
+{
+    PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+    if(img->iso > 0) {
+        PG_RETURN_INT32(img->iso);
+    }
+    PG_RETURN_NULL();
+}
+
+
+PG_FUNCTION_INFO_V1(image_focal_length);
+Datum   image_focal_length(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+	if(img->focal_l > 0) {
+        PG_RETURN_FLOAT4(img->focal_l);
+    }
+    PG_RETURN_NULL();
+}
+
+PG_FUNCTION_INFO_V1(image_colorspace);
+Datum	image_colorspace(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+	return ObjectIdGetDatum(img->cspace);
+}
+
+PG_FUNCTION_INFO_V1(image_metadata);
+Datum	image_metadata(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 90400
+	StringInfoData json;
+	char * meta, * end;
+	int len;
+
+	meta = pp_get_metadata(PG_GETARG_DATUM(0), &len);
+	end = meta + len;
+	initStringInfo(&json);
+	appendStringInfoChar(&json, '{');
+	while(meta < end) {
+		if(json.len > 1) appendStringInfoString(&json, ", ");
+		escape_json(&json, meta);
+		appendStringInfoString(&json, ": ");
+		meta += strlen(meta) + 1;
+		escape_json(&json, meta);
+		meta += strlen(meta) + 1;
+	}
+	appendStringInfoChar(&json, '}');
+	return DirectFunctionCall1(jsonb_in, CStringGetDatum(json.data));
+#else
+	ereport(ERROR,
+		(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		 errmsg("metadata(image) requires PostgreSQL 9.4 or later")));
+	PG_RETURN_NULL();
+#endif
+}
+
+PG_FUNCTION_INFO_V1(image_metadata_value);
+Datum	image_metadata_value(PG_FUNCTION_ARGS)
+{
+	char * key = pp_varchar2str(PG_GETARG_VARCHAR_P(1));
+	const char * value;
+	char * meta;
+	int len;
+
+	meta = pp_get_metadata(PG_GETARG_DATUM(0), &len);
+	value = pp_meta_lookup(meta, len, key);
+	if(!value) PG_RETURN_NULL();
+	PG_RETURN_VARCHAR_P(cstring_to_text(value));
+}
+
+PG_FUNCTION_INFO_V1(image_format);
+Datum	image_format(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+	PG_RETURN_VARCHAR_P(cstring_to_text(formats[img->format]));
+}
+
+PG_FUNCTION_INFO_V1(image_orientation);
+Datum	image_orientation(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+	if(img->orientation > 0) {
+		PG_RETURN_INT32(img->orientation);
+	}
+	PG_RETURN_NULL();
+}
+
+PG_FUNCTION_INFO_V1(image_digest);
+Datum	image_digest(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_SECTIONS(0);
+	bytea * res = (bytea *) palloc(DIGESTLEN + VARHDRSZ);
+
+	SET_VARSIZE(res, DIGESTLEN + VARHDRSZ);
+	pp_get_digest(PG_GETARG_DATUM(0), img, VARDATA(res));
+	PG_RETURN_BYTEA_P(res);
+}
+
+/*
+ * Length of the encoded image, from the header alone
+ */
+PG_FUNCTION_INFO_V1(image_data_length);
+Datum	image_data_length(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_SECTIONS(0);
+
+	PG_RETURN_INT32(pp_stored_datalen(PG_GETARG_DATUM(0), img));
+}
+
+/*
+ * Up to len bytes of the encoded image, starting at off (from 0),
+ * e.g. for HTTP range requests. Just the chunks holding them are
+ * detoasted.
+ */
+PG_FUNCTION_INFO_V1(image_data_range);
+Datum	image_data_range(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_SECTIONS(0);
+	int32 off = PG_GETARG_INT32(1);
+	int32 len = PG_GETARG_INT32(2);
+	uint32 datalen = pp_stored_datalen(PG_GETARG_DATUM(0), img);
+
+	if(off < 0 || len < 0) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("offset and length can't be negative")));
+	}
+	if((uint32) off >= datalen) len = 0;
+	else len = Min(len, datalen - off);
+	if(len == 0) PG_RETURN_BYTEA_P(pp_make_bytea("", 0));
+	PG_RETURN_BYTEA_P(pp_make_bytea(pp_fetch_data(PG_GETARG_DATUM(0), img, off, len), len));
+}
+
+/*
+ * The same pixels in fewer bytes, if possible
+ */
+PG_FUNCTION_INFO_V1(image_optimize);
+Datum	image_optimize(PG_FUNCTION_ARGS)
+{
+	PPImage * res = pp_optimize_image(PG_GETARG_DATUM(0), PG_GETARG_BOOL(1), PG_GETARG_BOOL(2));
+
+	if(!res) PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	PG_RETURN_POINTER(res);
+}
+
+/*
+ * The same as optimize, along with the encoded size before and after
+ */
+PG_FUNCTION_INFO_V1(image_optimize_report);
+Datum	image_optimize_report(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_SECTIONS(0), * res;
+	TupleDesc tupdesc;
+	Datum values[3];
+	bool nulls[3] = { false, false, false };
+	uint32 len;
+
+	if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	len = pp_stored_datalen(PG_GETARG_DATUM(0), img);
+	res = pp_optimize_image(PG_GETARG_DATUM(0), PG_GETARG_BOOL(1), PG_GETARG_BOOL(2));
+	values[0] = res ? PointerGetDatum(res) : PG_GETARG_DATUM(0);
+	values[1] = Int64GetDatum(len);
+	values[2] = Int64GetDatum(res ? PP_DATALEN(res) : len);
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(image_deduplicated);
+Datum	image_deduplicated(PG_FUNCTION_ARGS)
+{
+	PPImage * img = PG_GETARG_IMAGE_HEADER(0);
+
+	PG_RETURN_BOOL(PP_HAS(img, PPF_BLOB));
+}
+
+/*
+ * hdr must come from pp_header_from_datum(d, true)
+ */
+void	pp_get_digest(Datum d, const PPImage * hdr, char * digest)
+{
+	PPImage * img;
+	uint32 len;
+	char * sect = pp_section(hdr, PPF_DIGEST, &len);
+
+	if(sect) {
+		memcpy(digest, sect, DIGESTLEN);
+	} else {
+		/* not cached, e.g. stored by version 0 */
+		img = pp_image_from_datum(d);
+		pp_md5(PP_DATA(img), PP_DATALEN(img), digest);
+	}
+}
+
+/*
+ * MD5 of the len bytes at data, which pg_md5_binary can fail
+ * to compute (out of memory, or FIPS mode from 15 on)
+ */
+void	pp_md5(const void * data, size_t len, char * digest)
+{
+#if PG_VERSION_NUM >= 150000
+	const char * errstr = NULL;
+
+	if(!pg_md5_binary(data, len, digest, &errstr)) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INTERNAL_ERROR),
+			 errmsg("could not compute MD5 digest: %s", errstr)));
+	}
+#else
+	if(!pg_md5_binary(data, len, digest)) {
+		ereport(ERROR,
+			(errcode(ERRCODE_OUT_OF_MEMORY),
+			 errmsg("out of memory")));
+	}
+#endif
+}
+
+void * gm_image_to_blob(Image * timg, size_t * blen, ExceptionInfo * ex)
+{
+	return gm_image_to_blob_fmt(timg, "JPEG", blen, ex);
+}
+
+void * gm_image_to_blob_fmt(Image * timg, const char * magick, size_t * blen, ExceptionInfo * ex)
+{
+	return gm_image_encode(timg, magick, 0, blen, ex);
+}
+
+/*
+ * quality goes from 1 to 100, 0 leaves GM's default
+ */
+void *	gm_image_encode(Image * timg, const char * magick, int quality, size_t * blen, ExceptionInfo * ex)
+{
+	ImageInfo *iinfo;
+	void * blob;
+	instr_time start;
+	bool timed = PP_STAT_START(start);
+
+	iinfo = CloneImageInfo(NULL);
+	strcpy(iinfo->magick, magick);
+	if(quality > 0) iinfo->quality = quality;
+	blob = ImageToBlob(iinfo, timg, blen, ex);
+	DestroyImageInfo(iinfo);
+	if(!blob) gm_raise(ex, "error writing image data");
+	if(timed) pp_stat_op(PP_OP_ENCODE, &start, 0, *blen, (int64) timg->columns * timg->rows);
+	
+	return gm_track(blob, PP_RES_BLOB);
+}
+
+Image *		gm_image_from_lob(Oid loid)
+{
+	int blen;
+	void * blob;
+
+	if(!OidIsValid(loid)) return NULL;
+	blob = lo_readblob(loid, &blen);
+	return gm_image_from_blob(blob, blen);
+}
+
+Image *		gm_image_from_bytea(bytea * imgdata)
+{
+	if(!imgdata) return NULL;
+	return gm_image_from_blob(VARDATA(imgdata), VARSIZE(imgdata) - VARHDRSZ);
+}
+
+Image *		gm_image_from_image(PPImage * img)
+{
+	if(!img) return NULL;
+	pp_check_pixels(img->width, img->height);
+	return gm_image_from_blob(PP_DATA(img), PP_DATALEN(img));
+}
+
+/*
+ * Reads the image's attributes and profiles, not its pixels
+ */
+Image *		gm_ping_blob(const void * blob, size_t blen)
+{
+	ExceptionInfo ex;
+	ImageInfo * iinfo;
+	Image * res;
+	instr_time start;
+	bool timed = PP_STAT_START(start);
+
+	GetExceptionInfo(&ex);
+	iinfo = CloneImageInfo(NULL);
+	/* the header describes the first frame */
+	iinfo->subimage = 0;
+	iinfo->subrange = 1;
+	res = PingBlob(iinfo, blob, blen, &ex);
+	DestroyImageInfo(iinfo);
+	if(!res) gm_raise(&ex, "error reading image data");
+	DestroyExceptionInfo(&ex);
+	if(timed) pp_stat_op(PP_OP_PING, &start, blen, 0, 0);
+	/* decoders ignoring the range return every frame */
+	return gm_track(gm_take_frame(res, res), PP_RES_IMAGE);
+}
+
+Image *		gm_image_from_image_hint(PPImage * img, int32 w, int32 h)
+{
+	int64 scale = 1;
+
+	/* in 64 bits, so that hostile sizes can't wrap past the checks */
+	if(img->format != PP_FMT_JPEG || (int64) w * 2 > img->width || (int64) h * 2 > img->height) {
+		return gm_image_from_image(img);
+	}
+	/* libjpeg scales by 1/2, 1/4 or 1/8, keeping at least w x h */
+	while(scale < 8 && img->width / (scale * 2) >= w && img->height / (scale * 2) >= h) scale *= 2;
+	pp_check_pixels((img->width + scale - 1) / scale, (img->height + scale - 1) / scale);
+	return gm_image_from_blob_hint(PP_DATA(img), PP_DATALEN(img), w, h);
+}
+
+Image *		gm_image_from_blob(const void * blob, size_t blen)
+{
+	return gm_image_from_blob_hint(blob, blen, 0, 0);
+}
+
+/*
+ * With a size hint, decoders that can (JPEG, by 1/2 to 1/8) scale
+ * the image down while decoding, keeping it at least w x h.
+ * Operations work on the first frame, the only one decoded.
+ */
+Image *		gm_image_from_blob_hint(const void * blob, size_t blen, int32 w, int32 h)
+{
+	return gm_image_page(blob, blen, PP_FMT_UNKNOWN, 0, w, h);
+}
+
+/*
+ * Decodes frame (or page) number page, from 0, telling the decoder
+ * to stop there: those of formats with an index (TIFF) don't even
+ * read the ones before. Animation frames may only cover part of
+ * the canvas and build on the previous ones, so past the first
+ * GIF frame all the frames up to page are decoded and coalesced.
+ */
+Image *		gm_image_page(const void * blob, size_t blen, int format, int32 page, int32 w, int32 h)
+{
+	ExceptionInfo ex;
+	ImageInfo * iinfo;
+	Image * res, * frame, * all;
+	char size[2*INTLEN];
+	bool coalesce = (format == PP_FMT_GIF && page > 0);
+	int64 pixels = 0;
+	instr_time start;
+	bool timed = PP_STAT_START(start);
+
+	GetExceptionInfo(&ex);
+	iinfo = CloneImageInfo(NULL);
+	if(w > 0 && h > 0) {
+		snprintf(size, sizeof(size), "%dx%d", w, h);
+		CloneString(&iinfo->size, size);
+	}
+	iinfo->subimage = coalesce ? 0 : page;
+	iinfo->subrange = coalesce ? page + 1 : 1;
+	res = BlobToImage(iinfo, blob, blen, &ex);
+	DestroyImageInfo(iinfo);
+	if(!res) gm_raise(&ex, "error reading image data");
+	for(frame = res; frame; frame = frame->next) pixels += (int64) frame->columns * frame->rows;
+	if(timed) pp_stat_op(PP_OP_DECODE, &start, blen, 0, pixels);
+
+	if(coalesce) {
+		all = CoalesceImages(res, &ex);
+		DestroyImageList(res);
+		if(!all) gm_raise(&ex, "error processing image");
+		res = all;
+	}
+	DestroyExceptionInfo(&ex);
+	/*
+	 * Decoders ignoring the range return every frame, or just the
+	 * first: look for the one numbered page, by scene number, else
+	 * by position when there are several
+	 */
+	if(coalesce) frame = GetImageFromList(res, page);
+	else if(page == 0) frame = res;
+	else {
+		for(frame = res; frame && frame->scene != (unsigned long) page; frame = frame->next);
+		if(!frame && res->next) frame = GetImageFromList(res, page);
+	}
+	if(!frame) {
+		DestroyImageList(res);
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("image has no page %d", page)));
+	}
+
+	return gm_track(gm_take_frame(res, frame), PP_RES_IMAGE);
+}
+
+/*
+ * Detaches frame from list, destroying the other frames
+ */
+Image *		gm_take_frame(Image * list, Image * frame)
+{
+	if(list == frame) list = frame->next;
+	if(frame->previous) frame->previous->next = frame->next;
+	if(frame->next) frame->next->previous = frame->previous;
+	frame->previous = NULL;
+	frame->next = NULL;
+	if(list) DestroyImageList(list);
+	return frame;
+}
+
+/*
+ * Frames (or pages) in the encoded image, pinging them all
+ */
+int32		gm_page_count(const void * blob, size_t blen)
+{
+	ExceptionInfo ex;
+	ImageInfo * iinfo;
+	Image * res;
+	int32 n;
+	instr_time start;
+	bool timed = PP_STAT_START(start);
+
+	GetExceptionInfo(&ex);
+	iinfo = CloneImageInfo(NULL);
+	res = PingBlob(iinfo, blob, blen, &ex);
+	DestroyImageInfo(iinfo);
+	if(!res) gm_raise(&ex, "error reading image data");
+	DestroyExceptionInfo(&ex);
+	if(timed) pp_stat_op(PP_OP_PING, &start, blen, 0, 0);
+	n = GetImageListLength(res);
+	DestroyImageList(res);
+	return n;
+}
+
+void	gm_image_destroy(Image * gimg)
+{
+	gm_destroy(gimg, PP_RES_IMAGE);
+}
+
+/*
+ * Takes ownership of the image returned by a GM call,
+ * raising the error GM reported if there's none
+ */
+Image *	gm_result(Image * res, ExceptionInfo * ex)
+{
+	if(!res) gm_raise(ex, "error processing image");
+	return gm_track(res, PP_RES_IMAGE);
+}
+
+void	gm_raise(ExceptionInfo * ex, const char * msg)
+{
+	char * reason = pstrdup(ex->reason ? ex->reason : "unknown error");
+	bool limit = (ex->severity == ResourceLimitError);
+
+	DestroyExceptionInfo(ex);
+	if(limit) {
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("%s: %s", msg, reason),
+			 errhint("See postpic.max_pixels, postpic.max_memory and postpic.max_disk.")));
+	}
+	ereport(ERROR,
+		(errcode(ERRCODE_UNDEFINED_OBJECT),
+		 errmsg("%s: %s", msg, reason)));
+}
+
+/*
+ * Refuses to work on images larger than postpic.max_pixels,
+ * before GM gets to allocate anything for them
+ */
+void	pp_check_pixels(int64 w, int64 h)
+{
+	if(w <= 0 || h <= 0) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid image size %ldx%ld", (long) w, (long) h)));
+	}
+	if(max_pixels > 0 && w * h > max_pixels) {
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("image size %ldx%ld exceeds postpic.max_pixels (%d)",
+				(long) w, (long) h, max_pixels)));
+	}
+}
+
+void	assign_max_pixels(int newval, void * extra)
+{
+	SetMagickResourceLimit(PixelsResource, newval > 0 ? newval : gm_default_pixels);
+}
+
+void	assign_max_memory(int newval, void * extra)
+{
+	/* memory mapped pixel caches count as memory too */
+	SetMagickResourceLimit(MemoryResource,
+		newval > 0 ? (magick_int64_t) newval * 1024 : gm_default_memory);
+	SetMagickResourceLimit(MapResource,
+		newval > 0 ? (magick_int64_t) newval * 1024 : gm_default_map);
+}
+
+void	assign_max_disk(int newval, void * extra)
+{
+	SetMagickResourceLimit(DiskResource,
+		newval > 0 ? (magick_int64_t) newval * 1024 : gm_default_disk);
+}
+
+/*
+ * GM sizes the OpenMP team of every parallel loop from this limit,
+ * so it takes effect from the next operation on
+ */
+void	assign_max_threads(int newval, void * extra)
+{
+	SetMagickResourceLimit(ThreadsResource, newval > 0 ? newval : gm_default_threads);
+}
+
+void *	gm_track(void * obj, PPResourceKind kind)
+{
+	if(!obj) return NULL;
+	if(nresources == maxresources) {
+		maxresources = maxresources ? 2 * maxresources : 16;
+		resources = resources
+			? repalloc(resources, maxresources * sizeof(PPResource))
+			: MemoryContextAlloc(TopMemoryContext, maxresources * sizeof(PPResource));
+	}
+	resources[nresources].obj = obj;
+	resources[nresources].kind = kind;
+	resources[nresources].owner = CurrentResourceOwner;
+	++nresources;
+	return obj;
+}
+
+void	gm_untrack(void * obj)
+{
+	int i;
+
+	/* most recent first, it's usually the one */
+	for(i = nresources - 1; i >= 0; --i) {
+		if(resources[i].obj == obj) {
+			resources[i] = resources[--nresources];
+			return;
+		}
+	}
+}
+
+void	gm_destroy(void * obj, PPResourceKind kind)
+{
+	if(!obj) return;
+	gm_untrack(obj);
+	switch(kind) {
+		case PP_RES_IMAGE: DestroyImage((Image *) obj); break;
+		case PP_RES_IMAGEINFO: DestroyImageInfo((ImageInfo *) obj); break;
+		case PP_RES_DRAW: DrawDestroyContext((DrawContext) obj); break;
+		case PP_RES_DRAWINFO: DestroyDrawInfo((DrawInfo *) obj); break;
+		case PP_RES_BLOB: free(obj); break;
+	}
+}
+
+/*
+ * Resource owner callback: whatever is still tracked when its owner
+ * is released was left behind by an error (or a bug), free it
+ */
+void	gm_release_resources(ResourceReleasePhase phase, bool isCommit, bool isTopLevel, void * arg)
+{
+	int i;
+
+	if(phase != RESOURCE_RELEASE_AFTER_LOCKS) return;
+	if(isTopLevel && !isCommit) stat_depth = 0;
+	for(i = nresources - 1; i >= 0; --i) {
+		if(resources[i].owner != CurrentResourceOwner) continue;
+		if(isCommit) elog(WARNING, "postpic: GraphicsMagick object leaked");
+		/* the last one takes its place, and has been seen already */
+		gm_destroy(resources[i].obj, resources[i].kind);
+	}
+}
+
+Size	pp_stats_size(void)
+{
+	return add_size(offsetof(PPStats, entries), mul_size(PP_STAT_ENTRIES, sizeof(PPStat)));
+}
+
+#if PG_VERSION_NUM >= 150000
+void	pp_shmem_request(void)
+{
+	if(prev_shmem_request_hook) prev_shmem_request_hook();
+	RequestAddinShmemSpace(pp_stats_size());
+}
+#endif
+
+void	pp_shmem_startup(void)
+{
+	bool found;
+
+	if(prev_shmem_startup_hook) prev_shmem_startup_hook();
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	stats = (PPStats *) ShmemInitStruct("PostPic statistics", pp_stats_size(), &found);
+	if(!found) {
+		SpinLockInit(&stats->mutex);
+		stats->nentries = 0;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * The entry for funcid (InvalidOid for internal operation op)
+ * in the current database, added if missing. NULL once the
+ * table is full.
+ */
+PPStat *	pp_stat_entry(Oid funcid, int op)
+{
+	volatile PPStats * vs = stats;
+	PPStat * e;
+	int i, n;
+
+	SpinLockAcquire(&vs->mutex);
+	n = vs->nentries;
+	SpinLockRelease(&vs->mutex);
+	/* entries don't change key once added: look without the lock first */
+	for(i = 0; i < n; ++i) {
+		e = &stats->entries[i];
+		if(e->dbid == MyDatabaseId && e->funcid == funcid && e->op == op) return e;
+	}
+	SpinLockAcquire(&vs->mutex);
+	for(; i < vs->nentries; ++i) {
+		e = &stats->entries[i];
+		if(e->dbid == MyDatabaseId && e->funcid == funcid && e->op == op) break;
+	}
+	if(i == vs->nentries) {
+		e = NULL;
+		if(i < PP_STAT_ENTRIES) {
+			e = &stats->entries[i];
+			memset(e, 0, sizeof(PPStat));
+			e->dbid = MyDatabaseId;
+			e->funcid = funcid;
+			e->op = op;
+			SpinLockInit(&e->mutex);
+			vs->nentries++;
+		}
+	}
+	SpinLockRelease(&vs->mutex);
+	return e;
+}
+
+/*
+ * The entry of a function, NULL if it's not one of ours.
+ * The answer is remembered by the backend.
+ */
+PPStat *	pp_stat_function(Oid funcid)
+{
+	PPStatFunction * sf;
+	HASHCTL ctl;
+	bool found;
+
+	if(!stat_functions) {
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(PPStatFunction);
+#if PG_VERSION_NUM >= 90500
+		stat_functions = hash_create("PostPic statistics functions", 64, &ctl,
+			HASH_ELEM | HASH_BLOBS);
+#else
+		ctl.hash = oid_hash;
+		stat_functions = hash_create("PostPic statistics functions", 64, &ctl,
+			HASH_ELEM | HASH_FUNCTION);
+#endif
+	}
+	sf = (PPStatFunction *) hash_search(stat_functions, &funcid, HASH_ENTER, &found);
+	if(!found) sf->entry = pp_is_ours(funcid) ? pp_stat_entry(funcid, PP_OP_FUNCTION) : NULL;
+	return sf->entry;
+}
+
+/*
+ * Whether funcid is a C function from this library
+ */
+bool	pp_is_ours(Oid funcid)
+{
+	HeapTuple tup;
+	Datum bin;
+	char * path, * base;
+	bool isnull, ours = false;
+
+	tup = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
+	if(!HeapTupleIsValid(tup)) return false;
+	if(((Form_pg_proc) GETSTRUCT(tup))->prolang == ClanguageId) {
+		bin = SysCacheGetAttr(PROCOID, tup, Anum_pg_proc_probin, &isnull);
+		if(!isnull) {
+			path = TextDatumGetCString(bin);
+			base = last_dir_separator(path);
+			base = base ? base + 1 : path;
+			ours = !strncmp(base, "postpic", 7) && (!base[7] || base[7] == '.');
+		}
+	}
+	ReleaseSysCache(tup);
+	return ours;
+}
+
+void	pp_stat_add(PPStat * e, const instr_time * start, int64 in, int64 out, int64 pixels)
+{
+	volatile PPStat * ve = e;
+	instr_time t;
+	double ms;
+
+	if(!e) return;
+	INSTR_TIME_SET_CURRENT(t);
+	INSTR_TIME_SUBTRACT(t, *start);
+	ms = INSTR_TIME_GET_MILLISEC(t);
+	SpinLockAcquire(&ve->mutex);
+	ve->calls++;
+	ve->total_time += ms;
+	if(ms > ve->max_time) ve->max_time = ms;
+	ve->bytes_in += in;
+	ve->bytes_out += out;
+	ve->pixels += pixels;
+	SpinLockRelease(&ve->mutex);
+}
+
+/*
+ * Accounts for an internal operation started with PP_STAT_START
+ */
+void	pp_stat_op(int op, const instr_time * start, int64 in, int64 out, int64 pixels)
+{
+	if(!stats) return;
+	stat_bytes_in += in;
+	stat_bytes_out += out;
+	stat_pixels += pixels;
+	if(!stat_op_entries[op]) stat_op_entries[op] = pp_stat_entry(InvalidOid, op);
+	pp_stat_add(stat_op_entries[op], start, in, out, pixels);
+}
+
+/*
+ * Asks fmgr to go through pp_fmgr_hook for our functions,
+ * while postpic.track_stats is on
+ */
+bool	pp_needs_fmgr_hook(Oid funcid)
+{
+	bool ours = PP_STATS_ON && pp_stat_function(funcid) != NULL;
+
+	if(prev_needs_fmgr_hook && prev_needs_fmgr_hook(funcid)) return true;
+	return ours;
+}
+
+/*
+ * Times calls of our functions, the internal operations
+ * they run included. Calls that fail don't count.
+ */
+void	pp_fmgr_hook(FmgrHookEventType event, FmgrInfo * flinfo, Datum * arg)
+{
+	PPStatCall * c;
+	PPStat * e = stat_functions ? pp_stat_function(flinfo->fn_oid) : NULL;
+
+	if(e) {
+		switch(event) {
+			case FHET_START:
+				if(stat_depth < PP_STAT_DEPTH) {
+					c = &stat_calls[stat_depth];
+					c->entry = e;
+					INSTR_TIME_SET_CURRENT(c->start);
+					c->bytes_in = stat_bytes_in;
+					c->bytes_out = stat_bytes_out;
+					c->pixels = stat_pixels;
+				}
+				++stat_depth;
+				break;
+			case FHET_END:
+			case FHET_ABORT:
+				if(stat_depth > 0 && --stat_depth < PP_STAT_DEPTH && event == FHET_END && track_stats) {
+					c = &stat_calls[stat_depth];
+					pp_stat_add(c->entry, &c->start, stat_bytes_in - c->bytes_in,
+						stat_bytes_out - c->bytes_out, stat_pixels - c->pixels);
+				}
+				break;
+		}
+	}
+	if(prev_fmgr_hook) prev_fmgr_hook(event, flinfo, arg);
+}
+
+char *	gm_image_getattr(Image * img, const char * attr)
+{
+	const ImageAttribute * attrs = GetImageAttribute(img, attr);
+	if(!attrs) return NULL;
+	return pstrdup(attrs->value);
+}
+
+PixelPacket *   gm_ppacket_from_color(const PPColor * color)
+{
+	PixelPacket * pp = (PixelPacket *)palloc(sizeof(PixelPacket));
+	unsigned int data = ntohl(color->cd);
+	
+	if ((color->cs == CS_RGB.oid) || (color->cs == CS_sRGB.oid)) data = (data << 8);
+	pp->red = (data >> 24) & 0xFF;
+	pp->green = (data >> 16 ) & 0xFF;
+	pp->blue = (data >> 8 ) & 0xFF;
+	pp->opacity = data & 0xFF;
+	return pp;
+}
+
+int		pp_substr2int(char * str, int off, int len)
+{
+	str[off+len] = 0;
+	return atoi(str+off);
+}
+
+Timestamp	pp_str2timestamp(const char * edate)
+{
+	struct pg_tm tm;
+	Timestamp res;
+	char * date;
+	
+	if(!edate || strlen(edate)<19) {
+    	//elog(WARNING, "could not parse date %s", edate);
+	    TIMESTAMP_NOBEGIN(res);
+	    return res;
+	}
+	date = pstrdup(edate);
+	tm.tm_year = pp_substr2int(date, 0, 4);
+	tm.tm_mon =  pp_substr2int(date, 5, 2);
+	tm.tm_mday = pp_substr2int(date, 8, 2);
+	tm.tm_hour = pp_substr2int(date, 11, 2);
+	tm.tm_min = pp_substr2int(date, 14, 2);
+	tm.tm_sec = pp_substr2int(date, 17, 2);
+	tm2timestamp(&tm, 0, NULL, &res);
+	return res;
+}
+
+/*
+char*	pp_timestamp2str(Timestamp ts)
+{
+	/--* postgres tax *--/
+	int tzp;
+	fsec_t fsec;
+	char *tzn;
+	/--* end tax *--/
+	struct pg_tm tm;
+	char * res; 
+	
+	if(TIMESTAMP_IS_NOBEGIN(ts)) {
+		return pstrdup("");
+	}
+	res = palloc(DATELEN);
+	timestamp2tm(ts, &tzp, &tm, &fsec , &tzn, NULL);
+	sprintf(res, "%d-%.2d-%.2d %.2d:%.2d:%.2d", tm.tm_year, tm.tm_mon, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec);
+	return res;
+}
+*/
+char * 	pp_varchar2str(VarChar * text)
+{
+	char * str;
+	int sz;
+
+    sz = VARSIZE(text) - VARHDRSZ;
+    str = palloc(sz + 1);
+    strncpy(str, VARDATA(text), sz);
+    str[sz]=0;
+
+	return str;
+}
+
+float4	pp_parse_float(const char * str)
+{
+    float s=-1,g=1;
+    if(!str || !str[0]) return -1;
+    if(index(str, '/')==NULL) return strtod(str,NULL);
+    sscanf(str, "%f/%f", &s, &g);
+    return s/g;
+}
+
+int		pp_parse_int(char * str)
+{
+	if(!str || !isdigit(str[0])) return -1;
+	return pg_atoi(str, 4, 0);
+}
+
+Oid		pp_parse_cstype(const ColorspaceType t)
+{
+	switch (t) {
+		case RGBColorspace: return CS_RGB.oid;
+		case TransparentColorspace: return CS_RGBA.oid;
+		case GRAYColorspace: return CS_GRAY.oid;
+		case sRGBColorspace: return CS_sRGB.oid;
+		case CMYKColorspace: return CS_CMYK.oid;	
+		default: return CS_UNKNOWN.oid;
+	}
+}
+
+/*
+ * The colorspace enum's values, looked up on first use rather than
+ * when the library is loaded: preloaded, it may be before the
+ * extension exists, and in a database it isn't installed in
+ */
+PPColorspace *	pp_colorspaces(void)
+{
+	Oid nsp;
+	int i;
+
+	if(colorspaces_valid) return colorspaces;
+	nsp = pp_extension_namespace();
+	colorspace_oid = OidIsValid(nsp) ? pp_syscache_oid(TYPENAMENSP, Anum_pg_type_oid,
+		CStringGetDatum("colorspace"), ObjectIdGetDatum(nsp)) : InvalidOid;
+	for(i = 0; colorspaces[i].name; ++i) {
+		colorspaces[i].oid = OidIsValid(colorspace_oid) ? pp_syscache_oid(ENUMTYPOIDNAME, Anum_pg_enum_oid,
+			ObjectIdGetDatum(colorspace_oid), CStringGetDatum(colorspaces[i].name)) : InvalidOid;
+	}
+	/* without the extension, try again next time */
+	colorspaces_valid = OidIsValid(colorspace_oid);
+	if(colorspaces_valid) colorspace_hash = GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(colorspace_oid));
+	return colorspaces;
+}
+
+/*
+ * Syscache callback: the colorspace type changed, as with DROP
+ * EXTENSION, or the whole cache was reset. Other types are of no
+ * concern: until the extension exists, nothing is cached.
+ */
+void	pp_colorspaces_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+{
+	if(hashvalue == 0 || hashvalue == colorspace_hash) colorspaces_valid = false;
+}
+
+/*
+ * Schema postpic is installed in, InvalidOid if it isn't
+ */
+Oid		pp_extension_namespace(void)
+{
+	Relation rel;
+	ScanKeyData key;
+	SysScanDesc scan;
+	HeapTuple tup;
+	Oid nsp = InvalidOid;
+
+	rel = table_open(ExtensionRelationId, AccessShareLock);
+	ScanKeyInit(&key, Anum_pg_extension_extname, BTEqualStrategyNumber, F_NAMEEQ,
+		CStringGetDatum("postpic"));
+	scan = systable_beginscan(rel, ExtensionNameIndexId, true, NULL, 1, &key);
+	tup = systable_getnext(scan);
+	if(HeapTupleIsValid(tup)) nsp = ((Form_pg_extension) GETSTRUCT(tup))->extnamespace;
+	systable_endscan(scan);
+	table_close(rel, AccessShareLock);
+	return nsp;
+}
+
+void	pp_parse_color(const char * str, PPColor * color)
+{
+	char cs[COLORLEN], cd[COLORLEN];
+	PPColorspace * cspaces;
+	int i = 0;
+	
+	while(str[i] && str[i]!='#') ++i;
+	if(!str[i]) {
+		color->cs = InvalidOid;
+		return;
+	}
+	strncpy(cs, str, i); cs[i]=0;
+	strcpy(cd, str + i + 1);
+	
+	color->cd = htonl(strtoll(cd, NULL, 16));
+	if(!cs[0]) {
+		color->cs = (strlen(cd)>6 ? CS_RGBA.oid : CS_RGB.oid);
+	} else {
+		cspaces = pp_colorspaces();
+		i = 1;
+		while(cspaces[i].name && strcmp(cs, cspaces[i].name)) ++i;
+		if(!(cspaces[i].name)) i=0;
+		color->cs = cspaces[i].oid;
+	}
+}
+
+PPImage *	pp_init_image(Image * gimg) 
+{
+	return pp_init_image_full(gimg, NULL, 0);
+}
+
+/*
+ * Ingests an encoded image. Unless pyramids are to be built,
+ * which need the pixels, GM just pings it: the header, profiles
+ * and attributes are all pp_init_image_full looks at.
+ */
+PPImage *	pp_ingest_blob(void * data, size_t datalen)
+{
+	Image * gimg;
+	PPImage * img;
+	void * opt = NULL;
+	size_t optlen;
+	int format;
+
+	if(pyramid_levels > 0) gimg = gm_image_from_blob(data, datalen);
+	else gimg = gm_ping_blob(data, datalen);
+	/* the header and metadata still come from the original */
+	if(optimize_mode != PP_OPTIMIZE_OFF) {
+		format = pp_parse_format(gimg->magick);
+		if(format == PP_FMT_PNG) pp_check_pixels(gimg->columns, gimg->rows);
+		opt = pp_optimize_data(format, data, datalen, optimize_mode == PP_OPTIMIZE_STRIP, false, &optlen);
+	}
+	img = pp_ingest_image(gimg, opt ? opt : data, opt ? optlen : datalen);
+	if(opt) gm_destroy(opt, PP_RES_BLOB);
+	gm_image_destroy(gimg);
+	return img;
+}
+
+/*
+ * A smaller rendition of an encoded JPEG or PNG image with the same
+ * pixels, NULL if there's none. JPEG gets Huffman tables computed
+ * for it (and progressive scans, if asked), PNG the strongest deflate
+ * with adaptive filtering or none, whichever is smaller. strip drops
+ * the metadata too, but for color profiles.
+ */
+void *	pp_optimize_data(int format, const void * data, size_t len, bool strip, bool progressive, size_t * olen)
+{
+	static const int png_qualities[] = { 95, 90 };
+	ExceptionInfo ex;
+	Image * gimg;
+	unsigned char * blob;
+	void * res = NULL;
+	size_t blen;
+	int i;
+	instr_time start;
+	bool timed = PP_STAT_START(start);
+
+	*olen = len;
+	if(format == PP_FMT_JPEG) {
+		blen = pp_jpeg_optimize(data, len, progressive, strip, &blob);
+		if(blob) gm_track(blob, PP_RES_BLOB);
+		if(blen > 0 && blen < len) {
+			res = blob;
+			*olen = blen;
+		} else {
+			gm_destroy(blob, PP_RES_BLOB);
+		}
+	} else if(format == PP_FMT_PNG) {
+		gimg = gm_image_from_blob(data, len);
+		/* samples deeper than GM's quanta would lose bits */
+		if(gimg->depth <= QuantumDepth) {
+			if(strip) gm_strip(gimg);
+			GetExceptionInfo(&ex);
+			for(i = 0; i < lengthof(png_qualities); ++i) {
+				blob = gm_image_encode(gimg, "PNG", png_qualities[i], &blen, &ex);
+				if(blen < *olen) {
+					gm_destroy(res, PP_RES_BLOB);
+					res = blob;
+					*olen = blen;
+				} else {
+					gm_destroy(blob, PP_RES_BLOB);
+				}
+			}
+			DestroyExceptionInfo(&ex);
+		}
+		gm_image_destroy(gimg);
+	}
+	if(timed) pp_stat_op(PP_OP_OPTIMIZE, &start, len, *olen, 0);
+	return res;
+}
+
+/*
+ * The image in d with a smaller rendition of its encoded image,
+ * NULL if there's none
+ */
+PPImage *	pp_optimize_image(Datum d, bool strip, bool progressive)
+{
+	PPImage * img = pp_header_from_datum(d, false), * res;
+	void * data;
+	size_t len;
+
+	if(img->format != PP_FMT_JPEG && img->format != PP_FMT_PNG) return NULL;
+	img = pp_image_from_datum(d);
+	pp_check_pixels(img->width, img->height);
+	data = pp_optimize_data(img->format, PP_DATA(img), PP_DATALEN(img), strip, progressive, &len);
+	if(!data) return NULL;
+	res = pp_replace_data(img, data, len);
+	gm_destroy(data, PP_RES_BLOB);
+	return res;
+}
+
+/*
+ * The metadata GM would write back, but color profiles and
+ * the EXIF orientation, which is left in a block of its own
+ */
+void	gm_strip(Image * gimg)
+{
+	static const char * profiles[] = { "EXIF", "XMP", "IPTC", "8BIM" };
+	const ImageAttribute * attr;
+	unsigned char exif[PP_EXIF_ORIENTATION_LEN];
+	int orientation = 0, i;
+
+	attr = GetImageAttribute(gimg, ATTR_ORIENT);
+	if(attr) orientation = pp_parse_int(attr->value);
+	for(i = 0; i < lengthof(profiles); ++i) DeleteImageProfile(gimg, profiles[i]);
+	DestroyImageAttributes(gimg);
+	if(orientation > 1 && orientation <= 8) {
+		SetImageProfile(gimg, "EXIF", exif, pp_exif_orientation_block(orientation, exif));
+	}
+}
+
+/*
+ * img with its encoded image replaced by one with the same pixels:
+ * metadata and pyramid stay, digest and preview are computed again
+ */
+PPImage *	pp_replace_data(const PPImage * img, const void * data, size_t len)
+{
+	PPSectionData sects[PP_MAX_SECTIONS];
+	char digest[DIGESTLEN];
+	PPPreview pv;
+
+	pp_get_sections(img, sects);
+	pp_md5(data, len, digest);
+	sects[PPS_DIGEST].data = digest;
+	sects[PPS_DIGEST].len = DIGESTLEN;
+	sects[PPS_PREVIEW].data = NULL;
+	if(img->format == PP_FMT_JPEG && pp_find_preview(data, len, &pv)) {
+		sects[PPS_PREVIEW].data = &pv;
+		sects[PPS_PREVIEW].len = sizeof(PPPreview);
+	}
+	return pp_assemble(img, sects, data, len);
+}
+
+/*
+ * Like pp_init_image_full, for images entering the database
+ * rather than being derived from others: storage options apply
+ */
+PPImage *	pp_ingest_image(Image * gimg, void * data, size_t datalen)
+{
+	PPImage * img = pp_init_image_full(gimg, data, datalen);
+
+	if(img && pyramid_levels > 0) img = pp_build_pyramid(img, gimg, pyramid_levels);
+	return img;
+}
+
+PPImage *	pp_init_image_full(Image * gimg, void * data, size_t datalen)
+{
+	const char * attr;
+	void * blob;
+	size_t blen;
+	ExceptionInfo ex;
+	PPImage hdr, * img;
+	PPSectionData sects[PP_MAX_SECTIONS];
+	StringInfoData meta;
+	char digest[DIGESTLEN];
+	PPPreview pv;
+
+	if(!gimg) return NULL;
+
+	//Get gimg's blob
+	GetExceptionInfo(&ex);
+	if(!data) {
+		blob =gm_image_to_blob(gimg, &blen, &ex);
+	} else {
+		blob = data;
+		blen = datalen;
+	}
+	DestroyExceptionInfo(&ex);
+
+	memset(&hdr, 0, sizeof(PPImage));
+	memset(sects, 0, sizeof(sects));
+	//Data we have in Image
+	hdr.width = gimg->columns;
+	hdr.height = gimg->rows;
+	hdr.cspace = pp_parse_cstype(gimg->colorspace);
+	hdr.format = data ? pp_parse_format(gimg->magick) : PP_FMT_JPEG;
+
+	//Parse the whole attribute set once
+	initStringInfo(&meta);
+	pp_collect_metadata(gimg, &meta);
+	sects[PPS_METADATA].data = meta.data;
+	sects[PPS_METADATA].len = meta.len;
+	pp_md5(blob, blen, digest);
+	sects[PPS_DIGEST].data = digest;
+	sects[PPS_DIGEST].len = DIGESTLEN;
+	if(hdr.format == PP_FMT_JPEG && pp_find_preview(blob, blen, &pv)) {
+		sects[PPS_PREVIEW].data = &pv;
+		sects[PPS_PREVIEW].len = sizeof(PPPreview);
+	}
+
+	//Data read from attributes
+	attr = pp_meta_lookup(meta.data, meta.len, ATTR_TIME);
+	hdr.date = pp_str2timestamp(attr);
+	attr = pp_meta_lookup(meta.data, meta.len, ATTR_FNUM);
+	hdr.f_number = pp_parse_float(attr);
+	attr = pp_meta_lookup(meta.data, meta.len, ATTR_EXPT);
+	hdr.exposure_t = pp_parse_float(attr);
+	attr = pp_meta_lookup(meta.data, meta.len, ATTR_ISO);
+	hdr.iso = pp_parse_int((char *) attr);
+	attr = pp_meta_lookup(meta.data, meta.len, ATTR_FLEN);
+	hdr.focal_l = pp_parse_float(attr);
+	attr = pp_meta_lookup(meta.data, meta.len, ATTR_ORIENT);
+	hdr.orientation = Max(pp_parse_int((char *) attr), 0);
+
+	img = pp_assemble(&hdr, sects, blob, blen);
+	if(!data) gm_destroy(blob, PP_RES_BLOB);
+	pfree(meta.data);
+	return img;
+}
+
+uint8	pp_parse_format(const char * magick)
+{
+	int i = 1;
+	while (formats[i] && strcmp(magick, formats[i])) ++i;
+	return formats[i] ? i : PP_FMT_UNKNOWN;
+}
+
+/*
+ * Builds an image value out of a header, the optional sections
+ * (indexed by flag bit, NULL data meaning absent) and the encoded image
+ */
+PPImage *	pp_assemble(const PPImage * hdr, const PPSectionData * sects, const void * data, size_t datalen)
+{
+	PPImage * img;
+	uint16 flags = 0;
+	uint32 off, dataoff, size;
+	int i, n = 0;
+
+	for(i = 0; i < PP_MAX_SECTIONS; ++i) {
+		if(sects[i].data) {
+			flags |= (1 << i);
+			++n;
+		}
+	}
+	off = INTALIGN(offsetof(PPImage, sections) + n * sizeof(PPSection));
+	for(i = 0; i < PP_TRAILING_SECTIONS; ++i) {
+		if(sects[i].data) off = INTALIGN(off + sects[i].len);
+	}
+	dataoff = off;
+	size = off + datalen;
+	for(; i < PP_MAX_SECTIONS; ++i) {
+		if(sects[i].data) size = INTALIGN(size) + sects[i].len;
+	}
+	img = (PPImage *) palloc0(size);
+	memcpy(img, hdr, offsetof(PPImage, sections));
+	SET_VARSIZE(img, size);
+	img->version = PP_FORMAT_MAGIC | PP_FORMAT_VERSION;
+	img->flags = flags;
+	img->dataoff = dataoff;
+	img->datalen = datalen;
+	memcpy(PP_DATA(img), data, datalen);
+
+	off = INTALIGN(offsetof(PPImage, sections) + n * sizeof(PPSection));
+	for(i = 0, n = 0; i < PP_MAX_SECTIONS; ++i) {
+		if(i == PP_TRAILING_SECTIONS) off = INTALIGN(dataoff + datalen);
+		if(!sects[i].data) continue;
+		img->sections[n].off = off;
+		img->sections[n].len = sects[i].len;
+		memcpy((char *) img + off, sects[i].data, sects[i].len);
+		off = INTALIGN(off + sects[i].len);
+		++n;
+	}
+	return img;
+}
+
+void	pp_get_sections(const PPImage * img, PPSectionData * sects)
+{
+	int i, n = 0;
+
+	for(i = 0; i < PP_MAX_SECTIONS; ++i) {
+		sects[i].data = NULL;
+		sects[i].len = 0;
+		if(!PP_HAS(img, 1 << i)) continue;
+		sects[i].data = (const char *) img + img->sections[n].off;
+		sects[i].len = img->sections[n].len;
+		++n;
+	}
+}
+
+char *	pp_section(const PPImage * img, uint16 flag, uint32 * len)
+{
+	int n = 0;
+	uint16 below = img->flags & (flag - 1);
+
+	if(!PP_HAS(img, flag)) return NULL;
+	while(below) {
+		n += below & 1;
+		below >>= 1;
+	}
+	*len = img->sections[n].len;
+	return (char *) img + img->sections[n].off;
+}
+
+/*
+ * Returns a copy of img with section sect set to data,
+ * or removed if data is NULL
+ */
+PPImage *	pp_set_section(const PPImage * img, int sect, const void * data, uint32 len)
+{
+	PPSectionData sects[PP_MAX_SECTIONS];
+
+	pp_get_sections(img, sects);
+	sects[sect].data = data;
+	sects[sect].len = len;
+	return pp_assemble(img, sects, PP_DATA(img), PP_DATALEN(img));
+}
+
+/*
+ * Converts a version 0 value, moving its metadata sidecar
+ * into a section. With header_only, old may be just a slice
+ * holding the fixed data.
+ */
+PPImage *	pp_upgrade_v0(PPImageV0 * old, bool header_only)
+{
+	PPImage hdr;
+	PPSectionData sects[PP_MAX_SECTIONS];
 
-	gm_image_destroy(gimg);
-	gm_image_destroy(timg);
-	DestroyExceptionInfo(&ex);
-	PG_RETURN_POINTER(res);	
+	memset(&hdr, 0, sizeof(PPImage));
+	memset(sects, 0, sizeof(sects));
+	hdr.date = old->date;
+	hdr.width = old->width;
+	hdr.height = old->height;
+	hdr.cspace = old->cspace;
+	hdr.iso = old->iso;
+	hdr.f_number = old->f_number;
+	hdr.exposure_t = old->exposure_t;
+	hdr.focal_l = old->focal_l;
+	if(header_only) {
+		hdr.version = PP_FORMAT_MAGIC | PP_FORMAT_VERSION;
+		hdr.dataoff = offsetof(PPImage, sections);
+		hdr.datalen = VARSIZE(&old->imgdata) - VARHDRSZ;
+		SET_VARSIZE(&hdr, offsetof(PPImage, sections));
+		return (PPImage *) memcpy(palloc(sizeof(PPImage)), &hdr, sizeof(PPImage));
+	}
+	if(PP_V0_HAS_METADATA(old)) {
+		sects[PPS_METADATA].data = VARDATA(PP_V0_METADATA(old));
+		sects[PPS_METADATA].len = VARSIZE(PP_V0_METADATA(old)) - VARHDRSZ;
+	}
+	/* version 0 lost the trailing bytes to struct padding on some builds */
+	return pp_assemble(&hdr, sects, VARDATA(&old->imgdata),
+		Min(VARSIZE(&old->imgdata), VARSIZE(old) - offsetof(PPImageV0, imgdata)) - VARHDRSZ);
 }
 
-PG_FUNCTION_INFO_V1(image_rotate);
-Datum   image_rotate(PG_FUNCTION_ARGS)
+/*
+ * Detoasts an image value, upgrading it to the current format if needed
+ */
+PPImage *	pp_image_from_datum(Datum d)
 {
-	ExceptionInfo ex;
-	float4 deg;
-	PPImage * img, *res;
-	Image * gimg, * timg;
-	
-	img = PG_GETARG_IMAGE(0);
-	deg = PG_GETARG_FLOAT4(1);
+	PPImage * img;
+	instr_time start;
+	bool timed = VARATT_IS_EXTENDED(DatumGetPointer(d)) && PP_STAT_START(start);
 
-	gimg = gm_image_from_bytea(&img->imgdata);
-	GetExceptionInfo(&ex);
-	timg = RotateImage(gimg, deg, &ex);
-	res = pp_init_image(timg);
+	img = (PPImage *) PG_DETOAST_DATUM(d);
+	if(timed) pp_stat_op(PP_OP_DETOAST, &start, VARSIZE(img), 0, 0);
 
-	gm_image_destroy(gimg);
-	gm_image_destroy(timg);
-	DestroyExceptionInfo(&ex);
-	PG_RETURN_POINTER(res);
+	if(PP_IS_V0(img)) return pp_upgrade_v0((PPImageV0 *) img, false);
+	if(PP_HAS(img, PPF_BLOB)) return pp_attach(img);
+	return img;
 }
 
-PG_FUNCTION_INFO_V1(image_square);
-Datum   image_square(PG_FUNCTION_ARGS)
+/*
+ * Fetches just the header of an image value (and its sections, if asked),
+ * without detoasting the encoded image
+ */
+PPImage *	pp_header_from_datum(Datum d, bool sections)
 {
-	ExceptionInfo ex;
-	RectangleInfo ri;
-	int32 size, sx, sy;
-	PPImage * img, * res;
-	Image * gimg, * timg, * simg;
-	
-	img = PG_GETARG_IMAGE(0);
-	size = PG_GETARG_INT32(1);
-	gimg = gm_image_from_bytea(&img->imgdata);
+	PPImage * img;
+	int32 len = Max(sizeof(PPImage), sizeof(PPImageV0));
+	instr_time start;
+	bool timed = VARATT_IS_EXTENDED(DatumGetPointer(d)) && PP_STAT_START(start);
 
-	ri.x = ri.y = 0;
-	ri.width = ri.height = size;
-	if(img->width < img->height) {
-		sx = size;
-		sy = img->height * size / img->width;
-		ri.y = (sy-sx)/2;
-	} else {
-		sy = size;
-		sx = img->width * size / img->height;
-		ri.x = (sx-sy)/2;
+	/* slices are taken past the varlena header */
+	img = (PPImage *) PG_DETOAST_DATUM_SLICE(d, 0, len - VARHDRSZ);
+	if(PP_IS_V0(img)) {
+		if(!sections) return pp_upgrade_v0((PPImageV0 *) img, true);
+		return pp_image_from_datum(d);
 	}
-	GetExceptionInfo(&ex);
-	timg = ThumbnailImage(gimg, sx, sy, &ex);
-	simg = CropImage(timg, &ri, &ex);
-	res = pp_init_image(simg);
-	
-	gm_image_destroy(gimg);
-	gm_image_destroy(timg);
-	gm_image_destroy(simg);
-	DestroyExceptionInfo(&ex);
-	PG_RETURN_POINTER(res);		
+	if(sections && img->dataoff > VARSIZE(img)) {
+		img = (PPImage *) PG_DETOAST_DATUM_SLICE(d, 0, img->dataoff - VARHDRSZ);
+	}
+	if(timed) pp_stat_op(PP_OP_DETOAST_SLICE, &start, VARSIZE(img), 0, 0);
+	/* the slice knows nothing of the encoded image */
+	SET_VARSIZE(img, img->dataoff);
+	return img;
 }
 
-PG_FUNCTION_INFO_V1(image_draw_text);
-Datum   image_draw_text(PG_FUNCTION_ARGS)
+/*
+ * Returns len bytes of the encoded image, starting at off.
+ * hdr must come from pp_header_from_datum(d, true): when it
+ * doesn't hold the image, just the needed slice is detoasted.
+ */
+char *	pp_fetch_data(Datum d, const PPImage * hdr, uint32 off, uint32 len)
 {
-    PPImage * img, * res;
-    PPColor * color = NULL;
-    Image * gimg;
-    DrawContext ctx;
-    VarChar * label, * f_family = NULL;
-    char * str;
-    int x = 20, y = 20, f_size = 10;
-    unsigned int na;
-    
-    na = PG_NARGS();    
-    img = PG_GETARG_IMAGE(0);
-    label = PG_GETARG_VARCHAR_P(1);
-    switch(na) {
-    	case 7: //color
-    		color = (PPColor*) PG_GETARG_POINTER(6);
-    		/* fallthrough */
-    	case 6: //font family and size
-    		f_family = PG_GETARG_VARCHAR_P(4);
-    		f_size = PG_GETARG_INT32(5);
-    		/* fallthrough */
-		case 4: // x and y position
-			x = PG_GETARG_INT32(2);
-			y = PG_GETARG_INT32(3);
-    }
-    gimg = gm_image_from_bytea(&img->imgdata);
-    
-    ctx  = DrawAllocateContext((DrawInfo*)NULL, gimg);
-    if (na>=6) {
-		str = pp_varchar2str(f_family);
-    	DrawSetFontFamily(ctx, str);
-    	DrawSetFontSize(ctx, f_size);
-    	if (na>=7) DrawSetFillColor(ctx, gm_ppacket_from_color(color));
-    }
-	str = pp_varchar2str(label);
-    DrawAnnotation(ctx, x, y, (unsigned char*) str);
-    DrawRender(ctx);
-    DrawDestroyContext(ctx);
-    res = pp_init_image(gimg);
-    gm_image_destroy(gimg);
+	uint32 dlen;
 
-	PG_RETURN_POINTER(res);
+	if(PP_HAS(hdr, PPF_BLOB)) return pp_blob_fetch(pp_section(hdr, PPF_DIGEST, &dlen), off, len);
+	if(VARSIZE(hdr) > hdr->dataoff) return PP_DATA(hdr) + off;
+	return pp_detoast_slice(d, hdr->dataoff + off - VARHDRSZ, len);
 }
 
-PG_FUNCTION_INFO_V1(image_draw_rect);
-Datum   image_draw_rect(PG_FUNCTION_ARGS)
+/*
+ * Length of the encoded image, hdr coming from
+ * pp_header_from_datum(d, true)
+ */
+uint32	pp_stored_datalen(Datum d, const PPImage * hdr)
 {
-    PPImage * img, * res;
-    PPColor * color = NULL;
-    Image * gimg;
-    DrawContext ctx;
-    BOX * rect;
-    //bool fill;
-    
-    img = PG_GETARG_IMAGE(0);
-    rect = PG_GETARG_BOX_P(1);
-    //fill = PG_GETARG_BOOL(2);
-    color = (PPColor*) PG_GETARG_POINTER(2);
-    
-    gimg = gm_image_from_bytea(&img->imgdata);
-    
-    ctx  = DrawAllocateContext((DrawInfo*)NULL, gimg);
-    DrawSetFillColor(ctx, gm_ppacket_from_color(color));
-    DrawRectangle(ctx, rect->high.x, rect->high.y,
-		rect->low.x, rect->low.y);
-    DrawRender(ctx);
-    DrawDestroyContext(ctx);
-    res = pp_init_image(gimg);
-    gm_image_destroy(gimg);
+	PPBlobRef ref;
+	uint32 len;
+	char * sect;
 
-	PG_RETURN_POINTER(res);
+	sect = pp_section(hdr, PPF_BLOB, &len);
+	if(sect) {
+		memcpy(&ref, sect, sizeof(PPBlobRef));
+		return ref.len;
+	}
+	return PP_DATALEN(hdr);
 }
 
-PG_FUNCTION_INFO_V1(image_index);
-Datum	image_index(PG_FUNCTION_ARGS)
+/*
+ * Returns len bytes of a trailing section, starting at sect
+ * (as pp_section locates it in hdr), likewise
+ */
+char *	pp_fetch_section(Datum d, const PPImage * hdr, const char * sect, uint32 len)
 {
-	ArrayType * aimgs;
-	Image * gimg, * rimg;
-	int32 tile, offset;
-	int sz, nimgs, i, istart;
-	ImageInfo iinfo;
-	MontageInfo minfo;
-	ExceptionInfo ex;
-	PPImage * ptr, *res;
-	char * str, * data;
-	VarChar * title;
-	
-	aimgs = PG_GETARG_ARRAYTYPE_P(0);
-	title = PG_GETARG_VARCHAR_P(1);
-	tile = PG_GETARG_INT32(2);
-	
-	nimgs = ARR_DIMS(aimgs)[0];
-	if(nimgs==0) PG_RETURN_NULL();
-	istart = ARR_LBOUND(aimgs)[0]-1;
-	data =  ARR_DATA_PTR(aimgs);
-	gimg = NewImageList();
-	for(i = istart; i < istart+nimgs; ++i) {
-		ptr = (PPImage *) data;
-		AppendImageToList(&gimg, gm_image_from_bytea(& ptr->imgdata));
-		/* go to next image, taking padding into account */
-		sz = VARSIZE(data);
-		offset = sz; if (sz % 4) offset += (4 - (sz % 4));
-		data += offset;
-	}
-	
-	GetImageInfo(&iinfo);
-	GetMontageInfo(&iinfo, &minfo);
-	minfo.geometry = pstrdup("+4+4");
-	str = palloc(2*INTLEN);
-	sprintf(str, "%dx%d", tile, (nimgs % tile ? nimgs/tile+1 : nimgs/tile));
-	minfo.tile = str;
-	str = pp_varchar2str(title);
-	minfo.title = str;
-	minfo.shadow=1;
-	GetExceptionInfo(&ex);
-	rimg = MontageImages(gimg, &minfo, &ex);
-	CatchException(&ex);
-	
-	//So sad, it doesn't work if I don't write the img :((
-	sprintf(rimg->filename, "%s/ppm%d_%s.jpg", tmpdir, tile, minfo.title );
-	str = pstrdup(rimg->filename);
-	WriteImage(&iinfo, rimg);
-    CatchException(&ex);
-    if(!rimg) {
-		res = NULL;
-    	elog(WARNING, "Can't get montage data");
-	}
-    else {
-    	res = pp_init_image(rimg);
-	}
+	uint32 off = sect - (const char *) hdr;
 
-	DestroyImageList(gimg);
-	DestroyExceptionInfo(&ex);
-	gm_image_destroy(rimg);
-	unlink(str);
-	if(res) PG_RETURN_POINTER(res);
-	PG_RETURN_NULL();
+	if(VARSIZE(hdr) >= off + len) return (char *) sect;
+	return pp_detoast_slice(d, off - VARHDRSZ, len);
 }
 
-PG_FUNCTION_INFO_V1(postpic_version);
-Datum	postpic_version(PG_FUNCTION_ARGS)
+/*
+ * len bytes of d, from off (past the varlena header)
+ */
+char *	pp_detoast_slice(Datum d, uint32 off, uint32 len)
 {
-	char * version = palloc(DATELEN);
-	sprintf(version, "PostPic version %d.%d.%d", PP_VERSION_RELEASE,
-		PP_VERSION_MAJOR, PP_VERSION_MINOR);
-	PG_RETURN_CSTRING( version ); 
-}
+	char * res;
+	instr_time start;
+	bool timed = PP_STAT_START(start);
 
-PG_FUNCTION_INFO_V1(postpic_version_release);
-Datum	postpic_version_release(PG_FUNCTION_ARGS)
-{
-	PG_RETURN_INT32( PP_VERSION_RELEASE );
+	res = VARDATA(PG_DETOAST_DATUM_SLICE(d, off, len));
+	if(timed) pp_stat_op(PP_OP_DETOAST_SLICE, &start, len, 0, 0);
+	return res;
 }
 
-PG_FUNCTION_INFO_V1(postpic_version_major);
-Datum	postpic_version_major(PG_FUNCTION_ARGS)
+void	pp_copy_exif(PPImage * dst, const PPImage * src)
 {
-	PG_RETURN_INT32( PP_VERSION_MAJOR );
+	dst->date = src->date;
+	dst->iso = src->iso;
+	dst->f_number = src->f_number;
+	dst->exposure_t = src->exposure_t;
+	dst->focal_l = src->focal_l;
+	dst->orientation = src->orientation;
 }
 
-PG_FUNCTION_INFO_V1(postpic_version_minor);
-Datum	postpic_version_minor(PG_FUNCTION_ARGS)
+/*
+ * The self-contained copy of a deduplicated value
+ */
+PPImage *	pp_attach(const PPImage * img)
 {
-	PG_RETURN_INT32( PP_VERSION_MINOR );
+	PPSectionData sects[PP_MAX_SECTIONS];
+	PPBlobRef ref;
+	uint32 len;
+
+	pp_get_sections(img, sects);
+	memcpy(&ref, sects[PPS_BLOB].data, sizeof(PPBlobRef));
+	sects[PPS_BLOB].data = NULL;
+	sects[PPS_BLOB].len = 0;
+	return pp_assemble(img, sects,
+		pp_blob_fetch(pp_section(img, PPF_DIGEST, &len), 0, ref.len), ref.len);
 }
 
-PG_FUNCTION_INFO_V1(image_width);
-Datum	image_width(PG_FUNCTION_ARGS)
+/*
+ * A copy of img referring to its encoded image by digest,
+ * which must be in postpic_blobs already
+ */
+PPImage *	pp_detach(const PPImage * img, const char * digest)
 {
-	PPImage * img = PG_GETARG_IMAGE(0);
-	PG_RETURN_INT32(img->width);
+	PPSectionData sects[PP_MAX_SECTIONS];
+	PPBlobRef ref;
+
+	pp_get_sections(img, sects);
+	ref.len = PP_DATALEN(img);
+	sects[PPS_DIGEST].data = digest;
+	sects[PPS_DIGEST].len = DIGESTLEN;
+	sects[PPS_BLOB].data = &ref;
+	sects[PPS_BLOB].len = sizeof(PPBlobRef);
+	return pp_assemble(img, sects, "", 0);
 }
 
-PG_FUNCTION_INFO_V1(image_height);
-Datum	image_height(PG_FUNCTION_ARGS)
+/*
+ * Reads the digest of a deduplicated value, false
+ * if it's a self-contained one
+ */
+bool	pp_blob_digest(Datum d, char * digest)
 {
-	PPImage * img = PG_GETARG_IMAGE(0);
-	PG_RETURN_INT32(img->height);
+	PPImage * hdr = pp_header_from_datum(d, true);
+	uint32 len;
+
+	if(!PP_HAS(hdr, PPF_BLOB)) return false;
+	memcpy(digest, pp_section(hdr, PPF_DIGEST, &len), DIGESTLEN);
+	return true;
 }
 
-PG_FUNCTION_INFO_V1(image_date);
-Datum	image_date(PG_FUNCTION_ARGS)
+/*
+ * Returns len bytes of a stored image, starting at off,
+ * in the caller's memory context
+ */
+char *	pp_blob_fetch(const char * digest, uint32 off, uint32 len)
 {
-	PPImage * img = PG_GETARG_IMAGE(0);
-	if(TIMESTAMP_IS_NOBEGIN(img->date)) PG_RETURN_NULL();
-	PG_RETURN_TIMESTAMP(img->date);
+	Datum args[3];
+	bytea * data;
+	char * res = NULL;
+	bool isnull;
+	instr_time start;
+	bool timed = PP_STAT_START(start);
+
+	args[0] = PointerGetDatum(pp_make_bytea(digest, DIGESTLEN));
+	args[1] = Int32GetDatum(off + 1);
+	args[2] = Int32GetDatum(len);
+	if(SPI_connect() != SPI_OK_CONNECT) elog(ERROR, "SPI_connect failed");
+	if(pp_blob_exec(PP_BLOB_SLICE, args, true) == 1) {
+		data = DatumGetByteaP(SPI_getbinval(SPI_tuptable->vals[0],
+			SPI_tuptable->tupdesc, 1, &isnull));
+		if(!isnull && VARSIZE(data) - VARHDRSZ == len) {
+			res = SPI_palloc(len);
+			memcpy(res, VARDATA(data), len);
+		}
+	}
+	SPI_finish();
+	if(!res) {
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("image data missing from postpic_blobs")));
+	}
+	if(timed) pp_stat_op(PP_OP_BLOB_FETCH, &start, len, 0, 0);
+	return res;
 }
 
-PG_FUNCTION_INFO_V1(image_f_number);
-Datum	image_f_number(PG_FUNCTION_ARGS)
+/*
+ * Takes a reference to a stored image, storing it first if
+ * needed, which data (when not NULL) is for. Runs connected to SPI.
+ */
+void	pp_blob_ref(const char * digest, const char * data, uint32 len)
 {
-    PPImage * img = PG_GETARG_IMAGE(0);
-    if(img->f_number > 0) {
-    	PG_RETURN_FLOAT4(img->f_number);
+	Datum args[2];
+
+	args[0] = PointerGetDatum(pp_make_bytea(digest, DIGESTLEN));
+	if(!data) {
+		if(pp_blob_exec(PP_BLOB_REF, args, false) > 0) return;
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("image data missing from postpic_blobs")));
+	}
+	args[1] = PointerGetDatum(pp_make_bytea(data, len));
+	if(pp_blob_exec(PP_BLOB_REF_SAME, args, false) > 0) return;
+	/* a different image with the same digest (if any) stays there */
+	if(pp_blob_exec(PP_BLOB_ADD, args, false) == 0) {
+		ereport(ERROR,
+			(errcode(ERRCODE_UNIQUE_VIOLATION),
+			 errmsg("another image with the same digest is in postpic_blobs")));
 	}
-	PG_RETURN_NULL();
 }
 
-PG_FUNCTION_INFO_V1(image_exposure_time);
-Datum	image_exposure_time(PG_FUNCTION_ARGS)
+/*
+ * Drops a reference, leaving the image to postpic_gc.
+ * Runs connected to SPI.
+ */
+void	pp_blob_unref(const char * digest)
 {
-    PPImage * img = PG_GETARG_IMAGE(0);
-    if(img->exposure_t > 0) {
-        PG_RETURN_FLOAT4(img->exposure_t);
-    }
-    PG_RETURN_NULL();
+	Datum arg = PointerGetDatum(pp_make_bytea(digest, DIGESTLEN));
+
+	pp_blob_exec(PP_BLOB_UNREF, &arg, false);
 }
 
-PG_FUNCTION_INFO_V1(image_iso);
-Datum	image_iso(PG_FUNCTION_ARGS)
+/*
+ * Runs one of blob_queries, returning the number of rows
+ * processed. The table and functions are qualified with the
+ * extension's schema, or left to the search path without the
+ * extension.
+ */
+int		pp_blob_exec(int q, Datum * args, bool read_only)
 {
-    PPImage * img = PG_GETARG_IMAGE(0);
-    if(img->iso > 0) {
-        PG_RETURN_INT32(img->iso);
-    }
-    PG_RETURN_NULL();
+	PPBlobQuery * bq = &blob_queries[q];
+	char * query;
+	int ret;
+
+	if(!blob_schema) {
+		ret = SPI_execute("SELECT n.nspname FROM pg_catalog.pg_extension e, pg_catalog.pg_namespace n "
+			"WHERE e.extname = 'postpic' AND n.oid = e.extnamespace", true, 1);
+		blob_schema = MemoryContextStrdup(TopMemoryContext,
+			(ret == SPI_OK_SELECT && SPI_processed == 1)
+			? psprintf("%s.", quote_identifier(SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1)))
+			: "");
+	}
+	if(!bq->plan) {
+		query = palloc(strlen(bq->query) + strlen(blob_schema));
+		sprintf(query, bq->query, blob_schema);
+		bq->plan = SPI_prepare(query, bq->nargs, bq->argtypes);
+		if(!bq->plan) elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+		bq->plan = SPI_saveplan(bq->plan);
+	}
+	ret = SPI_execute_plan(bq->plan, args, NULL, read_only, 0);
+	if(ret < 0) elog(ERROR, "SPI_execute_plan failed: %s", SPI_result_code_string(ret));
+	return SPI_processed;
 }
 
+bytea *	pp_make_bytea(const char * data, uint32 len)
+{
+	bytea * res = (bytea *) palloc(len + VARHDRSZ);
+
+	SET_VARSIZE(res, len + VARHDRSZ);
+	memcpy(VARDATA(res), data, len);
+	return res;
+}
 
-PG_FUNCTION_INFO_V1(image_focal_length);
-Datum   image_focal_length(PG_FUNCTION_ARGS)
+/*
+ * Attribute number of an image column, by name
+ */
+int		pp_image_column(TupleDesc desc, const char * name)
 {
-	PPImage * img = PG_GETARG_IMAGE(0);
-	if(img->focal_l > 0) {
-        PG_RETURN_FLOAT4(img->focal_l);
-    }
-    PG_RETURN_NULL();
+	int attnum = SPI_fnumber(desc, name);
+	Oid input, ioparam;
+	FmgrInfo finfo;
+
+	if(attnum <= 0) {
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_COLUMN),
+			 errmsg("column \"%s\" does not exist", name)));
+	}
+	/* whatever schema it's in, it's ours if it reads through image_in */
+	getTypeInputInfo(getBaseType(SPI_gettypeid(desc, attnum)), &input, &ioparam);
+	fmgr_info(input, &finfo);
+	if(finfo.fn_addr != image_in) {
+		ereport(ERROR,
+			(errcode(ERRCODE_DATATYPE_MISMATCH),
+			 errmsg("column \"%s\" is not of type image", name)));
+	}
+	return attnum;
+}
+
+bool	pp_find_preview(const void * data, size_t len, PPPreview * pv)
+{
+	size_t off, tlen;
+	int w, h, ncomp;
+
+	if(pp_jpeg_exif_thumbnail(data, len, &off, &tlen)) return false;
+	if(pp_jpeg_dimensions((const unsigned char *) data + off, tlen, &w, &h, &ncomp)) return false;
+	if(w <= 0 || h <= 0) return false;
+	pv->off = off;
+	pv->len = tlen;
+	pv->width = w;
+	pv->height = h;
+	pv->ncomp = ncomp;
+	return true;
 }
 
-PG_FUNCTION_INFO_V1(image_colorspace);
-Datum	image_colorspace(PG_FUNCTION_ARGS)
+bool	pp_get_preview(Datum d, const PPImage * hdr, PPPreview * pv)
 {
-	PPImage * img = PG_GETARG_IMAGE(0);
-	return ObjectIdGetDatum(img->cspace);
+	PPImage * img;
+	uint32 len;
+	char * sect;
+
+	sect = pp_section(hdr, PPF_PREVIEW, &len);
+	if(sect) {
+		memcpy(pv, sect, sizeof(PPPreview));
+		return true;
+	}
+	/* JPEGs are scanned at ingest, only version 0 values are left to check */
+	if(hdr->format != PP_FMT_UNKNOWN) return false;
+	img = pp_image_from_datum(d);
+	return pp_find_preview(PP_DATA(img), PP_DATALEN(img), pv);
 }
 
-void * gm_image_to_blob(Image * timg, size_t * blen, ExceptionInfo * ex)
+/*
+ * Makes an image out of the preview bytes, without decoding them
+ */
+PPImage *	pp_init_preview(const PPImage * hdr, const void * data, const PPPreview * pv)
 {
-	ImageInfo *iinfo;
-	void * blob;
+	PPImage phdr;
+	PPSectionData sects[PP_MAX_SECTIONS];
+	char digest[DIGESTLEN];
 
-	iinfo = CloneImageInfo(NULL);
-	strcpy(iinfo->magick, "JPEG");
-	blob = ImageToBlob(iinfo, timg, blen, ex);
-	DestroyImageInfo(iinfo);
-	
-	return blob;
+	memset(&phdr, 0, sizeof(PPImage));
+	memset(sects, 0, sizeof(sects));
+	pp_copy_exif(&phdr, hdr);
+	phdr.width = pv->width;
+	phdr.height = pv->height;
+	phdr.format = PP_FMT_JPEG;
+	switch(pv->ncomp) {
+		case 1: phdr.cspace = CS_GRAY.oid; break;
+		case 4: phdr.cspace = CS_CMYK.oid; break;
+		default: phdr.cspace = CS_RGB.oid;
+	}
+	pp_md5(data, pv->len, digest);
+	sects[PPS_DIGEST].data = digest;
+	sects[PPS_DIGEST].len = DIGESTLEN;
+	return pp_assemble(&phdr, sects, data, pv->len);
 }
 
-Image *		gm_image_from_lob(Oid loid)
+/*
+ * The thumbnail() fast path: serve from the EXIF preview when it's
+ * at least as large as requested and has the same aspect ratio,
+ * slicing its bytes out without detoasting the whole image.
+ * Returns NULL when the preview can't be used.
+ */
+PPImage *	pp_thumbnail_from_preview(Datum d, int32 size)
 {
 	ExceptionInfo ex;
-	ImageInfo * iinfo;
-	Image * res;
-	int blen;
-	void * blob;
+	PPImage * hdr, * res;
+	PPPreview pv;
+	Image * gimg, * timg;
+	int32 sx, sy;
+	char * data;
 
-	if(!OidIsValid(loid)) return NULL;
+	hdr = pp_header_from_datum(d, true);
+	if(!pp_get_preview(d, hdr, &pv)) return NULL;
+	pp_thumbnail_size(hdr, size, &sx, &sy);
+	if(pv.width < sx || pv.height < sy) return NULL;
+	/* letterboxed previews won't do */
+	if(Abs((int64) pv.width * hdr->height - (int64) pv.height * hdr->width) * 50
+		> (int64) pv.height * hdr->width) return NULL;
+
+	data = pp_fetch_data(d, hdr, pv.off, pv.len);
+	if(pv.width == sx && pv.height == sy) return pp_init_preview(hdr, data, &pv);
+
+	gimg = gm_image_from_blob(data, pv.len);
 	GetExceptionInfo(&ex);
-	iinfo = CloneImageInfo(NULL);
-	blob = lo_readblob(loid, &blen);
-	res = BlobToImage(iinfo, blob, blen, &ex); 
-	DestroyImageInfo(iinfo);
+	timg = gm_result(ThumbnailImage(gimg, sx, sy, &ex), &ex);
+	res = pp_init_image(timg);
+	if(res) pp_copy_exif(res, hdr);
+	gm_image_destroy(gimg);
+	gm_image_destroy(timg);
 	DestroyExceptionInfo(&ex);
-
 	return res;
 }
 
-Image *		gm_image_from_bytea(bytea * imgdata)
+/*
+ * Size of the thumbnail of img fitting in size x size,
+ * checked as any output size is
+ */
+void	pp_thumbnail_size(const PPImage * img, int32 size, int32 * sx, int32 * sy)
+{
+	/* no aspect ratio to keep */
+	if(img->width <= 0 || img->height <= 0) pp_check_pixels(img->width, img->height);
+	if(img->width >= img->height) {
+		*sx = size;
+		*sy = Max((int64) img->height * size / img->width, 1);
+	} else {
+		*sy = size;
+		*sx = Max((int64) img->width * size / img->height, 1);
+	}
+	pp_check_pixels(*sx, *sy);
+}
+
+/*
+ * Returns a copy of img carrying up to levels renditions of gimg,
+ * each half the size of the previous one
+ */
+PPImage *	pp_build_pyramid(PPImage * img, Image * gimg, int levels)
 {
 	ExceptionInfo ex;
-	ImageInfo * iinfo;
-	Image * res;
+	StringInfoData sect;
+	PPPyramid * pyr;
+	Image * prev, * limg;
+	const char * magick;
+	void * blob;
+	size_t blen;
+	int32 w, h;
+	int n = 0;
+
+	levels = Min(levels, PP_MAX_LEVELS);
+	/* keep transparency, if the original can have it */
+	magick = img->format == PP_FMT_JPEG ? "JPEG" : "PNG";
+	initStringInfo(&sect);
+	enlargeStringInfo(&sect, offsetof(PPPyramid, levels) + levels * sizeof(PPLevel));
+	sect.len = offsetof(PPPyramid, levels) + levels * sizeof(PPLevel);
 
-	if(!imgdata) return NULL;
 	GetExceptionInfo(&ex);
-	iinfo = CloneImageInfo(NULL);
-	res = BlobToImage(iinfo, VARDATA(imgdata), VARSIZE(imgdata) - VARHDRSZ, &ex);
-	if(!res) {
-        ereport(ERROR,
-        	(errcode(ERRCODE_UNDEFINED_OBJECT),
-			 errmsg("error reading image data: %s", ex.reason)));
+	prev = gimg;
+	w = img->width;
+	h = img->height;
+	while(n < levels && w / 2 >= PP_LEVEL_MIN && h / 2 >= PP_LEVEL_MIN) {
+		w /= 2;
+		h /= 2;
+		limg = gm_track(gm_resize(prev, w, h, FILTER_DEFAULT, &ex), PP_RES_IMAGE);
+		if(prev != gimg) gm_image_destroy(prev);
+		prev = limg;
+		if(!limg) break;
+		blob = gm_image_to_blob_fmt(limg, magick, &blen, &ex);
+		pyr = (PPPyramid *) sect.data;
+		pyr->levels[n].width = w;
+		pyr->levels[n].height = h;
+		pyr->levels[n].off = sect.len;
+		pyr->levels[n].len = blen;
+		appendBinaryStringInfo(&sect, blob, blen);
+		gm_destroy(blob, PP_RES_BLOB);
+		++n;
 	}
-	DestroyImageInfo(iinfo);
+	if(prev != gimg) gm_image_destroy(prev);
 	DestroyExceptionInfo(&ex);
 
-	return res;
+	pyr = (PPPyramid *) sect.data;
+	pyr->nlevels = n;
+	if(!n) return pp_set_section(img, PPS_PYRAMID, NULL, 0);
+	return pp_set_section(img, PPS_PYRAMID, sect.data, sect.len);
 }
 
-void	gm_image_destroy(Image * gimg)
+const PPFilter *	pp_parse_filter(const char * name)
 {
-	if(gimg) DestroyImage(gimg);
+	int i = 0;
+
+	while(filters[i].name && pg_strcasecmp(name, filters[i].name)) ++i;
+	if(!filters[i].name) {
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unknown resampling filter \"%s\"", name)));
+	}
+	return &filters[i];
 }
 
-char *	gm_image_getattr(Image * img, const char * attr)
+/*
+ * Resizes with our own resampler when it can (8 bit RGB(A),
+ * not enlarging, a filter it knows), else with ResizeImage.
+ * Like GM's, returns an untracked image or NULL with ex set.
+ */
+Image *	gm_resize(Image * gimg, int32 w, int32 h, const PPFilter * f, ExceptionInfo * ex)
 {
-	const ImageAttribute * attrs = GetImageAttribute(img, attr);
-	if(!attrs) return NULL;
-	return pstrdup(attrs->value);
+	Image * res;
+
+	if(f->kernel >= 0 && gimg->depth <= 8 && gimg->colorspace != CMYKColorspace
+		&& (unsigned long) w <= gimg->columns && (unsigned long) h <= gimg->rows) {
+		res = gm_resample_rgba8(gimg, w, h, f->kernel, ex);
+		if(res) return res;
+	}
+	return ResizeImage(gimg, w, h, f->gm, 1, ex);
 }
 
-PixelPacket *   gm_ppacket_from_color(const PPColor * color)
+/*
+ * Moves the pixels to a plain RGBA buffer and back around
+ * pp_resample_rgba8. NULL when it couldn't: the caller then
+ * falls back to GM.
+ */
+Image *	gm_resample_rgba8(Image * gimg, int32 w, int32 h, int kernel, ExceptionInfo * ex)
 {
-	PixelPacket * pp = (PixelPacket *)palloc(sizeof(PixelPacket));
-	unsigned int data = ntohl(color->cd);
-	
-	if ((color->cs == CS_RGB.oid) || (color->cs == CS_sRGB.oid)) data = (data << 8);
-	pp->red = (data >> 24) & 0xFF;
-	pp->green = (data >> 16 ) & 0xFF;
-	pp->blue = (data >> 8 ) & 0xFF;
-	pp->opacity = data & 0xFF;
-	return pp;
+	PixelPacket * dp;
+	unsigned char * src, * dst = NULL, * p;
+	Image * res = NULL;
+	unsigned long x, y;
+
+	if((Size) gimg->columns * gimg->rows * 4 > MaxAllocSize) return NULL;
+	if((Size) w * h * 4 > MaxAllocSize) return NULL;
+	src = palloc((Size) gimg->columns * gimg->rows * 4);
+	if(!gm_export_rgba8(gimg, src, ex)) goto done;
+	dst = palloc((Size) w * h * 4);
+	if(pp_resample_rgba8(src, gimg->columns, gimg->rows, dst, w, h, kernel)) goto done;
+
+	/* a clone keeps attributes and profiles */
+	res = CloneImage(gimg, w, h, MagickTrue, ex);
+	if(!res) goto done;
+	/* and the colormap of palette images, which the pixels no longer index */
+	res->storage_class = DirectClass;
+	for(y = 0, p = dst; y < (unsigned long) h; ++y) {
+		dp = SetImagePixels(res, 0, y, w, 1);
+		if(!dp) break;
+		for(x = 0; x < (unsigned long) w; ++x, ++dp, p += 4) {
+			dp->red = ScaleCharToQuantum(p[0]);
+			dp->green = ScaleCharToQuantum(p[1]);
+			dp->blue = ScaleCharToQuantum(p[2]);
+			dp->opacity = MaxRGB - ScaleCharToQuantum(p[3]);
+		}
+		if(!SyncImagePixels(res)) break;
+	}
+	if(y < (unsigned long) h) {
+		DestroyImage(res);
+		res = NULL;
+	}
+done:
+	if(dst) pfree(dst);
+	pfree(src);
+	return res;
 }
 
-int		pp_substr2int(char * str, int off, int len)
+/*
+ * Copies the pixels to buf, 4 bytes each (R, G, B, alpha)
+ */
+bool	gm_export_rgba8(Image * gimg, unsigned char * buf, ExceptionInfo * ex)
 {
-	str[off+len] = 0;
-	return atoi(str+off);
+	const PixelPacket * sp;
+	unsigned long x, y;
+
+	for(y = 0; y < gimg->rows; ++y) {
+		sp = AcquireImagePixels(gimg, 0, y, gimg->columns, 1, ex);
+		if(!sp) return false;
+		for(x = 0; x < gimg->columns; ++x, ++sp, buf += 4) {
+			buf[0] = ScaleQuantumToChar(sp->red);
+			buf[1] = ScaleQuantumToChar(sp->green);
+			buf[2] = ScaleQuantumToChar(sp->blue);
+			buf[3] = ScaleQuantumToChar(MaxRGB - sp->opacity);
+		}
+	}
+	return true;
 }
 
-Timestamp	pp_str2timestamp(const char * edate)
+/*
+ * The pixels of a reduced copy (at most PP_ANALYSIS_SIZE on the longer
+ * side) of the image, in RGB, for statistics on its content
+ */
+unsigned char *	gm_analysis_pixels(Datum d, size_t * npixels)
 {
-	struct pg_tm tm;
-	Timestamp res;
-	char * date;
-	
-	if(!edate || strlen(edate)<19) {
-    	//elog(WARNING, "could not parse date %s", edate);
-	    TIMESTAMP_NOBEGIN(res);
-	    return res;
+	PPImage * hdr = pp_header_from_datum(d, true);
+	int32 w = hdr->width, h = hdr->height;
+
+	if(w > PP_ANALYSIS_SIZE || h > PP_ANALYSIS_SIZE) {
+		if(w >= h) {
+			h = Max(h * PP_ANALYSIS_SIZE / w, 1);
+			w = PP_ANALYSIS_SIZE;
+		} else {
+			w = Max(w * PP_ANALYSIS_SIZE / h, 1);
+			h = PP_ANALYSIS_SIZE;
+		}
 	}
-	date = pstrdup(edate);
-	tm.tm_year = pp_substr2int(date, 0, 4);
-	tm.tm_mon =  pp_substr2int(date, 5, 2);
-	tm.tm_mday = pp_substr2int(date, 8, 2);
-	tm.tm_hour = pp_substr2int(date, 11, 2);
-	tm.tm_min = pp_substr2int(date, 14, 2);
-	tm.tm_sec = pp_substr2int(date, 17, 2);
-	tm2timestamp(&tm, 0, NULL, &res);
-	return res;
+	*npixels = (size_t) w * h;
+	return gm_pixels_at_size(d, hdr, w, h, pp_parse_filter("box"));
 }
 
 /*
-char*	pp_timestamp2str(Timestamp ts)
+ * The pixels of the image resized to exactly w x h, as 8 bit RGBA.
+ * hdr must come from pp_header_from_datum(d, true).
+ */
+unsigned char *	gm_pixels_at_size(Datum d, const PPImage * hdr, int32 w, int32 h, const PPFilter * f)
 {
-	/--* postgres tax *--/
-	int tzp;
-	fsec_t fsec;
-	char *tzn;
-	/--* end tax *--/
-	struct pg_tm tm;
-	char * res; 
-	
-	if(TIMESTAMP_IS_NOBEGIN(ts)) {
-		return pstrdup("");
+	ExceptionInfo ex;
+	Image * gimg, * timg;
+	unsigned char * px;
+
+	pp_check_pixels(w, h);
+	gimg = gm_image_at_size(d, hdr, w, h);
+	GetExceptionInfo(&ex);
+	if(gimg->colorspace == CMYKColorspace) TransformColorspace(gimg, RGBColorspace);
+	if(gimg->columns != (unsigned long) w || gimg->rows != (unsigned long) h) {
+		timg = gm_result(gm_resize(gimg, w, h, f, &ex), &ex);
+		gm_image_destroy(gimg);
+		gimg = timg;
 	}
-	res = palloc(DATELEN);
-	timestamp2tm(ts, &tzp, &tm, &fsec , &tzn, NULL);
-	sprintf(res, "%d-%.2d-%.2d %.2d:%.2d:%.2d", tm.tm_year, tm.tm_mon, tm.tm_mday,
-		tm.tm_hour, tm.tm_min, tm.tm_sec);
-	return res;
+	px = palloc((Size) w * h * 4);
+	if(!gm_export_rgba8(gimg, px, &ex)) gm_raise(&ex, "error reading pixels");
+	gm_image_destroy(gimg);
+	DestroyExceptionInfo(&ex);
+	return px;
 }
-*/
-char * 	pp_varchar2str(VarChar * text)
-{
-	char * str;
-	int sz;
 
-    sz = VARSIZE(text) - VARHDRSZ;
-    str = palloc(sz + 1);
-    strncpy(str, VARDATA(text), sz);
-    str[sz]=0;
+/*
+ * Decodes the smallest rendition of the image which is at least
+ * w x h: a pyramid level if there's one, else the original,
+ * scaled down while decoding when possible. The pixel limit
+ * applies to what actually gets decoded, not to the original.
+ * hdr must come from pp_header_from_datum(d, true).
+ */
+Image *	gm_image_at_size(Datum d, const PPImage * hdr, int32 w, int32 h)
+{
+	PPPyramid * pyr;
+	PPLevel * best = NULL;
+	char * sect;
+	uint32 len;
+	int i, n;
 
-	return str;
+	/* already holding the whole value */
+	if(VARSIZE(hdr) > hdr->dataoff) return gm_image_from_image_hint((PPImage *) hdr, w, h);
+	sect = pp_section(hdr, PPF_PYRAMID, &len);
+	if(sect) {
+		pyr = (PPPyramid *) pp_fetch_section(d, hdr, sect, offsetof(PPPyramid, levels));
+		n = pyr->nlevels;
+		pyr = (PPPyramid *) pp_fetch_section(d, hdr, sect,
+			offsetof(PPPyramid, levels) + n * sizeof(PPLevel));
+		for(i = 0; i < n && pyr->levels[i].width >= w && pyr->levels[i].height >= h; ++i) {
+			best = &pyr->levels[i];
+		}
+		if(best) {
+			pp_check_pixels(best->width, best->height);
+			return gm_image_from_blob(pp_fetch_section(d, hdr, sect + best->off, best->len), best->len);
+		}
+	}
+	return gm_image_from_image_hint(pp_image_from_datum(d), w, h);
 }
 
-float4	pp_parse_float(const char * str)
+/*
+ * Collects every attribute GM knows about (the full EXIF block, 
+ * comments, ...) plus the raw XMP packet and the IPTC datasets,
+ * as "key\0value\0" pairs
+ */
+void	pp_collect_metadata(Image * gimg, StringInfo meta)
 {
-    float s=-1,g=1;
-    if(!str || !str[0]) return -1;
-    if(index(str, '/')==NULL) return strtod(str,NULL);
-    sscanf(str, "%f/%f", &s, &g);
-    return s/g;
+	const ImageAttribute * attr;
+	const unsigned char * profile;
+	size_t plen;
+
+	/* GM expands the whole EXIF profile into a "Tag=value\n" list */
+	attr = GetImageAttribute(gimg, ATTR_EXIF_ALL);
+	if(attr && attr->value) pp_parse_exif_list(attr->value, meta);
+	for(attr = GetImageAttribute(gimg, NULL); attr; attr = attr->next) {
+		if(!attr->key || !attr->value || !strncmp(attr->key, "EXIF:", 5)) continue;
+		pp_meta_append(meta, attr->key, attr->value, strlen(attr->value));
+	}
+	profile = GetImageProfile(gimg, "XMP", &plen);
+	if(profile && plen)
+		pp_meta_append(meta, ATTR_XMP, (const char *) profile, strnlen((const char *) profile, plen));
+	profile = GetImageProfile(gimg, "IPTC", &plen);
+	if(profile && plen) pp_parse_iptc(profile, plen, meta);
 }
 
-int		pp_parse_int(char * str)
+void	pp_parse_exif_list(const char * list, StringInfo meta)
 {
-	if(!str || !isdigit(str[0])) return -1;
-	return pg_atoi(str, 4, 0);
+	char key[VERLEN];
+	const char * eq, * eol;
+
+	while(*list) {
+		eol = strchr(list, '\n');
+		if(!eol) eol = list + strlen(list);
+		eq = memchr(list, '=', eol - list);
+		if(eq && eq - list < VERLEN - 6) {
+			snprintf(key, VERLEN, "EXIF:%.*s", (int) (eq - list), list);
+			pp_meta_append(meta, key, eq + 1, eol - eq - 1);
+		}
+		list = *eol ? eol + 1 : eol;
+	}
 }
 
-Oid		pp_parse_cstype(const ColorspaceType t)
+void	pp_meta_append(StringInfo meta, const char * key, const char * value, int len)
 {
-	switch (t) {
-		case RGBColorspace: return CS_RGB.oid;
-		case TransparentColorspace: return CS_RGBA.oid;
-		case GRAYColorspace: return CS_GRAY.oid;
-		case sRGBColorspace: return CS_sRGB.oid;
-		case CMYKColorspace: return CS_CMYK.oid;	
-		default: return CS_UNKNOWN.oid;
-	}
+	/* values must be usable as text in the database encoding */
+	if(!pg_verifymbstr(value, len, true)) return;
+	appendBinaryStringInfo(meta, key, strlen(key) + 1);
+	appendBinaryStringInfo(meta, value, len);
+	appendStringInfoChar(meta, '\0');
 }
 
-void	pp_parse_color(const char * str, PPColor * color)
+/*
+ * IPTC-IIM is a plain list of 0x1C, record, dataset, length(2), data.
+ * Repeated datasets (e.g. keywords) are joined with ';'
+ */
+void	pp_parse_iptc(const unsigned char * profile, size_t plen, StringInfo meta)
 {
-	char cs[COLORLEN], cd[COLORLEN];
-	int i = 0;
-	
-	while(str[i] && str[i]!='#') ++i;
-	if(!str[i]) {
-		color->cs = InvalidOid;
-		return;
-	}
-	strncpy(cs, str, i); cs[i]=0;
-	strcpy(cd, str + i + 1);
-	
-	color->cd = htonl(strtoll(cd, NULL, 16));
-	if(!cs[0]) {
-		color->cs = (strlen(cd)>6 ? CS_RGBA.oid : CS_RGB.oid);
-	} else {
-		i = 1;
-		while(colorspaces[i].name && strcmp(cs, colorspaces[i].name)) ++i;
-		if(!(colorspaces[i].name)) i=0;
-		color->cs = colorspaces[i].oid;
+	char key[INTLEN];
+	int last = -1, tag, len;
+	size_t i = 0;
+
+	while(i + 5 <= plen) {
+		if(profile[i] != IPTC_MARKER) { ++i; continue; }
+		tag = (profile[i+1] << 8) | profile[i+2];
+		len = (profile[i+3] << 8) | profile[i+4];
+		i += 5;
+		/* extended datasets are not worth the trouble */
+		if(len & 0x8000 || i + len > plen) break;
+		if(!pg_verifymbstr((const char *) profile + i, len, true)) {
+			i += len;
+			continue;
+		}
+		if(tag == last) {
+			/* drop the terminator of the previous value and chain */
+			meta->data[--meta->len] = 0;
+			appendStringInfoChar(meta, ';');
+			appendBinaryStringInfo(meta, (const char *) profile + i, len);
+			appendStringInfoChar(meta, '\0');
+		} else {
+			sprintf(key, "IPTC:%d:%d", tag >> 8, tag & 0xFF);
+			pp_meta_append(meta, key, (const char *) profile + i, len);
+		}
+		last = tag;
+		i += len;
 	}
 }
 
-PPImage *	pp_init_image(Image * gimg) 
+const char *	pp_meta_lookup(const char * meta, int len, const char * key)
 {
-	return pp_init_image_full(gimg, NULL, 0);
+	const char * end = meta + len;
+
+	while(meta < end) {
+		if(!strcmp(meta, key)) return meta + strlen(meta) + 1;
+		meta += strlen(meta) + 1;
+		meta += strlen(meta) + 1;
+	}
+	return NULL;
 }
 
-PPImage *	pp_init_image_full(Image * gimg, void * data, size_t datalen)
+/*
+ * Returns the metadata section of an image value. Images stored
+ * without one have their attributes read on the fly
+ */
+char *	pp_get_metadata(Datum d, int * len)
 {
-	char * attr;
-	void * blob;
-	size_t blen;
-	ExceptionInfo ex;
+	StringInfoData meta;
 	PPImage * img;
+	Image * gimg;
+	char * sect;
+	uint32 slen;
 
-	if(!gimg) return NULL;
-
-	//Get gimg's blob
-	GetExceptionInfo(&ex);
-	if(!data) {
-		blob =gm_image_to_blob(gimg, &blen, &ex);
-	} else {
-		blob = data;
-		blen = datalen;
+	img = pp_header_from_datum(d, true);
+	sect = pp_section(img, PPF_METADATA, &slen);
+	if(sect) {
+		*len = slen;
+		return sect;
 	}
-	
-	// We need room for our fixed data + our header + the bytea (data + header):
-	img = (PPImage *) palloc(FIXED_DATA_LEN + blen + 2*VARHDRSZ);
-	// Init imgdata with blob
-	SET_VARSIZE(&img->imgdata, blen + VARHDRSZ);
-	memcpy(VARDATA(&img->imgdata), blob, blen);
-	SET_VARSIZE(img, FIXED_DATA_LEN + blen + 2*VARHDRSZ );
-	if(!data) free(blob);
-
-	//Data we have in Image
-	img->width = gimg->columns;
-	img->height = gimg->rows;
-	img->cspace = pp_parse_cstype(gimg->colorspace);
-	
-	//Data read from attributes
-	attr = gm_image_getattr(gimg, ATTR_TIME);
-	img->date = pp_str2timestamp(attr);
-    attr = gm_image_getattr(gimg, ATTR_FNUM);
-   	img->f_number = pp_parse_float(attr);
-	attr = gm_image_getattr(gimg, ATTR_EXPT);
-   	img->exposure_t = pp_parse_float(attr);
-   	attr = gm_image_getattr(gimg, ATTR_ISO);
-   	img->iso = pp_parse_int(attr);
-   	attr = gm_image_getattr(gimg, ATTR_FLEN);
-   	img->focal_l = pp_parse_float(attr);
-		
-	return img;
+	initStringInfo(&meta);
+	gimg = gm_image_from_image(pp_image_from_datum(d));
+	pp_collect_metadata(gimg, &meta);
+	gm_image_destroy(gimg);
+	*len = meta.len;
+	return meta.data;
 }
 
 int	lo_size(int32 fd)
@@ -1009,32 +5050,138 @@ void *  lo_readblob(Oid loid, int * blen)
 // let's make compiler happy
 void _PG_init(void);
 
+/*
+ * GraphicsMagick loads its coders and reads its configuration
+ * files lazily, in the first query needing them: do it now, so
+ * that preloaded, backends inherit it all from the postmaster.
+ * That's all it does there, on a single thread: an OpenMP thread
+ * pool wouldn't survive fork(), backends start their own.
+ */
+void	gm_preload(void)
+{
+	ExceptionInfo ex;
+
+	SetMagickResourceLimit(ThreadsResource, 1);
+	GetExceptionInfo(&ex);
+	(void) GetMagickInfo("*", &ex);
+	(void) GetDelegateInfo("*", "*", &ex);
+	(void) GetTypeInfo("*", &ex);
+	(void) GetColorInfo("*", &ex);
+	DestroyExceptionInfo(&ex);
+}
+
 /* 
  * This function is called when the PostPic extension is loaded
- * into the server.
- * We use this to get colorspace enum's oids from SysCache and
- * save them for later use
+ * into the server: once in the postmaster when preloaded, in each
+ * backend using it otherwise. Catalog lookups are left to the
+ * first query, see pp_colorspaces.
  */
 void _PG_init()
 {
-	Oid csOid, pOid;
-	int i;
+	char path[MAXPGPATH];
 	char * tde;
 	
-	//TODO: init 1 time only! and get the client path somehow
-	InitializeMagick("/usr/lib/postgresql/9.1/lib/postpic.so");
-	/* Read colorspace Oids */
-	pOid = GetSysCacheOid(NAMESPACENAME,
-		CStringGetDatum("public"), 0, 0, 0);
-	csOid = GetSysCacheOid(TYPENAMENSP,
-		CStringGetDatum("colorspace"), 
-		pOid, 0, 0);
-	colorspace_oid = csOid;
-	for(i = 0; colorspaces[i].name!=NULL; ++i) {
-		colorspaces[i].oid = GetSysCacheOid(ENUMTYPOIDNAME, csOid,
-			CStringGetDatum(colorspaces[i].name), 0, 0);
+	/* GraphicsMagick only needs the directory */
+	snprintf(path, MAXPGPATH, "%s/postpic", pkglib_path);
+	InitializeMagick(path);
+
+	CacheRegisterSyscacheCallback(TYPEOID, pp_colorspaces_invalidate, (Datum) 0);
+	RegisterResourceReleaseCallback(gm_release_resources, NULL);
+
+	/* statistics need shared memory, which only preloading gets */
+	if(process_shared_preload_libraries_in_progress) {
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = pp_shmem_request;
+#else
+		RequestAddinShmemSpace(pp_stats_size());
+#endif
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = pp_shmem_startup;
+		prev_needs_fmgr_hook = needs_fmgr_hook;
+		needs_fmgr_hook = pp_needs_fmgr_hook;
+		prev_fmgr_hook = fmgr_hook;
+		fmgr_hook = pp_fmgr_hook;
 	}
-	
+
+	gm_default_pixels = GetMagickResourceLimit(PixelsResource);
+	gm_default_memory = GetMagickResourceLimit(MemoryResource);
+	gm_default_map = GetMagickResourceLimit(MapResource);
+	gm_default_disk = GetMagickResourceLimit(DiskResource);
+	gm_default_threads = GetMagickResourceLimit(ThreadsResource);
+	/* before postpic.threads is applied, once the defaults are known */
+	if(process_shared_preload_libraries_in_progress) gm_preload();
+
+	DefineCustomIntVariable("postpic.max_pixels",
+		"Largest image, in pixels, an operation may decode or create.",
+		"0 leaves GraphicsMagick's own limit in place.",
+		&max_pixels, 0, 0, INT_MAX, PGC_SUSET, 0,
+		NULL, assign_max_pixels, NULL);
+
+	DefineCustomIntVariable("postpic.max_memory",
+		"Memory GraphicsMagick may use for pixel caches, per backend.",
+		"Beyond it, pixel caches go to disk. 0 leaves GraphicsMagick's own limit in place.",
+		&max_memory, 0, 0, INT_MAX, PGC_SUSET, GUC_UNIT_KB,
+		NULL, assign_max_memory, NULL);
+
+	DefineCustomIntVariable("postpic.max_disk",
+		"Disk space GraphicsMagick may use for pixel caches, per backend.",
+		"Operations needing more fail. 0 leaves GraphicsMagick's own limit in place.",
+		&max_disk, 0, 0, INT_MAX, PGC_SUSET, GUC_UNIT_KB,
+		NULL, assign_max_disk, NULL);
+
+	/*
+	 * Backends are many already: unless told otherwise, don't let
+	 * each of them start a thread per core
+	 */
+	DefineCustomIntVariable("postpic.threads",
+		"Threads GraphicsMagick may use within a single operation.",
+		"0 lets GraphicsMagick use one per core.",
+		&max_threads, 1, 0, 1024, PGC_USERSET, 0,
+		NULL, assign_max_threads, NULL);
+
+	DefineCustomBoolVariable("postpic.send_header",
+		"Sends images in binary mode along with their header.",
+		"Receiving them doesn't need decoding then, but clients "
+		"get a PostPic specific format rather than the plain image.",
+		&send_header, false, PGC_USERSET, 0,
+		NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("postpic.track_stats",
+		"Collects pg_stat_postpic statistics.",
+		"Needs postpic in shared_preload_libraries. Turning it off stops "
+		"collecting at once, and functions looked up afterwards run unhooked.",
+		&track_stats, true, PGC_SUSET, 0,
+		NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("postpic.output_format",
+		"Text format of image values: hex or base64.",
+		"hex is what bytea uses, base64 is shorter but needs a client "
+		"that knows it.",
+		&output_format, PP_OUTPUT_HEX, output_formats, PGC_USERSET, 0,
+		NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("postpic.optimize",
+		"Losslessly shrinks JPEG and PNG images as they're stored.",
+		"on optimizes their encoding as optimize() does, strip also drops "
+		"their metadata but for color profiles; metadata() still returns it.",
+		&optimize_mode, PP_OPTIMIZE_OFF, optimize_modes, PGC_USERSET, 0,
+		NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("postpic.thumbnail_from_preview",
+		"Lets thumbnail() start from the preview embedded in EXIF data.",
+		"The preview is used when it's at least as large as the "
+		"requested thumbnail and has the same aspect ratio.",
+		&thumbnail_from_preview, false, PGC_USERSET, 0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable("postpic.pyramid_levels",
+		"Number of downscaled renditions stored along with new images.",
+		"Each level is half the size of the previous one; thumbnail(), "
+		"square() and resize() start from the smallest level that's large enough.",
+		&pyramid_levels, 0, 0, PP_MAX_LEVELS, PGC_USERSET, 0,
+		NULL, NULL, NULL);
+
 	/* Initialize tempdir from TMPDIR, if available */
 	tde = getenv("TMPDIR");
 	if(tde) tmpdir = tde;
@@ -0,0 +1,215 @@
+/*********************************************************************
+ PostPic - An image-enabling extension for PostgreSql
+ (C) Copyright 2010 Domenico Rotiroti
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, version 3 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ A copy of the GNU Lesser General Public License is included in the
+ source distribution of this software.
+
+*********************************************************************/
+
+/*
+ * Hex and base64 codecs for the text form of images
+ */
+#include "pp_kernels.h"
+
+#if defined(__SSE2__)
+#define PP_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static const char b64digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int	hexval(unsigned char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	c |= 0x20;
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+static int	is_space(unsigned char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+#ifdef PP_HAVE_SSE2
+/* 16 bytes to 32 digits */
+static size_t	hex_encode_sse2(const unsigned char * src, size_t len, char * dst)
+{
+	const __m128i nib = _mm_set1_epi8(0x0F), nine = _mm_set1_epi8(9);
+	const __m128i zero = _mm_set1_epi8('0'), gap = _mm_set1_epi8('a' - '0' - 10);
+	__m128i v, hi, lo;
+	size_t i;
+
+	for(i = 0; i + 16 <= len; i += 16, dst += 32) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+		hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+		lo = _mm_and_si128(v, nib);
+		hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+		_mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *) (dst + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+	return i;
+}
+
+/*
+ * Digit values of 16 characters, 0xFF where they aren't digits:
+ * a subtraction and an unsigned range check for each kind
+ */
+static __m128i	hex_values_sse2(__m128i c, int * valid)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i d, a, isd, isa;
+
+	d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	isd = _mm_cmpeq_epi8(_mm_subs_epu8(d, _mm_set1_epi8(9)), zero);
+	a = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	isa = _mm_cmpeq_epi8(_mm_subs_epu8(a, _mm_set1_epi8(5)), zero);
+	*valid = _mm_movemask_epi8(_mm_or_si128(isd, isa)) == 0xFFFF;
+	return _mm_or_si128(_mm_and_si128(isd, d),
+		_mm_and_si128(isa, _mm_add_epi8(a, _mm_set1_epi8(10))));
+}
+
+/* 32 digits to 16 bytes, stopping at anything else */
+static size_t	hex_decode_sse2(const char * src, size_t len, unsigned char * dst, size_t * out)
+{
+	const __m128i low = _mm_set1_epi16(0x00FF);
+	__m128i v0, v1;
+	int ok0, ok1;
+	size_t i;
+
+	for(i = 0; i + 32 <= len; i += 32, dst += 16, *out += 16) {
+		v0 = hex_values_sse2(_mm_loadu_si128((const __m128i *) (src + i)), &ok0);
+		v1 = hex_values_sse2(_mm_loadu_si128((const __m128i *) (src + i + 16)), &ok1);
+		if(!ok0 || !ok1) break;
+		/* each 16 bit lane holds the high digit, then the low one */
+		v0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v0, low), 4), _mm_srli_epi16(v0, 8));
+		v1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v1, low), 4), _mm_srli_epi16(v1, 8));
+		_mm_storeu_si128((__m128i *) dst, _mm_packus_epi16(v0, v1));
+	}
+	return i;
+}
+#endif
+
+/*
+ * Writes 2 * len digits to dst, no terminator
+ */
+void	pp_hex_encode(const unsigned char * src, size_t len, char * dst)
+{
+	size_t i = 0;
+
+#ifdef PP_HAVE_SSE2
+	i = hex_encode_sse2(src, len, dst);
+	dst += 2 * i;
+#endif
+	for(; i < len; ++i) {
+		*dst++ = hexdigits[src[i] >> 4];
+		*dst++ = hexdigits[src[i] & 0x0F];
+	}
+}
+
+/*
+ * Decodes pairs of digits, possibly separated by whitespace as
+ * byteain allows. Returns the number of bytes written to dst (which
+ * needs len / 2), or -1 with *bad pointing at the offending char.
+ */
+long	pp_hex_decode(const char * src, size_t len, unsigned char * dst, const char ** bad)
+{
+	size_t i = 0, out = 0;
+	int hi, lo;
+
+	while(i < len) {
+#ifdef PP_HAVE_SSE2
+		i += hex_decode_sse2(src + i, len - i, dst + out, &out);
+		if(i >= len) break;
+#endif
+		if(is_space(src[i])) {
+			++i;
+			continue;
+		}
+		hi = hexval(src[i]);
+		lo = i + 1 < len ? hexval(src[i + 1]) : -1;
+		if(hi < 0 || lo < 0) {
+			*bad = src + (hi < 0 ? i : i + 1);
+			return -1;
+		}
+		dst[out++] = (hi << 4) | lo;
+		i += 2;
+	}
+	return out;
+}
+
+/*
+ * Writes 4 * ((len + 2) / 3) characters to dst, no terminator
+ */
+void	pp_base64_encode(const unsigned char * src, size_t len, char * dst)
+{
+	unsigned int v;
+	size_t i;
+
+	for(i = 0; i + 3 <= len; i += 3) {
+		v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+		*dst++ = b64digits[v >> 18];
+		*dst++ = b64digits[(v >> 12) & 0x3F];
+		*dst++ = b64digits[(v >> 6) & 0x3F];
+		*dst++ = b64digits[v & 0x3F];
+	}
+	if(i < len) {
+		v = src[i] << 16;
+		if(i + 1 < len) v |= src[i + 1] << 8;
+		*dst++ = b64digits[v >> 18];
+		*dst++ = b64digits[(v >> 12) & 0x3F];
+		*dst++ = i + 1 < len ? b64digits[(v >> 6) & 0x3F] : '=';
+		*dst++ = '=';
+	}
+}
+
+/*
+ * Decodes base64, skipping whitespace. Returns the number of bytes
+ * written to dst (which needs 3 * (len / 4) + 3), or -1 on bad input.
+ */
+long	pp_base64_decode(const char * src, size_t len, unsigned char * dst)
+{
+	static signed char values[256];
+	unsigned int v = 0;
+	size_t i, out = 0;
+	int n = 0, pad = 0, c;
+
+	if(!values['B']) {
+		for(i = 0; i < 256; ++i) values[i] = -1;
+		for(i = 0; i < 64; ++i) values[(unsigned char) b64digits[i]] = i;
+	}
+	for(i = 0; i < len; ++i) {
+		c = (unsigned char) src[i];
+		if(is_space(c)) continue;
+		if(c == '=') {
+			++pad;
+			v <<= 6;
+		} else {
+			if(pad || values[c] < 0) return -1;
+			v = (v << 6) | values[c];
+		}
+		if(++n == 4) {
+			dst[out++] = v >> 16;
+			if(pad < 2) dst[out++] = (v >> 8) & 0xFF;
+			if(pad < 1) dst[out++] = v & 0xFF;
+			if(pad > 2) return -1;
+			v = 0;
+			n = 0;
+		}
+	}
+	return n ? -1 : (long) out;
+}
@@ -0,0 +1,213 @@
+/*********************************************************************
+ PostPic - An image-enabling extension for PostgreSql
+ (C) Copyright 2010 Domenico Rotiroti
+ 
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, version 3 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ A copy of the GNU Lesser General Public License is included in the
+ source distribution of this software.
+
+*********************************************************************/
+
+/*
+ * JPEG stream inspection, without decoding
+ */
+#include "pp_kernels.h"
+
+#include <string.h>
+
+#define M_SOI	0xD8
+#define M_EOI	0xD9
+#define M_SOS	0xDA
+#define M_APP1	0xE1
+#define TAG_ORIENTATION	0x0112
+#define TAG_JPEGIF		0x0201
+#define TAG_JPEGIF_LEN	0x0202
+
+static unsigned int	be16(const unsigned char * p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned int	rd16(const unsigned char * p, int le)
+{
+	return le ? (unsigned int) ((p[1] << 8) | p[0]) : be16(p);
+}
+
+static unsigned int	rd32(const unsigned char * p, int le)
+{
+	if(le) return ((unsigned) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+	return ((unsigned) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Walks the markers up to the start of scan, calling back
+ * for each segment. Stops early when cb returns nonzero.
+ */
+static int	jpeg_walk(const unsigned char * buf, size_t len,
+	int (*cb)(int marker, const unsigned char * seg, size_t slen, void * arg), void * arg)
+{
+	size_t i = 2, slen;
+	int marker, res;
+
+	if(len < 4 || buf[0] != 0xFF || buf[1] != M_SOI) return -1;
+	while(i + 4 <= len) {
+		if(buf[i] != 0xFF) return -1;
+		marker = buf[i+1];
+		if(marker == 0xFF) { ++i; continue; }	/* fill byte */
+		if(marker == M_SOS || marker == M_EOI) return -1;
+		slen = be16(buf + i + 2);
+		if(slen < 2 || i + 2 + slen > len) return -1;
+		res = cb(marker, buf + i + 4, slen - 2, arg);
+		if(res) return res > 0 ? 0 : -1;
+		i += 2 + slen;
+	}
+	return -1;
+}
+
+typedef struct {
+	int * w, * h, * ncomp;
+} SofArg;
+
+static int	sof_cb(int marker, const unsigned char * seg, size_t slen, void * arg)
+{
+	SofArg * sa = (SofArg *) arg;
+
+	/* SOF0..SOF15, but DHT, JPG and DAC share the range */
+	if(marker < 0xC0 || marker > 0xCF || marker == 0xC4
+		|| marker == 0xC8 || marker == 0xCC) return 0;
+	if(slen < 6) return -1;
+	*sa->h = be16(seg + 1);
+	*sa->w = be16(seg + 3);
+	*sa->ncomp = seg[5];
+	return 1;
+}
+
+/*
+ * Reads the frame size from the SOF marker.
+ * Returns 0 on success.
+ */
+int	pp_jpeg_dimensions(const unsigned char * buf, size_t len, int * w, int * h, int * ncomp)
+{
+	SofArg sa;
+
+	sa.w = w; sa.h = h; sa.ncomp = ncomp;
+	return jpeg_walk(buf, len, sof_cb, &sa);
+}
+
+typedef struct {
+	const unsigned char * base;
+	size_t off, len;
+} ExifArg;
+
+static int	exif_cb(int marker, const unsigned char * seg, size_t slen, void * arg)
+{
+	ExifArg * ea = (ExifArg *) arg;
+	const unsigned char * tiff, * ifd;
+	size_t tlen, ifdoff, off = 0, len = 0;
+	unsigned int n, i, tag;
+	int le;
+
+	if(marker != M_APP1 || slen < 14 || memcmp(seg, "Exif\0\0", 6)) return 0;
+	tiff = seg + 6;
+	tlen = slen - 6;
+	if(!memcmp(tiff, "II*\0", 4)) le = 1;
+	else if(!memcmp(tiff, "MM\0*", 4)) le = 0;
+	else return -1;
+
+	/* skip IFD0, the thumbnail is described by IFD1 */
+	ifdoff = rd32(tiff + 4, le);
+	if(ifdoff + 2 > tlen) return -1;
+	n = rd16(tiff + ifdoff, le);
+	ifdoff += 2 + 12 * n;
+	if(ifdoff + 4 > tlen) return -1;
+	ifdoff = rd32(tiff + ifdoff, le);
+	if(!ifdoff || ifdoff + 2 > tlen) return -1;
+
+	n = rd16(tiff + ifdoff, le);
+	ifd = tiff + ifdoff + 2;
+	if(ifdoff + 2 + 12 * n > tlen) return -1;
+	for(i = 0; i < n; ++i, ifd += 12) {
+		tag = rd16(ifd, le);
+		if(tag == TAG_JPEGIF) off = rd32(ifd + 8, le);
+		else if(tag == TAG_JPEGIF_LEN) len = rd32(ifd + 8, le);
+	}
+	if(!off || len < 4 || off > tlen || len > tlen - off) return -1;
+	if(tiff[off] != 0xFF || tiff[off+1] != M_SOI) return -1;
+	ea->off = (tiff - ea->base) + off;
+	ea->len = len;
+	return 1;
+}
+
+/*
+ * Locates the JPEG thumbnail embedded in the EXIF APP1 segment.
+ * Returns 0 and sets its offset and length on success.
+ */
+int	pp_jpeg_exif_thumbnail(const unsigned char * buf, size_t len, size_t * off, size_t * tlen)
+{
+	ExifArg ea;
+
+	ea.base = buf;
+	if(jpeg_walk(buf, len, exif_cb, &ea)) return -1;
+	*off = ea.off;
+	*tlen = ea.len;
+	return 0;
+}
+
+/*
+ * The Orientation tag of IFD0 in an EXIF block ("Exif\0\0" and
+ * the TIFF structure, as in the APP1 segment), 0 if there's none
+ */
+int	pp_exif_orientation(const unsigned char * exif, size_t len)
+{
+	const unsigned char * tiff, * ifd;
+	size_t tlen, ifdoff;
+	unsigned int n, i;
+	int le;
+
+	if(len < 14 || memcmp(exif, "Exif\0\0", 6)) return 0;
+	tiff = exif + 6;
+	tlen = len - 6;
+	if(!memcmp(tiff, "II*\0", 4)) le = 1;
+	else if(!memcmp(tiff, "MM\0*", 4)) le = 0;
+	else return 0;
+
+	ifdoff = rd32(tiff + 4, le);
+	if(ifdoff + 2 > tlen) return 0;
+	n = rd16(tiff + ifdoff, le);
+	ifd = tiff + ifdoff + 2;
+	if(ifdoff + 2 + 12 * n > tlen) return 0;
+	for(i = 0; i < n; ++i, ifd += 12) {
+		/* a SHORT, stored in the first bytes of the value */
+		if(rd16(ifd, le) == TAG_ORIENTATION) return rd16(ifd + 8, le);
+	}
+	return 0;
+}
+
+/*
+ * Writes to buf the smallest EXIF block carrying orientation:
+ * an IFD0 with that tag alone. Returns its length, which is
+ * PP_EXIF_ORIENTATION_LEN.
+ */
+size_t	pp_exif_orientation_block(int orientation, unsigned char * buf)
+{
+	static const unsigned char block[PP_EXIF_ORIENTATION_LEN] = {
+		'E', 'x', 'i', 'f', 0, 0,
+		'M', 'M', 0, '*', 0, 0, 0, 8,		/* big endian, IFD0 at 8 */
+		0, 1,								/* one entry */
+		0x01, 0x12, 0, 3, 0, 0, 0, 1,		/* Orientation, one SHORT */
+		0, 0, 0, 0,							/* its value, left aligned */
+		0, 0, 0, 0							/* no IFD1 */
+	};
+
+	memcpy(buf, block, sizeof(block));
+	buf[25] = orientation & 0xFF;
+	return sizeof(block);
+}
@@ -0,0 +1,143 @@
+/*********************************************************************
+ PostPic - An image-enabling extension for PostgreSql
+ (C) Copyright 2010 Domenico Rotiroti
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, version 3 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ A copy of the GNU Lesser General Public License is included in the
+ source distribution of this software.
+
+*********************************************************************/
+
+/*
+ * Lossless JPEG transcoding with libjpeg, as jpegtran -optimize does:
+ * the DCT coefficients are copied untouched and only their entropy
+ * coding changes
+ */
+#include "pp_kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+/* in-memory source and destination came with libjpeg 8 */
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+#define PP_HAVE_MEM_SRCDST
+#endif
+
+#define ICC_MARKER		(JPEG_APP0 + 2)
+#define ICC_SIGNATURE	"ICC_PROFILE"
+#define EXIF_MARKER		(JPEG_APP0 + 1)
+
+typedef struct {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+} PPJpegError;
+
+static void	error_exit(j_common_ptr cinfo)
+{
+	longjmp(((PPJpegError *) cinfo->err)->jmp, 1);
+}
+
+/* corrupt data warnings are for the decoding of pixels */
+static void	output_message(j_common_ptr cinfo)
+{
+}
+
+static int	has_signature(jpeg_saved_marker_ptr m, const char * sig, unsigned int len)
+{
+	return m->data_length >= len && !memcmp(m->data, sig, len);
+}
+
+/*
+ * Writes src with Huffman tables computed for it (and progressive,
+ * if asked) to *out, which the caller frees, returning its length
+ * or 0 on errors. Comments and APPn markers are copied, but those
+ * the encoder writes itself (JFIF and Adobe) or, with strip, all
+ * of them save for the ICC profile and the EXIF orientation, which
+ * gets a block of its own.
+ */
+size_t	pp_jpeg_optimize(const unsigned char * src, size_t len, int progressive, int strip,
+	unsigned char ** out)
+{
+#ifdef PP_HAVE_MEM_SRCDST
+	struct jpeg_decompress_struct din;
+	struct jpeg_compress_struct cout;
+	PPJpegError err;
+	jvirt_barray_ptr * coefs;
+	jpeg_saved_marker_ptr m;
+	unsigned char * buf = NULL;
+	unsigned char exif[PP_EXIF_ORIENTATION_LEN];
+	unsigned long blen = 0;
+	int i, orientation, oriented = 0;
+
+	*out = NULL;
+	memset(&din, 0, sizeof(din));
+	memset(&cout, 0, sizeof(cout));
+	din.err = cout.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = error_exit;
+	err.pub.output_message = output_message;
+	if(setjmp(err.jmp)) {
+		jpeg_destroy_compress(&cout);
+		jpeg_destroy_decompress(&din);
+		free(buf);
+		return 0;
+	}
+
+	jpeg_create_decompress(&din);
+	jpeg_mem_src(&din, (unsigned char *) src, len);
+	if(!strip) {
+		jpeg_save_markers(&din, JPEG_COM, 0xFFFF);
+		for(i = 0; i < 16; ++i) jpeg_save_markers(&din, JPEG_APP0 + i, 0xFFFF);
+	} else {
+		jpeg_save_markers(&din, ICC_MARKER, 0xFFFF);
+		jpeg_save_markers(&din, EXIF_MARKER, 0xFFFF);
+	}
+	jpeg_read_header(&din, TRUE);
+	coefs = jpeg_read_coefficients(&din);
+	/* damaged data would come out "repaired": leave it alone */
+	if(err.pub.num_warnings) longjmp(err.jmp, 1);
+
+	jpeg_create_compress(&cout);
+	jpeg_copy_critical_parameters(&din, &cout);
+	cout.optimize_coding = TRUE;
+	if(progressive) jpeg_simple_progression(&cout);
+	jpeg_mem_dest(&cout, &buf, &blen);
+	jpeg_write_coefficients(&cout, coefs);
+	for(m = din.marker_list; m; m = m->next) {
+		if(cout.write_JFIF_header && m->marker == JPEG_APP0 && has_signature(m, "JFIF", 5)) continue;
+		if(cout.write_Adobe_marker && m->marker == JPEG_APP0 + 14 && has_signature(m, "Adobe", 5)) continue;
+		/* without it viewers can't tell which way is up */
+		if(strip && m->marker == EXIF_MARKER) {
+			orientation = pp_exif_orientation(m->data, m->data_length);
+			if(orientation > 1 && orientation <= 8 && !oriented) {
+				jpeg_write_marker(&cout, EXIF_MARKER, exif,
+					pp_exif_orientation_block(orientation, exif));
+				oriented = 1;
+			}
+			continue;
+		}
+		if(strip && !has_signature(m, ICC_SIGNATURE, sizeof(ICC_SIGNATURE))) continue;
+		jpeg_write_marker(&cout, m->marker, m->data, m->data_length);
+	}
+	jpeg_finish_compress(&cout);
+	jpeg_destroy_compress(&cout);
+	jpeg_finish_decompress(&din);
+	jpeg_destroy_decompress(&din);
+
+	*out = buf;
+	return blen;
+#else
+	*out = NULL;
+	return 0;
+#endif
+}
@@ -0,0 +1,74 @@
+/*********************************************************************
+ PostPic - An image-enabling extension for PostgreSql
+ (C) Copyright 2010 Domenico Rotiroti
+ 
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, version 3 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ A copy of the GNU Lesser General Public License is included in the
+ source distribution of this software.
+
+*********************************************************************/
+
+/*
+ * Routines working on plain buffers, with no dependency
+ * on PostgreSQL or GraphicsMagick
+ */
+#ifndef PP_KERNELS_H
+#define PP_KERNELS_H
+
+#include <stddef.h>
+
+/* pp_jpeg.c */
+int		pp_jpeg_dimensions(const unsigned char * buf, size_t len, int * w, int * h, int * ncomp);
+int		pp_jpeg_exif_thumbnail(const unsigned char * buf, size_t len, size_t * off, size_t * tlen);
+int		pp_exif_orientation(const unsigned char * exif, size_t len);
+#define PP_EXIF_ORIENTATION_LEN	32
+size_t	pp_exif_orientation_block(int orientation, unsigned char * buf);
+
+/* pp_jpegopt.c, with libjpeg */
+size_t	pp_jpeg_optimize(const unsigned char * src, size_t len, int progressive, int strip,
+			unsigned char ** out);
+
+/* pp_resample.c */
+#define PP_FILTER_BOX		0
+#define PP_FILTER_TRIANGLE	1
+#define PP_FILTER_CUBIC		2
+#define PP_FILTER_CATROM	3
+#define PP_FILTER_MITCHELL	4
+#define PP_FILTER_LANCZOS	5
+
+int		pp_resample_rgba8(const unsigned char * src, int sw, int sh,
+			unsigned char * dst, int dw, int dh, int filter);
+
+/* pp_pixels.c */
+typedef struct {
+	size_t n;
+	long long sum[3];		/* R, G, B */
+	long long sum_rg;		/* R - G */
+	long long sum_yb;		/* R + G - 2B, i.e. twice the yellow-blue opponent */
+	long long sumsq_rg;
+	long long sumsq_yb;
+} PPPixelStats;
+
+void	pp_pixel_stats(const unsigned char * px, size_t n, PPPixelStats * st);
+int		pp_histogram(const unsigned char * px, size_t n, int bins, unsigned int * hist);
+int		pp_dominant_colors(const unsigned char * px, size_t n, int ncolors,
+			unsigned char * rgb, unsigned int * counts);
+void	pp_rgba8_to_float(const unsigned char * px, size_t n, int planar,
+			const float * scale, const float * bias, float * out);
+
+/* pp_hex.c */
+void	pp_hex_encode(const unsigned char * src, size_t len, char * dst);
+long	pp_hex_decode(const char * src, size_t len, unsigned char * dst, const char ** bad);
+void	pp_base64_encode(const unsigned char * src, size_t len, char * dst);
+long	pp_base64_decode(const char * src, size_t len, unsigned char * dst);
+
+#endif
+//PP_KERNELS_H
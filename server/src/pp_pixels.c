@@ -0,0 +1,265 @@
+/*********************************************************************
+ PostPic - An image-enabling extension for PostgreSql
+ (C) Copyright 2010 Domenico Rotiroti
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, version 3 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ A copy of the GNU Lesser General Public License is included in the
+ source distribution of this software.
+
+*********************************************************************/
+
+/*
+ * Statistics over 8 bit RGBA buffers (alpha is ignored)
+ */
+#include "pp_kernels.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#define PP_HAVE_SSE2
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
+
+/* each 32 bit lane adds up BLOCK_PIXELS / 4 squares up to 510^2 */
+#define BLOCK_PIXELS	4096
+
+static void	stats_scalar(const unsigned char * px, size_t n, PPPixelStats * st)
+{
+	int r, g, b, rg, yb;
+	size_t i;
+
+	for(i = 0; i < n; ++i, px += 4) {
+		r = px[0];
+		g = px[1];
+		b = px[2];
+		rg = r - g;
+		yb = r + g - 2 * b;
+		st->sum[0] += r;
+		st->sum[1] += g;
+		st->sum[2] += b;
+		st->sum_rg += rg;
+		st->sum_yb += yb;
+		st->sumsq_rg += rg * rg;
+		st->sumsq_yb += yb * yb;
+	}
+}
+
+#ifdef PP_HAVE_SSE2
+static long long	hsum64(__m128i v)
+{
+	long long a[2];
+
+	_mm_storeu_si128((__m128i *) a, v);
+	return a[0] + a[1];
+}
+
+static long long	hsum32(__m128i v)
+{
+	int a[4];
+
+	_mm_storeu_si128((__m128i *) a, v);
+	return (long long) a[0] + a[1] + a[2] + a[3];
+}
+
+/*
+ * Four pixels at a time. Channel sums come from _mm_sad_epu8 over
+ * masked bytes, the opponent channels are computed on 16 bit lanes
+ * and squared with _mm_madd_epi16.
+ */
+static void	stats_sse2(const unsigned char * px, size_t n, PPPixelStats * st)
+{
+	const __m128i zero = _mm_setzero_si128(), lo16 = _mm_set1_epi32(0xFFFF);
+	const __m128i mr = _mm_set1_epi32(0xFF), mg = _mm_set1_epi32(0xFF00), mb = _mm_set1_epi32(0xFF0000);
+	__m128i sr, sg, sb, srg, syb, qrg, qyb, v, p, r, g, b, rg, yb;
+	size_t i, end;
+
+	for(i = 0; i + 4 <= n; ) {
+		sr = sg = sb = srg = syb = qrg = qyb = zero;
+		end = i + BLOCK_PIXELS < n ? i + BLOCK_PIXELS : n;
+		for(; i + 4 <= end; i += 4, px += 16) {
+			v = _mm_loadu_si128((const __m128i *) px);
+			sr = _mm_add_epi64(sr, _mm_sad_epu8(_mm_and_si128(v, mr), zero));
+			sg = _mm_add_epi64(sg, _mm_sad_epu8(_mm_and_si128(v, mg), zero));
+			sb = _mm_add_epi64(sb, _mm_sad_epu8(_mm_and_si128(v, mb), zero));
+			/* one channel per 32 bit lane, in the low 16 bits */
+			r = _mm_and_si128(v, mr);
+			g = _mm_and_si128(_mm_srli_epi32(v, 8), mr);
+			b = _mm_and_si128(_mm_srli_epi32(v, 16), mr);
+			rg = _mm_sub_epi32(r, g);
+			yb = _mm_sub_epi32(_mm_add_epi32(r, g), _mm_slli_epi32(b, 1));
+			srg = _mm_add_epi32(srg, rg);
+			syb = _mm_add_epi32(syb, yb);
+			/* high halves of the lanes are 0 or sign bits: mask them */
+			p = _mm_and_si128(rg, lo16);
+			qrg = _mm_add_epi32(qrg, _mm_madd_epi16(p, p));
+			p = _mm_and_si128(yb, lo16);
+			qyb = _mm_add_epi32(qyb, _mm_madd_epi16(p, p));
+		}
+		st->sum[0] += hsum64(sr);
+		st->sum[1] += hsum64(sg);
+		st->sum[2] += hsum64(sb);
+		st->sum_rg += hsum32(srg);
+		st->sum_yb += hsum32(syb);
+		st->sumsq_rg += hsum32(qrg);
+		st->sumsq_yb += hsum32(qyb);
+	}
+	stats_scalar(px, n - i, st);
+}
+#endif
+
+void	pp_pixel_stats(const unsigned char * px, size_t n, PPPixelStats * st)
+{
+	memset(st, 0, sizeof(PPPixelStats));
+	st->n = n;
+#ifdef PP_HAVE_SSE2
+	stats_sse2(px, n, st);
+#else
+	stats_scalar(px, n, st);
+#endif
+}
+
+/*
+ * Per channel histograms, hist holding 3 * bins counters (R, then
+ * G, then B). Four partial histograms avoid stalls on repeated values.
+ */
+int		pp_histogram(const unsigned char * px, size_t n, int bins, unsigned int * hist)
+{
+	unsigned int part[4][3 * 256];
+	int shift = 0, i, j;
+	size_t k;
+
+	if(bins <= 0 || bins > 256 || (bins & (bins - 1))) return -1;
+	while((256 >> shift) > bins) ++shift;
+	memset(part, 0, sizeof(part));
+	for(k = 0; k + 4 <= n; k += 4, px += 16) {
+		for(j = 0; j < 4; ++j) {
+			part[j][px[j*4] >> shift]++;
+			part[j][256 + (px[j*4 + 1] >> shift)]++;
+			part[j][512 + (px[j*4 + 2] >> shift)]++;
+		}
+	}
+	for(; k < n; ++k, px += 4) {
+		part[0][px[0] >> shift]++;
+		part[0][256 + (px[1] >> shift)]++;
+		part[0][512 + (px[2] >> shift)]++;
+	}
+	for(i = 0; i < 3; ++i) {
+		for(j = 0; j < bins; ++j) {
+			hist[i * bins + j] = part[0][i*256 + j] + part[1][i*256 + j]
+				+ part[2][i*256 + j] + part[3][i*256 + j];
+		}
+	}
+	return 0;
+}
+
+/*
+ * The (up to) ncolors most common colors, quantized to 4 bits per
+ * channel, each reported as the average of the pixels falling in
+ * its cell. Returns how many were found, most common first.
+ */
+int		pp_dominant_colors(const unsigned char * px, size_t n, int ncolors,
+	unsigned char * rgb, unsigned int * counts)
+{
+	static unsigned int count[4096];
+	static unsigned long long sum[4096][3];
+	int found = 0, best, c, i, j;
+	size_t k;
+
+	memset(count, 0, sizeof(count));
+	memset(sum, 0, sizeof(sum));
+	for(k = 0; k < n; ++k, px += 4) {
+		c = ((px[0] >> 4) << 8) | ((px[1] >> 4) << 4) | (px[2] >> 4);
+		count[c]++;
+		sum[c][0] += px[0];
+		sum[c][1] += px[1];
+		sum[c][2] += px[2];
+	}
+	for(i = 0; i < ncolors; ++i) {
+		best = -1;
+		for(c = 0; c < 4096; ++c) {
+			if(count[c] && (best < 0 || count[c] > count[best])) best = c;
+		}
+		if(best < 0) break;
+		for(j = 0; j < 3; ++j) rgb[i*3 + j] = (unsigned char) ((sum[best][j] + count[best] / 2) / count[best]);
+		counts[i] = count[best];
+		count[best] = 0;
+		++found;
+	}
+	return found;
+}
+
+/*
+ * RGBA to normalized float RGB, pixel * scale + bias per channel,
+ * either planar (all R, then G, then B) or interleaved
+ */
+static void	to_float_scalar(const unsigned char * px, size_t n, int planar,
+	const float * scale, const float * bias, float * out, size_t i)
+{
+	int c;
+
+	for(px += i * 4; i < n; ++i, px += 4) {
+		for(c = 0; c < 3; ++c) {
+			if(planar) out[c * n + i] = px[c] * scale[c] + bias[c];
+			else out[i * 3 + c] = px[c] * scale[c] + bias[c];
+		}
+	}
+}
+
+#ifdef PP_HAVE_SSE2
+/*
+ * Four pixels at a time, one channel per vector. Interleaving
+ * transposes them into one vector per pixel, stored 3 floats
+ * apart: each store's 4th float is overwritten by the next,
+ * so the last pixel is left to the scalar loop.
+ */
+static size_t	to_float_sse2(const unsigned char * px, size_t n, int planar,
+	const float * scale, const float * bias, float * out)
+{
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	__m128 s0 = _mm_set1_ps(scale[0]), s1 = _mm_set1_ps(scale[1]), s2 = _mm_set1_ps(scale[2]);
+	__m128 b0 = _mm_set1_ps(bias[0]), b1 = _mm_set1_ps(bias[1]), b2 = _mm_set1_ps(bias[2]);
+	__m128 r, g, b, a;
+	__m128i v;
+	size_t i;
+
+	for(i = 0; i + 4 < n; i += 4, px += 16) {
+		v = _mm_loadu_si128((const __m128i *) px);
+		r = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(v, mask)), s0), b0);
+		g = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 8), mask)), s1), b1);
+		b = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 16), mask)), s2), b2);
+		if(planar) {
+			_mm_storeu_ps(out + i, r);
+			_mm_storeu_ps(out + n + i, g);
+			_mm_storeu_ps(out + 2 * n + i, b);
+		} else {
+			a = _mm_setzero_ps();
+			_MM_TRANSPOSE4_PS(r, g, b, a);
+			_mm_storeu_ps(out + i * 3, r);
+			_mm_storeu_ps(out + i * 3 + 3, g);
+			_mm_storeu_ps(out + i * 3 + 6, b);
+			_mm_storeu_ps(out + i * 3 + 9, a);
+		}
+	}
+	return i;
+}
+#endif
+
+void	pp_rgba8_to_float(const unsigned char * px, size_t n, int planar,
+	const float * scale, const float * bias, float * out)
+{
+	size_t i = 0;
+
+#ifdef PP_HAVE_SSE2
+	i = to_float_sse2(px, n, planar, scale, bias, out);
+#endif
+	to_float_scalar(px, n, planar, scale, bias, out, i);
+}
@@ -0,0 +1,379 @@
+/*********************************************************************
+ PostPic - An image-enabling extension for PostgreSql
+ (C) Copyright 2010 Domenico Rotiroti
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as
+ published by the Free Software Foundation, version 3 of the License.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Lesser General Public License for more details.
+
+ A copy of the GNU Lesser General Public License is included in the
+ source distribution of this software.
+
+*********************************************************************/
+
+/*
+ * Separable resampling of 8 bit RGBA buffers: a horizontal pass
+ * into a temporary buffer, then a vertical one, both with
+ * precomputed fixed point weights
+ */
+#include "pp_kernels.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PP_HAVE_SSE41
+#define PP_TARGET_SSE41	__attribute__((target("sse4.1")))
+#include <smmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PP_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+#define PREC	14
+#define ONE		(1 << PREC)
+#define ROUND	(1 << (PREC - 1))
+#define NCH		4
+
+typedef struct {
+	int start;		/* first source pixel */
+	int n;			/* number of taps */
+} PPContrib;
+
+typedef struct {
+	PPContrib * c;
+	int * w;		/* maxn weights for each destination pixel */
+	int maxn;
+} PPWeights;
+
+typedef struct {
+	double (*f)(double);
+	double support;
+} PPKernel;
+
+static double	f_box(double x)
+{
+	return (x >= -0.5 && x < 0.5) ? 1.0 : 0.0;
+}
+
+static double	f_triangle(double x)
+{
+	x = fabs(x);
+	return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+/* Mitchell-Netravali family of cubics */
+static double	bc_cubic(double x, double b, double c)
+{
+	x = fabs(x);
+	if(x < 1.0)
+		return ((12 - 9*b - 6*c) * x*x*x + (-18 + 12*b + 6*c) * x*x + (6 - 2*b)) / 6.0;
+	if(x < 2.0)
+		return ((-b - 6*c) * x*x*x + (6*b + 30*c) * x*x + (-12*b - 48*c) * x + (8*b + 24*c)) / 6.0;
+	return 0.0;
+}
+
+/* the B-spline, as GM's CubicFilter */
+static double	f_cubic(double x)
+{
+	return bc_cubic(x, 1.0, 0.0);
+}
+
+static double	f_catrom(double x)
+{
+	return bc_cubic(x, 0.0, 0.5);
+}
+
+static double	f_mitchell(double x)
+{
+	return bc_cubic(x, 1.0/3.0, 1.0/3.0);
+}
+
+static double	sinc(double x)
+{
+	if(x == 0.0) return 1.0;
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+static double	f_lanczos(double x)
+{
+	x = fabs(x);
+	return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+/* indexed by PP_FILTER_* */
+static const PPKernel kernels[] = {
+	{ f_box, 0.5 },
+	{ f_triangle, 1.0 },
+	{ f_cubic, 2.0 },
+	{ f_catrom, 2.0 },
+	{ f_mitchell, 2.0 },
+	{ f_lanczos, 3.0 }
+};
+
+static unsigned char	clamp8(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static void	free_weights(PPWeights * pw)
+{
+	free(pw->c);
+	free(pw->w);
+}
+
+/*
+ * Weights for mapping sn source pixels onto dn: the filter
+ * is stretched when shrinking, and each pixel's weights
+ * are normalized to sum exactly ONE
+ */
+static int	compute_weights(int sn, int dn, const PPKernel * k, PPWeights * pw)
+{
+	double scale = (double) sn / dn, fscale = scale > 1.0 ? scale : 1.0;
+	double support = k->support * fscale, center, sum, * tmp;
+	int i, j, lo, hi, total, best;
+	int * w;
+
+	pw->maxn = (int) ceil(support) * 2 + 1;
+	pw->c = malloc(dn * sizeof(PPContrib));
+	pw->w = malloc((size_t) dn * pw->maxn * sizeof(int));
+	tmp = malloc(pw->maxn * sizeof(double));
+	if(!pw->c || !pw->w || !tmp) {
+		free(tmp);
+		free_weights(pw);
+		return -1;
+	}
+
+	for(i = 0; i < dn; ++i) {
+		center = (i + 0.5) * scale;
+		lo = (int) floor(center - support + 0.5);
+		hi = (int) floor(center + support + 0.5);
+		if(lo < 0) lo = 0;
+		if(hi > sn) hi = sn;
+		if(hi - lo > pw->maxn) hi = lo + pw->maxn;
+		sum = 0.0;
+		for(j = lo; j < hi; ++j) {
+			tmp[j - lo] = k->f((j + 0.5 - center) / fscale);
+			sum += tmp[j - lo];
+		}
+		w = pw->w + (size_t) i * pw->maxn;
+		if(sum == 0.0) {
+			/* nothing in reach: take the nearest pixel */
+			lo = (int) center;
+			if(lo >= sn) lo = sn - 1;
+			hi = lo + 1;
+			tmp[0] = sum = 1.0;
+		}
+		total = best = 0;
+		for(j = 0; j < hi - lo; ++j) {
+			w[j] = (int) floor(tmp[j] / sum * ONE + 0.5);
+			total += w[j];
+			if(w[j] > w[best]) best = j;
+		}
+		w[best] += ONE - total;
+		pw->c[i].start = lo;
+		pw->c[i].n = hi - lo;
+	}
+	free(tmp);
+	return 0;
+}
+
+static void	hpass_scalar(const unsigned char * src, unsigned char * dst, int dw, const PPWeights * pw)
+{
+	const unsigned char * s;
+	const int * w;
+	int x, k, a0, a1, a2, a3;
+
+	for(x = 0; x < dw; ++x) {
+		s = src + pw->c[x].start * NCH;
+		w = pw->w + (size_t) x * pw->maxn;
+		a0 = a1 = a2 = a3 = ROUND;
+		for(k = 0; k < pw->c[x].n; ++k, s += NCH) {
+			a0 += s[0] * w[k];
+			a1 += s[1] * w[k];
+			a2 += s[2] * w[k];
+			a3 += s[3] * w[k];
+		}
+		dst[x*NCH] = clamp8(a0 >> PREC);
+		dst[x*NCH + 1] = clamp8(a1 >> PREC);
+		dst[x*NCH + 2] = clamp8(a2 >> PREC);
+		dst[x*NCH + 3] = clamp8(a3 >> PREC);
+	}
+}
+
+static void	vpass_scalar(const unsigned char * src, size_t stride, unsigned char * dst, int len, const int * w, int n)
+{
+	int i, k, acc;
+
+	for(i = 0; i < len; ++i) {
+		acc = ROUND;
+		for(k = 0; k < n; ++k) acc += src[k * stride + i] * w[k];
+		dst[i] = clamp8(acc >> PREC);
+	}
+}
+
+#ifdef PP_HAVE_SSE41
+/* one pixel, all four channels, per output */
+PP_TARGET_SSE41
+static void	hpass_sse41(const unsigned char * src, unsigned char * dst, int dw, const PPWeights * pw)
+{
+	const unsigned char * s;
+	const int * w;
+	__m128i acc, p;
+	int x, k, v;
+
+	for(x = 0; x < dw; ++x) {
+		s = src + pw->c[x].start * NCH;
+		w = pw->w + (size_t) x * pw->maxn;
+		acc = _mm_set1_epi32(ROUND);
+		for(k = 0; k < pw->c[x].n; ++k, s += NCH) {
+			memcpy(&v, s, NCH);
+			p = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(v));
+			acc = _mm_add_epi32(acc, _mm_mullo_epi32(p, _mm_set1_epi32(w[k])));
+		}
+		acc = _mm_srai_epi32(acc, PREC);
+		acc = _mm_packs_epi32(acc, acc);
+		v = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+		memcpy(dst + x*NCH, &v, NCH);
+	}
+}
+
+/* 16 bytes at a time, the tail goes scalar */
+PP_TARGET_SSE41
+static void	vpass_sse41(const unsigned char * src, size_t stride, unsigned char * dst, int len, const int * w, int n)
+{
+	__m128i a0, a1, a2, a3, v, wk;
+	int i, k;
+
+	for(i = 0; i + 16 <= len; i += 16) {
+		a0 = a1 = a2 = a3 = _mm_set1_epi32(ROUND);
+		for(k = 0; k < n; ++k) {
+			v = _mm_loadu_si128((const __m128i *) (src + k * stride + i));
+			wk = _mm_set1_epi32(w[k]);
+			a0 = _mm_add_epi32(a0, _mm_mullo_epi32(_mm_cvtepu8_epi32(v), wk));
+			a1 = _mm_add_epi32(a1, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), wk));
+			a2 = _mm_add_epi32(a2, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8)), wk));
+			a3 = _mm_add_epi32(a3, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 12)), wk));
+		}
+		a0 = _mm_packs_epi32(_mm_srai_epi32(a0, PREC), _mm_srai_epi32(a1, PREC));
+		a2 = _mm_packs_epi32(_mm_srai_epi32(a2, PREC), _mm_srai_epi32(a3, PREC));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(a0, a2));
+	}
+	vpass_scalar(src + i, stride, dst + i, len - i, w, n);
+}
+#endif
+
+#ifdef PP_HAVE_NEON
+static void	hpass_neon(const unsigned char * src, unsigned char * dst, int dw, const PPWeights * pw)
+{
+	const unsigned char * s;
+	const int * w;
+	int32x4_t acc, p;
+	uint8x8_t r;
+	uint32_t v;
+	int x, k;
+
+	for(x = 0; x < dw; ++x) {
+		s = src + pw->c[x].start * NCH;
+		w = pw->w + (size_t) x * pw->maxn;
+		acc = vdupq_n_s32(0);
+		for(k = 0; k < pw->c[x].n; ++k, s += NCH) {
+			memcpy(&v, s, NCH);
+			p = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(v))))));
+			acc = vmlaq_n_s32(acc, p, w[k]);
+		}
+		/* the rounding shift adds ROUND itself */
+		r = vqmovn_u16(vcombine_u16(vqrshrun_n_s32(acc, PREC), vdup_n_u16(0)));
+		v = vget_lane_u32(vreinterpret_u32_u8(r), 0);
+		memcpy(dst + x*NCH, &v, NCH);
+	}
+}
+
+static void	vpass_neon(const unsigned char * src, size_t stride, unsigned char * dst, int len, const int * w, int n)
+{
+	int32x4_t a0, a1, a2, a3;
+	uint16x8_t lo, hi;
+	uint8x16_t v;
+	int i, k;
+
+	for(i = 0; i + 16 <= len; i += 16) {
+		a0 = a1 = a2 = a3 = vdupq_n_s32(0);
+		for(k = 0; k < n; ++k) {
+			v = vld1q_u8(src + k * stride + i);
+			lo = vmovl_u8(vget_low_u8(v));
+			hi = vmovl_u8(vget_high_u8(v));
+			a0 = vmlaq_n_s32(a0, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(lo))), w[k]);
+			a1 = vmlaq_n_s32(a1, vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(lo))), w[k]);
+			a2 = vmlaq_n_s32(a2, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(hi))), w[k]);
+			a3 = vmlaq_n_s32(a3, vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(hi))), w[k]);
+		}
+		lo = vcombine_u16(vqrshrun_n_s32(a0, PREC), vqrshrun_n_s32(a1, PREC));
+		hi = vcombine_u16(vqrshrun_n_s32(a2, PREC), vqrshrun_n_s32(a3, PREC));
+		vst1q_u8(dst + i, vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi)));
+	}
+	vpass_scalar(src + i, stride, dst + i, len - i, w, n);
+}
+#endif
+
+static void	(*hpass)(const unsigned char *, unsigned char *, int, const PPWeights *) = NULL;
+static void	(*vpass)(const unsigned char *, size_t, unsigned char *, int, const int *, int) = NULL;
+
+static void	choose_kernels(void)
+{
+	hpass = hpass_scalar;
+	vpass = vpass_scalar;
+#ifdef PP_HAVE_SSE41
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.1")) {
+		hpass = hpass_sse41;
+		vpass = vpass_sse41;
+	}
+#endif
+#ifdef PP_HAVE_NEON
+	hpass = hpass_neon;
+	vpass = vpass_neon;
+#endif
+}
+
+int		pp_resample_rgba8(const unsigned char * src, int sw, int sh,
+	unsigned char * dst, int dw, int dh, int filter)
+{
+	PPWeights hw, vw;
+	unsigned char * tmp;
+	size_t sstride = (size_t) sw * NCH, dstride = (size_t) dw * NCH;
+	int y;
+
+	if(filter < 0 || filter >= (int) (sizeof(kernels) / sizeof(kernels[0]))) return -1;
+	if(sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0) return -1;
+	/* rows are passed on as int lengths */
+	if(sw > INT_MAX / NCH || dw > INT_MAX / NCH) return -1;
+	if(!hpass) choose_kernels();
+
+	if(compute_weights(sw, dw, &kernels[filter], &hw)) return -1;
+	if(compute_weights(sh, dh, &kernels[filter], &vw)) {
+		free_weights(&hw);
+		return -1;
+	}
+	tmp = malloc(dstride * sh);
+	if(tmp) {
+		for(y = 0; y < sh; ++y) hpass(src + y * sstride, tmp + y * dstride, dw, &hw);
+		for(y = 0; y < dh; ++y) {
+			vpass(tmp + vw.c[y].start * dstride, dstride, dst + y * dstride, (int) dstride,
+				vw.w + (size_t) y * vw.maxn, vw.c[y].n);
+		}
+		free(tmp);
+	}
+	free_weights(&hw);
+	free_weights(&vw);
+	return tmp ? 0 : -1;
+}
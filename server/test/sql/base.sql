@@ -0,0 +1,62 @@
+--
+-- Construction, properties and transforms, on generated images
+--
+SET client_min_messages = warning;
+CREATE EXTENSION postpic;
+RESET client_min_messages;
+CREATE TABLE imgs ( name VARCHAR, img image );
+INSERT INTO imgs VALUES ('landscape', image_new(200, 100, '#336699'));
+INSERT INTO imgs VALUES ('portrait', image_new(60, 120, '#ffffff'));
+SELECT name, width(img), height(img), format(img) FROM imgs ORDER BY name;
+SELECT name, size(img) FROM imgs ORDER BY name;
+-- thumbnails keep the aspect ratio, and may come from a scaled decode
+SELECT name, width(t), height(t) FROM (SELECT name, thumbnail(img, 50) AS t FROM imgs) s ORDER BY name;
+SELECT name, width(t), height(t) FROM (SELECT name, square(img, 32) AS t FROM imgs) s ORDER BY name;
+SELECT name, width(t), height(t) FROM (SELECT name, resize(img, 40, 30) AS t FROM imgs) s ORDER BY name;
+-- filters the vectorized resampler handles, and one it leaves to GraphicsMagick
+SELECT f, width(t), height(t) FROM (SELECT f, resize(img, 40, 30, f) AS t FROM imgs, unnest(ARRAY['box', 'lanczos', 'gaussian']) f WHERE name = 'landscape') s ORDER BY f;
+SELECT width(t), height(t) FROM (SELECT crop(img, 10, 10, 50, 20) AS t FROM imgs WHERE name = 'landscape') s;
+SELECT width(t), height(t) FROM (SELECT rotate(img, 90) AS t FROM imgs WHERE name = 'landscape') s;
+SELECT width(t), height(t) FROM (SELECT composite(l.img, p.img, 10, 10, 'northwest', 0.5) AS t FROM imgs l, imgs p WHERE l.name = 'landscape' AND p.name = 'portrait') s;
+SELECT level, x, y, width(tile), height(tile) FROM imgs, tiles(img, 128) WHERE name = 'landscape' ORDER BY y, x;
+SELECT count(*) FROM imgs, tiles(img, 64, 1) WHERE name = 'landscape';
+-- single frame formats have one page, the image itself
+SELECT page_count(img), digest(page(img, 0)) = digest(img) AS same FROM imgs WHERE name = 'landscape';
+SELECT page(img, 1) FROM imgs WHERE name = 'landscape';
+-- content statistics
+SELECT name, brightness(img) > 0.95 AS bright, colorfulness(img) < 1 AS gray FROM imgs ORDER BY name;
+SELECT round(sum(v)::numeric, 3) AS total FROM imgs, unnest(histogram(img, 4)) v WHERE name = 'landscape';
+SELECT array_dims(tensor(img, 8, 4)) AS chw, array_dims(tensor(img, 8, 4, 'hwc')) AS hwc, length(tensor_bytes(img, 8, 4)) AS bytes FROM imgs WHERE name = 'landscape';
+-- sizes are checked before anything gets decoded
+SELECT tensor(img, 20000, 20000) FROM imgs WHERE name = 'landscape';
+SELECT tensor_bytes(img, 0, 4) FROM imgs WHERE name = 'landscape';
+-- on solid canvases, drawn over in PNG so that the statistics are exact
+CREATE TABLE solids AS SELECT name, draw_rect(image_new(64, 32, '#000000')::image(64, 64, png), box '((-8,-8),(72,40))', c) AS img FROM (VALUES ('black', color '#000000'), ('white', color '#ffffff'), ('orange', color '#ff8000')) v(name, c);
+SELECT name, average_color(img), round(brightness(img)::numeric, 4) AS brightness, dominant_colors(img) FROM solids ORDER BY name;
+SELECT name, histogram(img, 4) FROM solids ORDER BY name;
+SELECT histogram(img, 3) FROM solids WHERE name = 'black';
+SELECT dominant_colors(img, 0) FROM solids WHERE name = 'black';
+DROP TABLE solids;
+-- pyramids
+SELECT pyramid_levels(img) FROM imgs WHERE name = 'landscape';
+SELECT pyramid_levels(pyramid(image_new(512, 384, '#336699'), 4)) AS levels;
+SELECT pyramid_levels(pyramid(pyramid(image_new(512, 384, '#336699'), 2), 0)) AS levels;
+SELECT width(t), height(t) FROM (SELECT thumbnail(pyramid(image_new(512, 384, '#336699'), 2), 100) AS t) s;
+-- the encoded image comes out exactly the same with a pyramid trailing it
+SELECT bool_and(data_length(p) = data_length(i)) AS length, bool_and(data_range(p, 0, 1 << 30) = data_range(i, 0, 1 << 30)) AS bytes, bool_and(digest(p) = digest(i)) AS digest FROM (SELECT i, pyramid(i, 2) AS p FROM (SELECT image_new(512 + n, 384, '#336699') AS i FROM generate_series(0, 3) n) s) s;
+-- drawing, on a PNG canvas so that pixels read back exactly
+CREATE TABLE canvas AS SELECT image_new(100, 60, '#ffffff')::image(100, 100, png) AS c;
+SELECT average_color(crop(d, 20, 20, 1, 1)) AS inside, average_color(crop(d, 70, 45, 1, 1))::text = average_color(crop(c, 70, 45, 1, 1))::text AS outside FROM (SELECT c, draw_rect(c, box '((10,10),(40,30))', '#ff0000') AS d FROM canvas) s;
+SELECT average_color(crop(d, 20, 20, 1, 1)) AS rect, average_color(crop(d, 75, 40, 1, 1)) AS polygon FROM (SELECT draw(c, rects => '{"((10,10),(40,30))"}', rect_colors => '{#ff0000}', polygons => '{"((60,30),(90,30),(90,55),(60,55))"}', polygon_colors => '{#0000ff}') AS d FROM canvas) s;
+-- outlines only leave the inside alone
+SELECT average_color(crop(d, 25, 20, 1, 1))::text = average_color(crop(c, 25, 20, 1, 1))::text AS hollow FROM (SELECT c, draw(c, rects => '{"((10,10),(40,30))"}', rect_colors => '{#ff0000}', filled => false) AS d FROM canvas) s;
+SELECT average_color(crop(d, 20, 20, 1, 1)) AS rect FROM (SELECT draw_texts(c, '{postpic}', '{"(50,50)"}', rects => '{"((10,10),(40,30))"}', rect_fill => '#ff0000') AS d FROM canvas) s;
+SELECT digest(draw_text(c, 'postpic', 10, 40)) <> digest(c) AS drawn FROM canvas;
+-- annotation settings are cached by font, size and color: the same
+-- settings render the same, other ones don't, and settings evicted from
+-- the cache render the same once rebuilt
+SELECT digest(a) = digest(a2) AS cached, digest(a) <> digest(b) AS resized, digest(a) <> digest(r) AS recolored FROM (SELECT draw_texts(c, '{postpic}', '{"(10,40)"}', size => 12) AS a, draw_texts(c, '{postpic}', '{"(10,40)"}', size => 24) AS b, draw_texts(c, '{postpic}', '{"(10,40)"}', size => 12) AS a2, draw_texts(c, '{postpic}', '{"(10,40)"}', size => 12, fill => '#ff0000') AS r FROM canvas) s;
+SELECT count(DISTINCT digest(draw_texts(c, '{postpic}', '{"(10,40)"}', size => 10 + n % 10))) AS sizes FROM canvas, generate_series(0, 19) n;
+SELECT draw_texts(c, '{a,b}', '{"(10,10)"}') FROM canvas;
+SELECT draw(c, labels => '{a,b}', positions => '{"(10,10)"}') FROM canvas;
+DROP TABLE canvas;
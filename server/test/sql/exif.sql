@@ -0,0 +1,24 @@
+--
+-- EXIF, XMP and IPTC metadata and EXIF previews, on a camera-like
+-- JPEG: a 32x16 gray image carrying a 16x8 EXIF preview, an XMP
+-- packet and IPTC datasets
+--
+CREATE TABLE shots ( img image );
+INSERT INTO shots VALUES (image_from_bytea(decode('ffd8ffe1013545786966000049492a000800000003000f010200080000007a0000001201030001000000010000006987040001000000320000005c00000003009d82050001000000960000002788030001000000c800000003900200140000008200000000000000020001020400010000009e00000002020400010000008f00000000000000706f737470696300323031303a30353a30312031323a33343a3536001c0000000a000000ffd8ffdb004300080606070605080707070909080a0c140d0c0b0b0c1912130f141d1a1f1e1d1a1c1c20242e2720222c231c1c2837292c30313434341f27393d38323c2e333432ffc0000b080008001001011100ffc4001500010100000000000000000000000000000007ffc40014100100000000000000000000000000000000ffda0008010100003f00a40fffd9ffe1006f687474703a2f2f6e732e61646f62652e636f6d2f7861702f312e302f003c783a786d706d65746120786d6c6e733a783d2261646f62653a6e733a6d6574612f223e3c64633a63726561746f723e706f73747069633c2f64633a63726561746f723e3c2f783a786d706d6574613effed003a50686f746f73686f7020332e30003842494d040400000000001d1c02050007706f73747069631c021900037265641c02190004626c756500ffdb004300080606070605080707070909080a0c140d0c0b0b0c1912130f141d1a1f1e1d1a1c1c20242e2720222c231c1c2837292c30313434341f27393d38323c2e333432ffc0000b080010002001011100ffc4001500010100000000000000000000000000000007ffc40014100100000000000000000000000000000000ffda0008010100003f00a40000ffd9', 'hex')));
+-- header fields come from EXIF
+SELECT width(img), height(img), format(img), iso(img), f_number(img), date(img) = '2010-05-01 12:34:56' AS taken FROM shots;
+-- the sidecar holds every attribute, as GraphicsMagick formats it
+SELECT k, metadata(img, k) FROM shots, unnest(ARRAY['EXIF:Make', 'EXIF:DateTimeOriginal', 'EXIF:ISOSpeedRatings', 'EXIF:FNumber', 'IPTC:2:5', 'IPTC:2:25']) k;
+SELECT metadata(img, 'XMP') LIKE '%<dc:creator>postpic</dc:creator>%' AS xmp, metadata(img, 'EXIF:Model') IS NULL AS absent FROM shots;
+-- the jsonb form holds the same pairs
+SELECT metadata(img) ->> 'EXIF:Make' AS make, metadata(img) ->> 'IPTC:2:25' AS keywords, metadata(img) ? 'XMP' AS xmp FROM shots;
+-- generated images have none of it
+SELECT metadata(img, 'EXIF:Make') IS NULL AS none FROM imgs WHERE name = 'landscape';
+-- the EXIF preview, which thumbnail() starts from when it's large enough
+SELECT width(p), height(p), format(p), digest(p) = digest(img) AS same FROM (SELECT img, preview(img) AS p FROM shots) s;
+SELECT preview(img) IS NULL AS none FROM imgs WHERE name = 'landscape';
+SET postpic.thumbnail_from_preview = on;
+SELECT s, width(t), height(t), digest(t) = digest(preview(img)) AS preview FROM (SELECT img, s, thumbnail(img, s) AS t FROM shots, unnest(ARRAY[8, 16, 24]) s) q ORDER BY s;
+SELECT thumbnail(img, 0) FROM shots;
+RESET postpic.thumbnail_from_preview;
+DROP TABLE shots;
@@ -0,0 +1,61 @@
+--
+-- Text, binary and bytea forms, multi-frame input, type modifiers,
+-- byte ranges and lossless optimization
+--
+SELECT name, digest(img::text::image) = digest(img) AS same FROM imgs ORDER BY name;
+SELECT left(img::text, 6) AS prefix FROM imgs WHERE name = 'landscape';
+SET postpic.output_format = base64;
+SELECT left(img::text, 7) AS prefix, digest(img::text::image) = digest(img) AS same FROM imgs WHERE name = 'landscape';
+RESET postpic.output_format;
+SELECT name, digest(image_from_bytea(data_range(img, 0, data_length(img)))) = digest(img) AS same FROM imgs ORDER BY name;
+-- multi-frame input: a 2x1 GIF animation, one red frame and one blue
+CREATE TABLE frames AS SELECT image_from_bytea(decode('47494638396102000100810000ff00000000ff000000ffffff21ff0b4e45545343415045322e30030100000021f904040a0000002c0000000002000100000202040a0021f904040a0000002c00000000020001000002024c0a003b', 'hex')) AS img;
+SELECT format(img), width(img), height(img), page_count(img) FROM frames;
+SELECT p, format(f), width(f), height(f), page_count(f), digest(f) = digest(img) AS whole FROM (SELECT p, page(img, p) AS f, img FROM frames, generate_series(0, 1) p) s ORDER BY p;
+SELECT digest(page(img, 0)) = digest(page(img, 1)) AS same_frame FROM frames;
+SELECT page(img, 2) FROM frames;
+DROP TABLE frames;
+-- binary round trip, plain and with the header
+CREATE TABLE roundtrip ( name VARCHAR, img image );
+COPY imgs TO PROGRAM 'cat > postpic_roundtrip.bin' WITH (FORMAT binary);
+COPY roundtrip FROM PROGRAM 'cat postpic_roundtrip.bin' WITH (FORMAT binary);
+SET postpic.send_header = on;
+COPY imgs TO PROGRAM 'cat > postpic_roundtrip.bin' WITH (FORMAT binary);
+COPY roundtrip FROM PROGRAM 'cat postpic_roundtrip.bin' WITH (FORMAT binary);
+RESET postpic.send_header;
+COPY roundtrip FROM PROGRAM 'rm -f postpic_roundtrip.bin';
+SELECT r.name, count(*), bool_and(digest(r.img) = digest(i.img)) AS same_data, bool_and(width(r.img) = width(i.img) AND date(r.img) IS NOT DISTINCT FROM date(i.img)) AS same_header FROM roundtrip r JOIN imgs i USING (name) GROUP BY r.name ORDER BY r.name;
+DROP TABLE roundtrip;
+-- and with a pyramid trailing the encoded image, which must come out exact
+CREATE TABLE pyramids ( img image );
+INSERT INTO pyramids SELECT pyramid(image_new(512, 384, '#336699'), 2);
+COPY pyramids TO PROGRAM 'cat > postpic_roundtrip.bin' WITH (FORMAT binary);
+COPY pyramids FROM PROGRAM 'cat postpic_roundtrip.bin' WITH (FORMAT binary);
+SET postpic.send_header = on;
+COPY (SELECT img FROM pyramids LIMIT 1) TO PROGRAM 'cat > postpic_roundtrip.bin' WITH (FORMAT binary);
+COPY pyramids FROM PROGRAM 'cat postpic_roundtrip.bin' WITH (FORMAT binary);
+RESET postpic.send_header;
+COPY pyramids FROM PROGRAM 'rm -f postpic_roundtrip.bin';
+SELECT pyramid_levels(img) AS levels, count(*), bool_and(data_range(img, 0, 1 << 30) = data_range(image_new(512, 384, '#336699'), 0, 1 << 30)) AS bytes, bool_and(digest(img) = digest(image_new(512, 384, '#336699'))) AS digest FROM pyramids GROUP BY 1 ORDER BY 1;
+DROP TABLE pyramids;
+-- byte ranges
+SELECT data_range(img, 0, 2) AS soi FROM imgs WHERE name = 'landscape';
+SELECT length(data_range(img, 0, 1 << 30)) = data_length(img) AS whole, length(data_range(img, data_length(img), 10)) AS past_end FROM imgs WHERE name = 'landscape';
+SELECT data_range(img, -1, 2) FROM imgs WHERE name = 'landscape';
+-- type modifiers
+CREATE TABLE bounded ( a image(100, 100), b image(64, 64, png), c image(300, 300, Jpeg, 50) );
+SELECT attname, format_type(atttypid, atttypmod) FROM pg_attribute WHERE attrelid = 'bounded'::regclass AND attnum > 0 ORDER BY attnum;
+INSERT INTO bounded VALUES (image_new(400, 200, '#336699'), image_new(32, 48, '#336699'), image_new(250, 300, '#336699'));
+SELECT width(a), height(a), format(a) FROM bounded;
+SELECT width(b), height(b), format(b) FROM bounded;
+SELECT width(c), height(c), format(c), digest(c) = digest(image_new(250, 300, '#336699')) AS untouched FROM bounded;
+SELECT width(i), height(i) FROM (SELECT image_new(90, 300, '#336699')::image(60, 60) AS i) s;
+-- lossless optimization
+SELECT name, data_length(optimize(img)) <= data_length(img) AS smaller, tensor(optimize(img, true, true), 16, 16) = tensor(img, 16, 16) AS same_pixels FROM imgs ORDER BY name;
+SELECT data_length(optimize(b)) <= data_length(b) AS smaller, tensor(optimize(b, true), 16, 16) = tensor(b, 16, 16) AS same_pixels FROM bounded;
+SELECT name, r.bytes_in = data_length(img) AS bytes_in, r.bytes_out = data_length(r.optimized) AS bytes_out, r.bytes_out <= r.bytes_in AS smaller FROM imgs, optimize_report(img) r ORDER BY name;
+-- strip keeps the EXIF orientation: an 8x4 gray JPEG shown rotated by 90 degrees
+CREATE TABLE oriented AS SELECT image_from_bytea(decode('ffd8ffe1002e45786966000049492a000800000002000f010200040000007070630012010300010000000600000000000000fffe0009706f7374706963ffdb004300080606070605080707070909080a0c140d0c0b0b0c1912130f141d1a1f1e1d1a1c1c20242e2720222c231c1c2837292c30313434341f27393d38323c2e333432ffc0000b080004000801011100ffc40014000100000000000000000000000000000007ffc40014100100000000000000000000000000000000ffda0008010100003f00487fffd9', 'hex')) AS img;
+SELECT orientation(img), r.bytes_in, r.bytes_out < r.bytes_in AS smaller, orientation(image_from_bytea(data_range(r.optimized, 0, data_length(r.optimized)))) AS stripped FROM oriented, optimize_report(img, true) r;
+DROP TABLE oriented;
+DROP TABLE bounded;
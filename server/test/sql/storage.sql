@@ -0,0 +1,71 @@
+--
+-- Deduplicated storage and statistics
+--
+CREATE TABLE photos ( id INT, photo image );
+CREATE TRIGGER photos_dedup BEFORE INSERT OR UPDATE OR DELETE ON photos
+	FOR EACH ROW EXECUTE PROCEDURE postpic_dedup('photo');
+INSERT INTO photos SELECT 1, img FROM imgs WHERE name = 'landscape';
+INSERT INTO photos SELECT 2, img FROM imgs WHERE name = 'landscape';
+INSERT INTO photos SELECT 3, img FROM imgs WHERE name = 'portrait';
+SELECT count(*) AS blobs, sum(refs) AS refs FROM postpic_blobs;
+-- detached values read back the same bytes
+SELECT p.id, deduplicated(p.photo), width(p.photo), digest(p.photo) = digest(i.img) AS same,
+	data_range(p.photo, 0, 2) AS soi, data_length(p.photo) = data_length(i.img) AS length
+	FROM photos p JOIN imgs i ON i.name = CASE WHEN p.id < 3 THEN 'landscape' ELSE 'portrait' END
+	ORDER BY p.id;
+SELECT id, width(thumbnail(photo, 20)) AS thumb, photo::text = i.img::text AS text
+	FROM photos p, imgs i WHERE i.name = 'landscape' AND p.id = 1;
+UPDATE photos SET id = 4 WHERE id = 2;
+SELECT count(*) AS blobs, sum(refs) AS refs FROM postpic_blobs;
+DELETE FROM photos WHERE id IN (1, 4);
+SELECT postpic_gc();
+SELECT count(*) AS blobs, sum(refs) AS refs FROM postpic_blobs;
+-- values copied where no trigger counts them still keep their image
+CREATE TABLE copies AS SELECT id, photo FROM photos;
+DELETE FROM photos;
+SELECT postpic_gc();
+SELECT id, deduplicated(photo), width(photo) FROM copies;
+DROP TABLE copies;
+SELECT postpic_gc();
+-- with a pyramid trailing it, the encoded image alone goes to postpic_blobs
+INSERT INTO photos VALUES (5, pyramid(image_new(512, 384, '#336699'), 2));
+SELECT deduplicated(photo), pyramid_levels(photo) AS levels, data_length(photo) = data_length(image_new(512, 384, '#336699')) AS length, data_range(photo, 0, 1 << 30) = data_range(image_new(512, 384, '#336699'), 0, 1 << 30) AS bytes FROM photos;
+SELECT count(*) AS blobs, bool_and(data = data_range(image_new(512, 384, '#336699'), 0, 1 << 30)) AS exact FROM postpic_blobs;
+DELETE FROM photos;
+SELECT postpic_gc();
+-- without any right on postpic_blobs, the trigger and readers still work
+CREATE ROLE regress_postpic;
+GRANT ALL ON photos TO regress_postpic;
+SET ROLE regress_postpic;
+INSERT INTO photos VALUES (6, image_new(40, 30, '#336699'));
+SELECT id, deduplicated(photo), width(thumbnail(photo, 20)) AS thumb FROM photos;
+SELECT has_table_privilege('postpic_blobs', 'SELECT') AS blobs, has_function_privilege('postpic_gc()', 'EXECUTE') AS gc;
+DELETE FROM photos;
+RESET ROLE;
+SELECT postpic_gc();
+REVOKE ALL ON photos FROM regress_postpic;
+DROP ROLE regress_postpic;
+-- the trigger refuses columns that aren't images
+CREATE TABLE notes ( id INT, body TEXT );
+CREATE TRIGGER notes_dedup BEFORE INSERT ON notes
+	FOR EACH ROW EXECUTE PROCEDURE postpic_dedup('body');
+INSERT INTO notes VALUES (1, 'text');
+DROP TABLE notes;
+DROP TABLE photos;
+-- statistics count this database's calls, once preloaded
+CREATE TEMP VIEW width_calls AS
+	SELECT COALESCE(sum(calls), 0) AS calls,
+		current_setting('shared_preload_libraries') ~ 'postpic' AS preloaded
+	FROM pg_stat_postpic
+	WHERE operation = 'width(image)';
+SELECT postpic_stats_reset();
+SET postpic.track_stats = off;
+SELECT count(width(img)) FROM imgs WHERE name IN ('landscape', 'portrait');
+SELECT calls AS untracked FROM width_calls;
+SET postpic.track_stats = on;
+SELECT count(width(img)) FROM imgs WHERE name IN ('landscape', 'portrait');
+SELECT calls = CASE WHEN preloaded THEN 2 ELSE 0 END AS counted FROM width_calls;
+SELECT postpic_stats_reset();
+SELECT calls AS reset FROM width_calls;
+DROP VIEW width_calls;
+DROP TABLE imgs;